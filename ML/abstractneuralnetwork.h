@@ -32,6 +32,10 @@ public:
       */
     virtual bool init(const QString& modelFile, const QString& labelsFile, const QString& configurationFile) = 0;
     virtual bool setInputImage(QVideoFrame& input, bool flip) = 0;
+    // image already converted for the network, results are reported in frameSize coordinates
+    virtual bool setInputImage(const QImage& input, const QSize& frameSize) = 0;
+    // size of the network input tensor
+    virtual QSize inputSize() const = 0;
     virtual bool process() = 0;
     virtual NeuralNetworksBackend type() = 0;
 
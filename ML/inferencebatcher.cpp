@@ -0,0 +1,94 @@
+#include "inferencebatcher.h"
+
+#include <QDeadlineTimer>
+#include <QDebug>
+#include <QHash>
+
+#include <common/latencyhistogram.h>
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+std::shared_ptr<InferenceBatcher> InferenceBatcher::shared(const QString &modelFile, const QString &labelsFile,
+                                                           int maxBatchSize)
+{
+    static QMutex mutex;
+    static QHash<QString, std::weak_ptr<InferenceBatcher>> batchers;
+
+    QMutexLocker locker(&mutex);
+    std::shared_ptr<InferenceBatcher> result = batchers.value(modelFile).lock();
+    if (!result) {
+        result = std::make_shared<InferenceBatcher>();
+        if (!result->init(modelFile, labelsFile, maxBatchSize))
+            return result;
+        batchers.insert(modelFile, result);
+    }
+    return result;
+}
+
+bool InferenceBatcher::init(const QString &modelFile, const QString &labelsFile, int maxBatchSize)
+{
+    // the TPU context is shared with the unbatched networks of the same model
+    m_network.setSharedModel(true);
+    if (!m_network.init(modelFile, labelsFile, ""))
+        return false;
+    const int size = m_network.setBatchSize(maxBatchSize);
+    qInfo() << "Batching inferences of" << modelFile << "by" << size;
+    return true;
+}
+
+PipelineFuture<InferenceBatcher::Result> InferenceBatcher::infer(const QImage &image, const QSize &frameSize)
+{
+    Request request { image, frameSize, {}, LatencyHistogram::now() };
+    PipelineFuture<Result> future = request.promise.future();
+    if (!initialized()) {
+        request.promise.setValue(std::nullopt);
+        return future;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_pending.push_back(std::move(request));
+    m_arrived.wakeOne();
+    if (!std::exchange(m_scheduled, true))
+        m_network.acceleratorQueue()->post([this]() { runBatch(); });
+    return future;
+}
+
+void InferenceBatcher::runBatch()
+{
+    const int size = m_network.batchSize();
+    std::vector<Request> batch;
+    {
+        QMutexLocker locker(&m_mutex);
+        // fill the batch until the oldest request reaches its deadline
+        const qint64 deadline = m_pending.front().arrival + qint64(m_maxDelay) * 1000;
+        while (int(m_pending.size()) < size) {
+            const qint64 left = deadline - LatencyHistogram::now();
+            if (left <= 0 || !m_arrived.wait(&m_mutex, QDeadlineTimer(std::chrono::nanoseconds(left), Qt::PreciseTimer)))
+                break;
+        }
+        const int count = std::min(int(m_pending.size()), size);
+        for (int i = 0; i < count; ++i) {
+            batch.push_back(std::move(m_pending.front()));
+            m_pending.pop_front();
+        }
+        // requests which didn't fit go in the next batch, queued behind this one
+        m_scheduled = !m_pending.empty();
+        if (m_scheduled)
+            m_network.acceleratorQueue()->post([this]() { runBatch(); });
+    }
+
+    std::vector<Result> results(batch.size());
+    bool ok = true;
+    for (size_t i = 0; i < batch.size() && ok; ++i)
+        ok = m_network.setInputImage(int(i), batch[i].image, batch[i].frameSize);
+    if (ok && m_network.process()) {
+        for (size_t i = 0; i < batch.size(); ++i)
+            results[i] = m_network.results(int(i));
+    }
+
+    /* The callers may be gone right after, nothing touches this from here */
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i].promise.setValue(std::move(results[i]));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+
+#include "tensorflowtpuneuralnetwork.h"
+
+#include <common/pipelinecoroutine.h>
+
+/*
+ * Collects the images the TensorFlow filters of all cameras (and consecutive
+ * frames or crops of one) want to run through the same model and runs them
+ * as one batch: the input tensor is resized to maxBatchSize images, filled and
+ * invoked once, the results go back to every caller's future.
+ *
+ * A batch starts once a request is waiting and the accelerator thread is
+ * free. It takes the requests arriving until it is full or its oldest request
+ * has waited maxDelay, so under load the per inference overhead is paid once
+ * per batch and a single camera waits maxDelay at most. A batch not filled up
+ * runs with the rest of the input unused, only time the accelerator would be
+ * idle otherwise. Models without a batch dimension run the batch one image at
+ * a time.
+ */
+class InferenceBatcher
+{
+public:
+    using Result = std::optional<QList<DetectionResult>>;
+
+    // filters using the same model share one batcher while any of them is alive
+    static std::shared_ptr<InferenceBatcher> shared(const QString &modelFile, const QString &labelsFile, int maxBatchSize);
+
+    InferenceBatcher() = default;
+
+    bool init(const QString &modelFile, const QString &labelsFile, int maxBatchSize);
+    bool initialized() const { return m_network.initialized(); }
+    QSize inputSize() const { return m_network.inputSize(); }
+    // images per inference, 1 if the model has a fixed batch size
+    int batchSize() const { return m_network.batchSize(); }
+
+    // us
+    int maxDelay() const { return m_maxDelay; }
+    void setMaxDelay(int us) { m_maxDelay = std::max(us, 0); }
+
+    // image converted for the network, results in frameSize coordinates
+    PipelineFuture<Result> infer(const QImage &image, const QSize &frameSize);
+
+private:
+    Q_DISABLE_COPY(InferenceBatcher)
+
+    struct Request {
+        QImage image;
+        QSize frameSize;
+        PipelinePromise<Result> promise;
+        qint64 arrival = 0;
+    };
+
+    // accelerator thread
+    void runBatch();
+
+    TensorFlowTPUNeuralNetwork m_network;
+    std::atomic<int> m_maxDelay { 2000 };
+
+    QMutex m_mutex;
+    QWaitCondition m_arrived;
+    std::deque<Request> m_pending;
+    // a runBatch() job is posted
+    bool m_scheduled = false;
+};
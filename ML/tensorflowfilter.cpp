@@ -1,12 +1,53 @@
 #include "tensorflowfilter.h"
 
+#include <algorithm>
+#include <vector>
+
+namespace {
+// results of a crop into full frame coordinates
+void appendCropResults(const QList<DetectionResult> &cropResults, const QRect &region, QList<DetectionResult> *results)
+{
+    for (DetectionResult result : cropResults) {
+        result.objectRect.translate(region.topLeft());
+        results->append(result);
+    }
+}
+}
+
+FilterResult::FilterResult(QObject *parent)
+    : QObject{parent}
+{
+    m_snapshot = &m_buffer.latest();
+}
+
+bool FilterResult::refresh()
+{
+    const quint64 sequence = m_snapshot->sequence;
+    m_snapshot = &m_buffer.latest();
+    return m_snapshot->sequence != sequence;
+}
+
 TensorFlowFilter::TensorFlowFilter(QObject *parent)
-    : AbstractVideoFilter{parent}
+    : TensorFlowFilter{OwnModel, parent}
+{
+}
+
+TensorFlowFilter::TensorFlowFilter(ModelSharing sharing, QObject *parent)
+    : AsyncVideoFilter{parent}
 {
+    setMaxFramesInFlight(2);
+    m_neuralNetwork.setSharedModel(sharing == SharedModel);
+
     const auto modelName = qgetenv("TF2_MODEL");
     const auto modelLabelsName = qgetenv("TF2_MODEL_LABELS");
 
-    m_neuralNetwork.init(modelName, modelLabelsName, "");
+    if (sharing == BatchedModel) {
+        const int batchSize = qEnvironmentVariableIsSet("TF2_MODEL_BATCH") ? qEnvironmentVariableIntValue("TF2_MODEL_BATCH")
+                                                                           : kDefaultBatchSize;
+        m_batcher = InferenceBatcher::shared(modelName, modelLabelsName, batchSize);
+    } else {
+        m_neuralNetwork.init(modelName, modelLabelsName, "");
+    }
     m_filterResult = new FilterResult;
 }
 
@@ -15,27 +56,150 @@ TensorFlowFilter::~TensorFlowFilter()
     delete m_filterResult;
 }
 
-QVideoFrame TensorFlowFilter::run(QVideoFrame *input)
+FrameRequirements TensorFlowFilter::requirements() const
+{
+    // the network resizes its input anyway, so there is no point to convert
+    // more pixels than twice the input tensor size
+    FrameRequirements req { QImage::Format_RGB888, QSize(), QRect() };
+    if (networkInitialized())
+        req.maxSize = networkInputSize() * 2;
+    return req;
+}
+
+bool TensorFlowFilter::networkInitialized() const
+{
+    return m_batcher ? m_batcher->initialized() : m_neuralNetwork.initialized();
+}
+
+QSize TensorFlowFilter::networkInputSize() const
+{
+    return m_batcher ? m_batcher->inputSize() : m_neuralNetwork.inputSize();
+}
+
+QList<QRect> TensorFlowFilter::cropRegions(const VideoFilterFrame *input) const
+{
+    // regions an analysis filter upstream found changed, e.g. the background
+    // filter blobs. Each is grown to at least the network input, crops more
+    // than that are scaled down anyway
+    const QList<QRect> regions = input->regionsOfInterest();
+    if (regions.isEmpty() || regions.size() > kMaxCrops)
+        return {};
+
+    const QRect frameRect(QPoint(0, 0), input->size());
+    const QSize minimum = networkInputSize().boundedTo(frameRect.size());
+    QList<QRect> crops;
+    for (const QRect &region : regions) {
+        QRect crop(QPoint(0, 0), region.size().expandedTo(minimum));
+        crop.moveCenter(region.center());
+        // moved back inside the frame rather than clipped
+        crop.moveLeft(std::clamp(crop.left(), 0, frameRect.width() - crop.width()));
+        crop.moveTop(std::clamp(crop.top(), 0, frameRect.height() - crop.height()));
+        crop &= frameRect;
+        // overlapping crops are merged, objects on the seam would be cut in two
+        for (int i = 0; i < crops.size();) {
+            if (crops.at(i).intersects(crop)) {
+                crop |= crops.takeAt(i);
+                i = 0;
+            } else {
+                ++i;
+            }
+        }
+        crops.append(crop);
+    }
+
+    // the whole frame is cheaper than crops covering most of it
+    qint64 area = 0;
+    for (const QRect &crop : std::as_const(crops))
+        area += qint64(crop.width()) * crop.height();
+    if (area * 2 > qint64(frameRect.width()) * frameRect.height())
+        return {};
+    return crops;
+}
+
+PipelineTask<QVideoFrame> TensorFlowFilter::process(std::shared_ptr<VideoFilterFrame> input)
 {
-    if (!m_neuralNetwork.initialized()) {
-        return *input;
+    if (!networkInitialized()) {
+        co_return input->videoFrame();
     }
 
-    m_neuralNetwork.setInputImage(*input, false);
-    if (m_neuralNetwork.process()) {
-        m_filterResult->clear();
-        const QList<DetectionResult>& results = m_neuralNetwork.results();
-        for (int i = 0; i < results.size(); ++i) {
-            DetectionResult res = results.at(i);
-            m_filterResult->m_masks.append(res.mask);
-            m_filterResult->m_names.append(res.label);
-            m_filterResult->m_confidences.append(res.confidence);
-            m_filterResult->m_rects.append(res.objectRect);
-            m_filterResult->m_colors.append(res.color);
+    // converted on the pipeline worker, the worker is free while the TPU runs.
+    // Without regions of interest the whole frame is one crop
+    const QSize frameSize = input->size();
+    QList<std::pair<QImage, QRect>> crops;
+    const QList<QRect> regions = cropRegions(input.get());
+    if (regions.isEmpty()) {
+        crops.append({ input->image(requirements()), QRect(QPoint(0, 0), frameSize) });
+    } else {
+        FrameRequirements req = requirements();
+        for (const QRect &region : regions) {
+            req.roi = region;
+            crops.append({ input->image(req), region });
         }
     }
-    Q_EMIT processingFinished(m_filterResult);
-    return *input;
+
+    std::optional<QList<DetectionResult>> results;
+    if (m_batcher) {
+        // every crop is an entry of a batch, together with the frames of the other cameras
+        std::vector<PipelineFuture<InferenceBatcher::Result>> futures;
+        for (const auto &[image, region] : crops)
+            futures.push_back(m_batcher->infer(image, region.size()));
+        results.emplace();
+        for (size_t i = 0; i < futures.size(); ++i) {
+            const InferenceBatcher::Result cropResults = co_await futures[i];
+            if (!cropResults) {
+                results.reset();
+                break;
+            }
+            appendCropResults(*cropResults, crops.at(i).second, &*results);
+        }
+    } else {
+        results = co_await m_neuralNetwork.acceleratorQueue()->run([this, crops]() -> std::optional<QList<DetectionResult>> {
+            QList<DetectionResult> results;
+            for (const auto &[image, region] : crops) {
+                if (!m_neuralNetwork.setInputImage(image, region.size()) || !m_neuralNetwork.process())
+                    return std::nullopt;
+                appendCropResults(m_neuralNetwork.results(), region, &results);
+            }
+            return results;
+        });
+    }
+    if (results)
+        publishResults(*results, input.get());
+    co_return input->videoFrame();
+}
+
+void TensorFlowFilter::publishResults(const QList<DetectionResult> &results, const VideoFilterFrame *input)
+{
+    quint64 last = m_lastPublished.load();
+    do {
+        if (input->sequence() < last)
+            return;
+    } while (!m_lastPublished.compare_exchange_weak(last, input->sequence()));
+
+    m_filterResult->m_buffer.publish([&](DetectionResults &next, const DetectionResults &) {
+        // reuses the lists of an older result
+        next.masks.clear();
+        next.names.clear();
+        next.confidences.clear();
+        next.rects.clear();
+        next.colors.clear();
+        for (const DetectionResult &res : results) {
+            next.masks.append(res.mask);
+            next.names.append(res.label);
+            next.confidences.append(res.confidence);
+            next.rects.append(input->mapToFullFrame(res.objectRect));
+            next.colors.append(res.color);
+        }
+        return true;
+    });
+    QMetaObject::invokeMethod(this, &TensorFlowFilter::deliverResult, Qt::QueuedConnection);
+}
+
+void TensorFlowFilter::deliverResult()
+{
+    // several queued calls pin the same latest result, notify once
+    if (m_filterResult->refresh())
+        Q_EMIT processingFinished(m_filterResult);
 }
 
 FilterResult *TensorFlowFilter::filterResult() const
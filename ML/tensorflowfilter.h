@@ -3,60 +3,106 @@
 #include <QObject>
 #include <QVideoFrame>
 #include <QVariantList>
-#include "abstractvideofilter.h"
+#include "asyncvideofilter.h"
+#include "inferencebatcher.h"
 #include "tensorflowtpuneuralnetwork.h"
 
+#include <common/snapshotbuffer.h>
+
 class TensorFlowFilter;
 
+struct DetectionResults
+{
+    QVariantList rects;
+    QVariantList confidences;
+    QStringList names;
+    QList<QImage> masks;
+    QList<QColor> colors;
+};
+
+/*
+ * Detections exposed to QML. The filter publishes every result into a
+ * snapshot buffer from the pipeline threads, the object pins the latest one
+ * on the GUI thread, so all the getters return the same, complete result.
+ */
 class FilterResult : public QObject
 {
     Q_OBJECT
 
 public:
-    void clear()
-    {
-        m_rects.clear();
-        m_confidences.clear();
-        m_names.clear();
-        m_masks.clear();
-        m_colors.clear();
-    }
+    explicit FilterResult(QObject *parent = nullptr);
+
+    // pins the latest published result, returns false if it is already pinned
+    bool refresh();
+    const SnapshotBuffer<DetectionResults>::Snapshot &snapshot() const { return *m_snapshot; }
 
 public Q_SLOTS:
 
-    QVariantList rects() const { return m_rects; }
-    QVariantList confidences() const { return m_confidences; }
-    QStringList names() const { return m_names; }
-    QList<QImage> masks() const  { return m_masks; }
-    QList<QColor> colors() const  { return m_colors; }
+    quint64 sequence() const { return m_snapshot->sequence; }
+    QVariantList rects() const { return m_snapshot->value.rects; }
+    QVariantList confidences() const { return m_snapshot->value.confidences; }
+    QStringList names() const { return m_snapshot->value.names; }
+    QList<QImage> masks() const  { return m_snapshot->value.masks; }
+    QList<QColor> colors() const  { return m_snapshot->value.colors; }
 
 private:
-    QVariantList m_rects;
-    QVariantList m_confidences;
-    QStringList m_names;
-    QList<QImage> m_masks;
-    QList<QColor> m_colors;
+    SnapshotBuffer<DetectionResults> m_buffer;
+    const SnapshotBuffer<DetectionResults>::Snapshot *m_snapshot = nullptr;
     friend class TensorFlowFilter;
 };
 
-class TensorFlowFilter: public AbstractVideoFilter
+/*
+ * Runs the network on the accelerator thread of its model, two frames are in
+ * flight by default: the next frame gets converted while the TPU works.
+ */
+class TensorFlowFilter: public AsyncVideoFilter
 {
     Q_OBJECT
     Q_PROPERTY(FilterResult *filterResult READ filterResult CONSTANT FINAL)
 
 public:
+    enum ModelSharing {
+        // the filter loads its own model
+        OwnModel,
+        // filters of all cameras share the read-only model and the TPU context
+        SharedModel,
+        // filters of all cameras share one interpreter running their frames in
+        // batches of TF2_MODEL_BATCH images, see InferenceBatcher
+        BatchedModel,
+    };
+
     explicit TensorFlowFilter(QObject *parent = nullptr);
+    explicit TensorFlowFilter(ModelSharing sharing, QObject *parent = nullptr);
     ~TensorFlowFilter() override;
 
     FilterResult *filterResult() const;
 
+    FrameRequirements requirements() const override;
+
 Q_SIGNALS:
     void processingFinished(FilterResult * result);
 
+protected:
+    PipelineTask<QVideoFrame> process(std::shared_ptr<VideoFilterFrame> input) override;
+
 private:
-    QVideoFrame run(QVideoFrame *input) override;
+    // more regions of interest than this and the whole frame is processed
+    static constexpr int kMaxCrops = 4;
+    // images per inference of a BatchedModel without TF2_MODEL_BATCH
+    static constexpr int kDefaultBatchSize = 4;
+
+    bool networkInitialized() const;
+    QSize networkInputSize() const;
+    QList<QRect> cropRegions(const VideoFilterFrame *input) const;
+    void publishResults(const QList<DetectionResult> &results, const VideoFilterFrame *input);
+    void deliverResult();
+
     TensorFlowTPUNeuralNetwork m_neuralNetwork;
+    // set for BatchedModel, m_neuralNetwork isn't used then
+    std::shared_ptr<InferenceBatcher> m_batcher;
     FilterResult* m_filterResult = nullptr;
+    // frames finish out of order now and then, don't publish older results
+    std::atomic<quint64> m_lastPublished { 0 };
 };
 
 Q_DECLARE_METATYPE(FilterResult*)
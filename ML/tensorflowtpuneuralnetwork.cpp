@@ -5,7 +5,45 @@
 
 #include <QFile>
 #include <QDebug>
+#include <QHash>
 #include <QMatrix4x4>
+#include <QMutex>
+
+#include <algorithm>
+
+std::shared_ptr<TensorFlowModel> TensorFlowModel::load(const QString &modelFile)
+{
+    auto result = std::make_shared<TensorFlowModel>();
+    result->model = FlatBufferModel::BuildFromFile(modelFile.toLatin1().data(), DefaultErrorReporter());
+    if (result->model == nullptr) {
+        qWarning() << "TensorFlow model loading: ERROR";
+        return nullptr;
+    }
+    edgetpu::EdgeTpuManager::GetSingleton()->SetVerbosity(0);
+
+    result->tpuContext = edgetpu::EdgeTpuManager::GetSingleton()->OpenDevice();
+    if (result->tpuContext == nullptr) {
+        qWarning() << "Cant acqure TensorFlow TPU context";
+        return nullptr;
+    }
+    result->queue = std::make_shared<AcceleratorQueue>("edgetpu");
+    return result;
+}
+
+std::shared_ptr<TensorFlowModel> TensorFlowModel::shared(const QString &modelFile)
+{
+    static QMutex mutex;
+    static QHash<QString, std::weak_ptr<TensorFlowModel>> models;
+
+    QMutexLocker locker(&mutex);
+    std::shared_ptr<TensorFlowModel> result = models.value(modelFile).lock();
+    if (!result) {
+        result = load(modelFile);
+        if (result)
+            models.insert(modelFile, result);
+    }
+    return result;
+}
 
 bool TensorFlowTPUNeuralNetwork::cocoReadLabels(const QString& fileName)
 {
@@ -49,36 +87,6 @@ std::unique_ptr<tflite::Interpreter> BuildEdgeTpuInterpreter(
     return interpreter;
 }
 
-bool TensorFlowTPUNeuralNetwork::getClassfierOutputsTFLite(std::vector<std::pair<float, int>> *top_results)
-{
-    const int    output_size = 1000;
-    const size_t num_results = 5;
-
-    // Assume one output
-    if (m_interpreter->outputs().size() > 0) {
-        int output = m_interpreter->outputs()[0];
-
-        switch (m_interpreter->tensor(output)->type) {
-        case kTfLiteFloat32: {
-            get_top_n<float>(m_interpreter->typed_output_tensor<float>(0), output_size,
-                                                  num_results, m_threshold, top_results, true);
-            break;
-        }
-        case kTfLiteUInt8: {
-            get_top_n<uint8_t>(m_interpreter->typed_output_tensor<uint8_t>(0),
-                                                    output_size, num_results, m_threshold, top_results,false);
-            break;
-        }
-        default: {
-            qDebug() << "Cannot handle output type" << m_interpreter->tensor(output)->type << "yet";
-            return false;
-        }
-        }
-        return true;
-    }
-    return false;
-}
-
 template<typename T>
 T* TensorData(TfLiteTensor* tensor, int batch_index);
 
@@ -97,7 +105,7 @@ float* TensorData(TfLiteTensor* tensor, int batch_index) {
 
 template<>
 uint8_t* TensorData(TfLiteTensor* tensor, int batch_index) {
-    int nelems = 0;
+    int nelems = 1;
     for (int i = 1; i < tensor->dims->size; i++) nelems *= tensor->dims->data[i];
     switch (tensor->type) {
     case kTfLiteUInt8:
@@ -108,6 +116,36 @@ uint8_t* TensorData(TfLiteTensor* tensor, int batch_index) {
     return nullptr;
 }
 
+bool TensorFlowTPUNeuralNetwork::getClassfierOutputsTFLite(int batchIndex, std::vector<std::pair<float, int>> *top_results)
+{
+    const int    output_size = 1000;
+    const size_t num_results = 5;
+
+    // Assume one output
+    if (m_interpreter->outputs().size() > 0) {
+        int output = m_interpreter->outputs()[0];
+
+        switch (m_interpreter->tensor(output)->type) {
+        case kTfLiteFloat32: {
+            get_top_n<float>(TensorData<float>(outputs[0], batchIndex), output_size,
+                                                  num_results, m_threshold, top_results, true);
+            break;
+        }
+        case kTfLiteUInt8: {
+            get_top_n<uint8_t>(TensorData<uint8_t>(outputs[0], batchIndex),
+                                                    output_size, num_results, m_threshold, top_results,false);
+            break;
+        }
+        default: {
+            qDebug() << "Cannot handle output type" << m_interpreter->tensor(output)->type << "yet";
+            return false;
+        }
+        }
+        return true;
+    }
+    return false;
+}
+
 template <class T>
 void formatImageTFLite(T* out, const uint8_t* in,
                        int image_height, int image_width, int image_channels,
@@ -171,13 +209,12 @@ void formatImageTFLite(T* out, const uint8_t* in,
     }
 }
 
-bool TensorFlowTPUNeuralNetwork::setInputsTFLite(const QImage& image)
+bool TensorFlowTPUNeuralNetwork::setInputsTFLite(const QImage& image, int batchIndex)
 {
+    // entries of a batch follow each other in the input tensor
+    const int batchOffset = batchIndex * wanted_height * wanted_width * wanted_channels;
     // Get inputs
     std::vector<int> inputs = m_interpreter->inputs();
-    // Store original image properties
-    img_width    = image.width();
-    img_height   = image.height();
     img_channels = 3;
     // Set inputs
     for(unsigned int i=0; i<m_interpreter->inputs().size(); i++) {
@@ -187,7 +224,7 @@ bool TensorFlowTPUNeuralNetwork::setInputsTFLite(const QImage& image)
         switch (m_interpreter->tensor(input)->type) {
         case kTfLiteFloat32:
         {
-            formatImageTFLite<float>(m_interpreter->typed_tensor<float>(input), image.bits(),
+            formatImageTFLite<float>(m_interpreter->typed_tensor<float>(input) + batchOffset, image.bits(),
                                      image.height(), image.width(), img_channels,
                                      wanted_height, wanted_width, wanted_channels, true);
             //formatImageQt<float>(interpreter->typed_tensor<float>(input),image,img_channels,
@@ -196,8 +233,8 @@ bool TensorFlowTPUNeuralNetwork::setInputsTFLite(const QImage& image)
         }
         case kTfLiteUInt8:
         {
-            formatImageTFLite<uint8_t>(m_interpreter->typed_tensor<uint8_t>(input),image.bits(),
-                                       img_height, img_width, img_channels,
+            formatImageTFLite<uint8_t>(m_interpreter->typed_tensor<uint8_t>(input) + batchOffset, image.bits(),
+                                       image.height(), image.width(), img_channels,
                                        wanted_height, wanted_width, wanted_channels, false);
 
             //formatImageQt<uint8_t>(interpreter->typed_tensor<uint8_t>(input),image,img_channels,
@@ -225,15 +262,17 @@ QImage rotateImage(QImage img, double rotation)
     return img.transformed(matrix);
 }
 
-bool TensorFlowTPUNeuralNetwork::getObjectOutputsTFLite()
+bool TensorFlowTPUNeuralNetwork::getObjectOutputsTFLite(int batchIndex, QList<DetectionResult> *results)
 {
     if (outputs.size() >= 4) {
-        const int    num_detections    = *TensorData<float>(outputs[3], 0);
-        const float* detection_classes =  TensorData<float>(outputs[1], 0);
-        const float* detection_scores  =  TensorData<float>(outputs[2], 0);
-        const float* detection_boxes   =  TensorData<float>(outputs[0], 0);
+        const int    num_detections    = *TensorData<float>(outputs[3], batchIndex);
+        const float* detection_classes =  TensorData<float>(outputs[1], batchIndex);
+        const float* detection_scores  =  TensorData<float>(outputs[2], batchIndex);
+        const float* detection_boxes   =  TensorData<float>(outputs[0], batchIndex);
         const float* detection_masks   =  /*!has_detection_masks || */outputs.size() < 5 ?
-                    nullptr : TensorData<float>(outputs[4], 0);
+                    nullptr : TensorData<float>(outputs[4], batchIndex);
+        const int img_width  = m_frameSizes.value(batchIndex).width();
+        const int img_height = m_frameSizes.value(batchIndex).height();
 
         const auto ck = (float)m_classes.size() / (float)QColor::colorNames().size();
         for (int i = 0; i < num_detections; i++) {
@@ -288,7 +327,7 @@ bool TensorFlowTPUNeuralNetwork::getObjectOutputsTFLite()
             det_result.label = label;
             det_result.confidence = score;
             det_result.objectRect = box;
-            m_results.append(det_result);
+            results->append(det_result);
         }
 
         return true;
@@ -305,22 +344,13 @@ bool TensorFlowTPUNeuralNetwork::init(const QString &modelFile, const QString &l
     m_initialized = false;
     Q_UNUSED(configurationFile)
     try {
-        // Open model & assign error reporter
-        m_model = FlatBufferModel::BuildFromFile(modelFile.toLatin1().data(), &error_reporter);
-
-        if(m_model == nullptr) {
-            qWarning() << "TensorFlow model loading: ERROR";
-            return false;
-        }
-        edgetpu::EdgeTpuManager::GetSingleton()->SetVerbosity(0);
-
-        m_tpuContext = edgetpu::EdgeTpuManager::GetSingleton()->NewEdgeTpuContext().release();
-        if (m_tpuContext == nullptr) {
-            qWarning() << "Cant acqure TensorFlow TPU context";
+        // Open model and the TPU
+        m_model = m_sharedModel ? TensorFlowModel::shared(modelFile) : TensorFlowModel::load(modelFile);
+        if (m_model == nullptr) {
             return false;
         }
 
-        m_interpreter = BuildEdgeTpuInterpreter(*m_model.get(), m_tpuContext);
+        m_interpreter = BuildEdgeTpuInterpreter(*m_model->model, m_model->tpuContext.get());
 
         if(m_interpreter->AllocateTensors() != kTfLiteOk) {
             qWarning() << "Allocate tensors: ERROR";
@@ -368,6 +398,8 @@ bool TensorFlowTPUNeuralNetwork::init(const QString &modelFile, const QString &l
         wanted_height   = dims->data[1];
         wanted_width    = dims->data[2];
         wanted_channels = dims->data[3];
+        m_batchSize = dims->data[0];
+        m_frameSizes.resize(m_batchSize);
 
 
         qDebug() << "Wanted height:"   << wanted_height;
@@ -411,7 +443,7 @@ bool TensorFlowTPUNeuralNetwork::setInputImage(QVideoFrame& input, bool flip)
         img = img.convertToFormat(QImage::Format_RGB888);
         //qDebug() << img.pixelFormat().channelCount();
         //img = rotateImage(img, -180);
-        setInputsTFLite(img);
+        return setInputImage(img, img.size());
     } else {
         qWarning() << "converted image not valid";
         return false;
@@ -419,29 +451,95 @@ bool TensorFlowTPUNeuralNetwork::setInputImage(QVideoFrame& input, bool flip)
     return true;
 }
 
+bool TensorFlowTPUNeuralNetwork::setInputImage(const QImage &input, const QSize &frameSize)
+{
+    if (input.isNull() || input.format() != QImage::Format_RGB888) {
+        qWarning() << "converted image not valid";
+        return false;
+    }
+    return setInputImage(0, input, frameSize);
+}
+
+bool TensorFlowTPUNeuralNetwork::setInputImage(int batchIndex, const QImage &input, const QSize &frameSize)
+{
+    if (input.isNull() || input.format() != QImage::Format_RGB888 || batchIndex < 0 || batchIndex >= m_batchSize) {
+        qWarning() << "converted image not valid";
+        return false;
+    }
+    // detection boxes are normalized, so report them in the original frame coordinates
+    m_frameSizes[batchIndex] = frameSize;
+    return setInputsTFLite(input, batchIndex);
+}
+
+int TensorFlowTPUNeuralNetwork::setBatchSize(int size)
+{
+    size = std::max(size, 1);
+    if (!m_interpreter || size == m_batchSize)
+        return m_batchSize;
+
+    const auto resize = [this](int batch) {
+        const int input = m_interpreter->inputs()[0];
+        if (m_interpreter->ResizeInputTensor(input, { batch, wanted_height, wanted_width, wanted_channels }) != kTfLiteOk
+            || m_interpreter->AllocateTensors() != kTfLiteOk) {
+            return false;
+        }
+        // every output needs a batch dimension to scatter the results
+        for (const int output : m_interpreter->outputs()) {
+            const TfLiteIntArray *dims = m_interpreter->tensor(output)->dims;
+            if (dims->size == 0 || dims->data[0] != batch)
+                return false;
+        }
+        return true;
+    };
+    if (!resize(size)) {
+        qWarning() << "The model doesn't support batches of" << size << "images, running them one by one";
+        if (!resize(1))
+            qWarning() << "Failed to restore the model input";
+        size = 1;
+    }
+
+    // the tensors were reallocated
+    outputs.clear();
+    for (const int output : m_interpreter->outputs())
+        outputs.push_back(m_interpreter->tensor(output));
+    m_batchSize = size;
+    m_frameSizes.resize(size);
+    return size;
+}
+
+QSize TensorFlowTPUNeuralNetwork::inputSize() const
+{
+    return QSize(wanted_width, wanted_height);
+}
+
 bool TensorFlowTPUNeuralNetwork::process()
 {
     if (m_interpreter->Invoke() != kTfLiteOk) {
         qDebug() << "Failed to invoke interpreter";
         return false;
     }
-    m_results.clear();
-    // Image classifier
-    if (m_networkType == TF_IMAGE_CLASSIFIER) {
-        std::vector<std::pair<float, int>> top_results;
-
-        getClassfierOutputsTFLite(&top_results);
+    m_batchResults.resize(m_batchSize);
+    for (int batchIndex = 0; batchIndex < m_batchSize; ++batchIndex) {
+        QList<DetectionResult> &results = m_batchResults[batchIndex];
+        results.clear();
+        // Image classifier
+        if (m_networkType == TF_IMAGE_CLASSIFIER) {
+            std::vector<std::pair<float, int>> top_results;
+
+            getClassfierOutputsTFLite(batchIndex, &top_results);
+
+            for (const auto& result : top_results) {
+                DetectionResult det_result;
+                det_result.label = m_classes.value(result.second);
+                det_result.confidence = result.first;
+                results.append(det_result);
+            }
+        } else if (m_networkType == TF_OBJECT_DETECTION) {             // Object detection
 
-        for (const auto& result : top_results) {
-            DetectionResult det_result;
-            det_result.label = m_classes.value(result.second);
-            det_result.confidence = result.first;
-            m_results.append(det_result);
+            getObjectOutputsTFLite(batchIndex, &results);
         }
-    } else if (m_networkType == TF_OBJECT_DETECTION) {             // Object detection
-
-        getObjectOutputsTFLite();
     }
+    m_results = m_batchResults.first();
     return true;
 }
 
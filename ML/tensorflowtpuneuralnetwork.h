@@ -12,6 +12,8 @@
 
 #include <edgetpu.h>
 
+#include <common/acceleratorqueue.h>
+
 #include <queue>
 
 template <class T>
@@ -61,6 +63,19 @@ template void get_top_n<float>(float*, int, size_t, float,
 
 using namespace tflite;
 
+// model weights and Edge TPU context, read-only once loaded
+struct TensorFlowModel
+{
+    std::unique_ptr<FlatBufferModel> model;
+    std::shared_ptr<edgetpu::EdgeTpuContext> tpuContext;
+    // thread the inferences on the TPU context are run from
+    std::shared_ptr<AcceleratorQueue> queue;
+
+    static std::shared_ptr<TensorFlowModel> load(const QString &modelFile);
+    // networks loading the same file share one instance while any of them is alive
+    static std::shared_ptr<TensorFlowModel> shared(const QString &modelFile);
+};
+
 class TensorFlowTPUNeuralNetwork : public AbstractNeuralNetwork
 {
 public:
@@ -73,34 +88,58 @@ public:
 
     TensorFlowTPUNeuralNetwork();
 
+    // share the model and the TPU context with other networks, call before init().
+    // Every network still has its own interpreter
+    void setSharedModel(bool shared) { m_sharedModel = shared; }
+
     bool init(const QString& modelFile, const QString& labelsFile, const QString& configurationFile) override;
     bool setInputImage(QVideoFrame &input, bool flip) override;
+    bool setInputImage(const QImage &input, const QSize &frameSize) override;
+    QSize inputSize() const override;
     bool process() override;
     NeuralNetworksBackend type() override;
 
+    /*
+     * Resizes the input tensor to a batch of size images, one Invoke() runs
+     * them all. Returns the batch size in effect: models with a fixed batch
+     * dimension (e.g. with the detection post-processing op) stay at 1.
+     */
+    int setBatchSize(int size);
+    int batchSize() const { return m_batchSize; }
+    // input image of one entry of the batch, results in frameSize coordinates
+    bool setInputImage(int batchIndex, const QImage &input, const QSize &frameSize);
+    // results of one entry of the batch after process()
+    using AbstractNeuralNetwork::results;
+    QList<DetectionResult> results(int batchIndex) const { return m_batchResults.value(batchIndex); }
+
+    // the network is only used from here once it is initialized
+    AcceleratorQueue *acceleratorQueue() const { return m_model ? m_model->queue.get() : nullptr; }
+
 private:
     QMap<int, QString> m_classes;
 
-    edgetpu::EdgeTpuContext* m_tpuContext = nullptr;
-    // Model
-    std::unique_ptr<FlatBufferModel> m_model;
+    bool m_sharedModel = false;
+    // Model and TPU context
+    std::shared_ptr<TensorFlowModel> m_model;
     // Resolver
     tflite::ops::builtin::BuiltinOpResolver m_resolver;
     // Interpreter
     std::unique_ptr<Interpreter> m_interpreter;
-    // Error reporter
-    StderrReporter error_reporter;
     // Outputs
     std::vector<TfLiteTensor*> outputs;
-    int wanted_height, wanted_width, wanted_channels;
-    int img_height, img_width, img_channels;
+    int wanted_height = 0, wanted_width = 0, wanted_channels = 0;
+    int img_channels;
+    int m_batchSize = 1;
+    // frame size of every entry of the batch
+    QList<QSize> m_frameSizes;
+    QList<QList<DetectionResult>> m_batchResults;
     TensorFlowNetworkType m_networkType;
     // Threshold
     double m_threshold = 0.6;
     // Configuration constants
     const double MASK_THRESHOLD = 0.3;
-    bool getObjectOutputsTFLite();
-    bool getClassfierOutputsTFLite(std::vector<std::pair<float, int> > *top_results);
+    bool getObjectOutputsTFLite(int batchIndex, QList<DetectionResult> *results);
+    bool getClassfierOutputsTFLite(int batchIndex, std::vector<std::pair<float, int> > *top_results);
     bool cocoReadLabels(const QString &fileName);
-    bool setInputsTFLite(const QImage &image);
+    bool setInputsTFLite(const QImage &image, int batchIndex);
 };
@@ -1,5 +1,7 @@
 #include "abstractvideofilter.h"
 
+#include <algorithm>
+
 AbstractVideoFilter::AbstractVideoFilter(QObject *parent) : QObject(parent) {}
 
 void AbstractVideoFilter::setActive(bool v)
@@ -8,3 +10,39 @@ void AbstractVideoFilter::setActive(bool v)
     Q_EMIT activeChanged();
 }
 
+void AbstractVideoFilter::setMaxRate(qreal rate)
+{
+    rate = std::max<qreal>(rate, 0.0);
+    if (qFuzzyCompare(m_maxRate, rate))
+        return;
+    m_maxRate = rate;
+    Q_EMIT maxRateChanged();
+}
+
+void AbstractVideoFilter::setDeadline(int ms)
+{
+    ms = std::max(ms, 0);
+    if (m_deadline == ms)
+        return;
+    m_deadline = ms;
+    Q_EMIT deadlineChanged();
+}
+
+void AbstractVideoFilter::addDependency(AbstractVideoFilter *filter)
+{
+    if (!filter || filter == this || m_dependencies.contains(filter))
+        return;
+    m_dependencies.append(filter);
+    connect(filter, &QObject::destroyed, this, [this, filter]() {
+        removeDependency(filter);
+    });
+    Q_EMIT dependenciesChanged();
+}
+
+void AbstractVideoFilter::removeDependency(AbstractVideoFilter *filter)
+{
+    if (m_dependencies.removeAll(filter) == 0)
+        return;
+    disconnect(filter, &QObject::destroyed, this, nullptr);
+    Q_EMIT dependenciesChanged();
+}
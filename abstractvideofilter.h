@@ -1,26 +1,100 @@
 #pragma once
 
+#include <QList>
 #include <QObject>
 #include <QVideoFrame>
 
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "videofilterframe.h"
+
 class AbstractVideoFilter : public QObject
 {
     Q_OBJECT
     Q_PROPERTY(bool active READ isActive WRITE setActive NOTIFY activeChanged)
+    Q_PROPERTY(FilterKind kind READ kind CONSTANT)
+    Q_PROPERTY(qreal maxRate READ maxRate WRITE setMaxRate NOTIFY maxRateChanged)
+    Q_PROPERTY(int deadline READ deadline WRITE setDeadline NOTIFY deadlineChanged)
 
 public:
+    enum FilterKind {
+        // only reads the frame, runs in parallel with other analysis filters
+        AnalysisFilter,
+        // returns a transformed frame, runs ahead of the filters depending on it.
+        // The output of the last active one replaces the captured frame in the
+        // video sink
+        ProcessingFilter,
+    };
+    Q_ENUM(FilterKind)
+
     explicit AbstractVideoFilter(QObject *parent = nullptr);
     virtual ~AbstractVideoFilter() = default;
 
     bool isActive() const { return m_active; }
     void setActive(bool v);
 
-    virtual QVideoFrame run(QVideoFrame *input) = 0;
+    virtual FilterKind kind() const { return AnalysisFilter; }
+
+    // frames per second an analysis filter runs at most, frames coming sooner
+    // pass through it untouched. Processing filters transform every frame, an
+    // untouched one would show up between the processed ones, they ignore it.
+    // 0 for no limit
+    qreal maxRate() const { return m_maxRate; }
+    void setMaxRate(qreal rate);
+
+    // ms from the frame capture the filter should be done by, the pipeline runs
+    // the filters of all cameras earliest deadline first. 0 for the maxRate
+    // interval, or 100 ms without a rate cap
+    int deadline() const { return m_deadline; }
+    void setDeadline(int ms);
+
+    // filters which have to finish with the frame before this one starts.
+    // Besides these, every filter waits for the processing filters added
+    // before it to the camera
+    QList<AbstractVideoFilter *> dependencies() const { return m_dependencies; }
+    void addDependency(AbstractVideoFilter *filter);
+    void removeDependency(AbstractVideoFilter *filter);
+
+    // input the filter wants to get from VideoFilterFrame::image()
+    virtual FrameRequirements requirements() const { return {}; }
+
+    virtual QVideoFrame run(VideoFilterFrame *input) = 0;
+
+    // gate filters let the analysis filters depending on them skip frames:
+    // called once the filter is done with the frame, false passes the frame
+    // through all the analysis filters downstream without running them.
+    // Processing filters downstream still transform it. Frames a gate skips
+    // for its rate cap or load shedding get the decision of its last frame
+    virtual bool isGateOpen(const VideoFilterFrame *frame) const
+    {
+        Q_UNUSED(frame)
+        return true;
+    }
+
+    using Completion = std::function<void(const QVideoFrame &output)>;
+    // filters finishing frames later, on another thread, e.g. AsyncVideoFilter.
+    // The graph calls runAsync() for them instead of run() and keeps up to
+    // maxFramesInFlight() frames in the filter at once
+    virtual bool isAsync() const { return false; }
+    virtual int maxFramesInFlight() const { return 1; }
+    virtual void runAsync(const std::shared_ptr<VideoFilterFrame> &input, Completion completion)
+    {
+        completion(run(input.get()));
+    }
 
 Q_SIGNALS:
     void activeChanged();
+    void maxRateChanged();
+    void deadlineChanged();
+    void dependenciesChanged();
 
 private:
     Q_DISABLE_COPY(AbstractVideoFilter)
     bool m_active = false;
+    // read by the pipeline threads
+    std::atomic<qreal> m_maxRate { 0.0 };
+    std::atomic<int> m_deadline { 0 };
+    QList<AbstractVideoFilter *> m_dependencies;
 };
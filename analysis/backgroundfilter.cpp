@@ -0,0 +1,221 @@
+#include "backgroundfilter.h"
+
+#include <common/imageops.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+namespace {
+// foreground pixels are learned 2^kForegroundSlowdown times slower
+constexpr int kForegroundSlowdown = 3;
+}
+
+BackgroundFilter::BackgroundFilter(QObject *parent)
+    : AbstractVideoFilter{parent}
+{
+    setObjectName(QStringLiteral("background"));
+    m_pinnedResults = &m_results.latest();
+}
+
+template<typename Function>
+void BackgroundFilter::updateSettings(Function update)
+{
+    {
+        QMutexLocker locker(&m_settingsMutex);
+        if (!update(m_settings))
+            return;
+    }
+    Q_EMIT settingsChanged();
+}
+
+int BackgroundFilter::adaptationFrames() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return 1 << m_settings.rate;
+}
+
+void BackgroundFilter::setAdaptationFrames(int frames)
+{
+    // the fixed point update works with powers of two
+    const int rate = std::clamp(int(std::lround(std::log2(std::max(frames, 1)))), 0, 10);
+    updateSettings([rate](Settings &settings) {
+        return std::exchange(settings.rate, rate) != rate;
+    });
+}
+
+int BackgroundFilter::threshold() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.threshold;
+}
+
+void BackgroundFilter::setThreshold(int threshold)
+{
+    threshold = std::clamp(threshold, 0, 255);
+    updateSettings([threshold](Settings &settings) {
+        return std::exchange(settings.threshold, threshold) != threshold;
+    });
+}
+
+int BackgroundFilter::downscale() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.downscale;
+}
+
+void BackgroundFilter::setDownscale(int factor)
+{
+    factor = std::clamp(factor, 1, 16);
+    updateSettings([factor](Settings &settings) {
+        return std::exchange(settings.downscale, factor) != factor;
+    });
+}
+
+qreal BackgroundFilter::minBlobArea() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.minBlobArea;
+}
+
+void BackgroundFilter::setMinBlobArea(qreal area)
+{
+    area = std::clamp<qreal>(area, 0.0, 1.0);
+    updateSettings([area](Settings &settings) {
+        return std::exchange(settings.minBlobArea, area) != area;
+    });
+}
+
+int BackgroundFilter::maxBlobs() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.maxBlobs;
+}
+
+void BackgroundFilter::setMaxBlobs(int count)
+{
+    count = std::max(count, 1);
+    updateSettings([count](Settings &settings) {
+        return std::exchange(settings.maxBlobs, count) != count;
+    });
+}
+
+void BackgroundFilter::resetBackground()
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_resetRequested = true;
+}
+
+bool BackgroundFilter::isGateOpen(const VideoFilterFrame *frame) const
+{
+    // frames the filter couldn't look at go through
+    const QVariant blobs = frame->annotation("blobs");
+    return !blobs.isValid() || blobs.toInt() > 0;
+}
+
+QVideoFrame BackgroundFilter::run(VideoFilterFrame *input)
+{
+    Settings settings;
+    bool reset = false;
+    {
+        QMutexLocker locker(&m_settingsMutex);
+        settings = m_settings;
+        reset = std::exchange(m_resetRequested, false);
+    }
+
+    const QSize planeSize = input->downscaledLuma(settings.downscale, &m_plane);
+    if (planeSize.isEmpty())
+        return input->videoFrame();
+    const int count = planeSize.width() * planeSize.height();
+
+    qreal foreground = 0.0;
+    QList<QRect> boxes;
+    if (reset || planeSize != m_planeSize) {
+        // the first frame is the background
+        m_planeSize = planeSize;
+        m_background.resize(count);
+        std::transform(m_plane.begin(), m_plane.end(), m_background.begin(), ImageOps::toBackground);
+        m_mask.assign(count, 0);
+    } else {
+        ImageOps::updateBackground(m_plane.data(), m_background.data(), m_mask.data(), count, settings.rate,
+                                   std::min(settings.rate + kForegroundSlowdown, 14), settings.threshold);
+        boxes = foregroundBlobs(settings, input->size(), &foreground);
+    }
+
+    input->setRegionsOfInterest(boxes);
+    input->setAnnotation("foreground", foreground);
+    input->setAnnotation("blobs", int(boxes.size()));
+
+    m_results.publish([this, input, foreground, &boxes](BackgroundResults &next, const BackgroundResults &) {
+        next.foreground = foreground;
+        next.blobs.clear();
+        for (const QRect &box : boxes)
+            next.blobs.append(input->mapToFullFrame(QRectF(box)));
+        // reuses the image of an older result unless the GUI still holds it
+        if (next.mask.size() != m_planeSize || next.mask.format() != QImage::Format_Grayscale8)
+            next.mask = QImage(m_planeSize, QImage::Format_Grayscale8);
+        for (int y = 0; y < m_planeSize.height(); ++y)
+            memcpy(next.mask.scanLine(y), m_mask.data() + size_t(y) * m_planeSize.width(), m_planeSize.width());
+        return true;
+    });
+    QMetaObject::invokeMethod(this, &BackgroundFilter::deliverResults, Qt::QueuedConnection);
+
+    return input->videoFrame();
+}
+
+QList<QRect> BackgroundFilter::foregroundBlobs(const Settings &settings, const QSize &frameSize, qreal *foreground)
+{
+    const int width = m_planeSize.width();
+    const int height = m_planeSize.height();
+    const int columns = ImageOps::cellCount(width);
+    const int rows = ImageOps::cellCount(height);
+
+    m_cellSums.resize(size_t(columns) * rows);
+    ImageOps::cellSums(m_mask.data(), width, width, height, m_cellSums.data());
+
+    // cells at least a quarter foreground make up the blobs
+    m_cells.assign(m_cellSums.size(), 0);
+    quint64 foregroundPixels = 0;
+    for (int row = 0; row < rows; ++row) {
+        const int cellHeight = std::min(ImageOps::kCellSize, height - row * ImageOps::kCellSize);
+        for (int column = 0; column < columns; ++column) {
+            const size_t cell = size_t(row) * columns + column;
+            const int cellWidth = std::min(ImageOps::kCellSize, width - column * ImageOps::kCellSize);
+            const uint32_t pixels = m_cellSums[cell] / 255;
+            foregroundPixels += pixels;
+            m_cells[cell] = pixels * 4 >= uint32_t(cellWidth * cellHeight);
+        }
+    }
+    *foreground = qreal(foregroundPixels) / (qreal(width) * height);
+
+    std::vector<ImageOps::Blob> blobs = ImageOps::connectedBlobs(m_cells.data(), columns, rows);
+    const int minCells = int(std::ceil(settings.minBlobArea * columns * rows));
+    blobs.erase(std::remove_if(blobs.begin(), blobs.end(), [minCells](const ImageOps::Blob &blob) {
+        return blob.cells < minCells;
+    }), blobs.end());
+    std::sort(blobs.begin(), blobs.end(), [](const ImageOps::Blob &a, const ImageOps::Blob &b) {
+        return a.cells > b.cells;
+    });
+    if (int(blobs.size()) > settings.maxBlobs)
+        blobs.resize(settings.maxBlobs);
+
+    QList<QRect> boxes;
+    const int cellPixels = ImageOps::kCellSize * settings.downscale;
+    const QRect frameRect(QPoint(0, 0), frameSize);
+    for (const ImageOps::Blob &blob : blobs) {
+        // a cell of margin, the blob edges are only a quarter foreground
+        const QRect box(QPoint((blob.left - 1) * cellPixels, (blob.top - 1) * cellPixels),
+                        QPoint((blob.right + 2) * cellPixels - 1, (blob.bottom + 2) * cellPixels - 1));
+        boxes.append(box & frameRect);
+    }
+    return boxes;
+}
+
+void BackgroundFilter::deliverResults()
+{
+    const quint64 sequence = m_pinnedResults->sequence;
+    m_pinnedResults = &m_results.latest();
+    if (m_pinnedResults->sequence != sequence)
+        Q_EMIT resultsChanged();
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QVariantList>
+
+#include <vector>
+
+#include "abstractvideofilter.h"
+
+#include <common/snapshotbuffer.h>
+
+struct BackgroundResults
+{
+    // fraction of the pixels differing from the background
+    qreal foreground = 0.0;
+    // bounding boxes of the foreground blobs, in the coordinates of a frame
+    // covering the full field of view, see VideoFilterFrame::mapToFullFrame()
+    QVariantList blobs;
+    // 255 for foreground pixels, at analysis resolution of the cropped frame
+    QImage mask;
+};
+
+/*
+ * Foreground extraction against a running background model: an exponential
+ * average of the luma plane at analysis resolution (scaled down by downscale),
+ * updated every frame in fixed point. Pixels further than threshold from the
+ * background are foreground, they are learned into the background 8 times
+ * slower so objects which stop are absorbed only after a while.
+ *
+ * The foreground cells are grouped into blobs, the largest ones go to the
+ * filters depending on this one as VideoFilterFrame::regionsOfInterest() and
+ * frames without any blob don't reach them at all.
+ */
+class BackgroundFilter : public AbstractVideoFilter
+{
+    Q_OBJECT
+    // the background follows the scene over about this many frames
+    Q_PROPERTY(int adaptationFrames READ adaptationFrames WRITE setAdaptationFrames NOTIFY settingsChanged)
+    // luma difference of a foreground pixel, 0..255
+    Q_PROPERTY(int threshold READ threshold WRITE setThreshold NOTIFY settingsChanged)
+    Q_PROPERTY(int downscale READ downscale WRITE setDownscale NOTIFY settingsChanged)
+    // fraction of the frame a blob has to cover
+    Q_PROPERTY(qreal minBlobArea READ minBlobArea WRITE setMinBlobArea NOTIFY settingsChanged)
+    // the largest blobs handed on
+    Q_PROPERTY(int maxBlobs READ maxBlobs WRITE setMaxBlobs NOTIFY settingsChanged)
+    Q_PROPERTY(qreal foreground READ foreground NOTIFY resultsChanged)
+    Q_PROPERTY(QVariantList blobs READ blobs NOTIFY resultsChanged)
+
+public:
+    explicit BackgroundFilter(QObject *parent = nullptr);
+
+    int adaptationFrames() const;
+    void setAdaptationFrames(int frames);
+    int threshold() const;
+    void setThreshold(int threshold);
+    int downscale() const;
+    void setDownscale(int factor);
+    qreal minBlobArea() const;
+    void setMinBlobArea(qreal area);
+    int maxBlobs() const;
+    void setMaxBlobs(int count);
+
+    // starts learning the background over from the next frame
+    Q_INVOKABLE void resetBackground();
+
+    // latest results, GUI thread
+    qreal foreground() const { return m_pinnedResults->value.foreground; }
+    QVariantList blobs() const { return m_pinnedResults->value.blobs; }
+    QImage foregroundMask() const { return m_pinnedResults->value.mask; }
+
+    bool isGateOpen(const VideoFilterFrame *frame) const override;
+
+Q_SIGNALS:
+    void settingsChanged();
+    void resultsChanged();
+
+protected:
+    QVideoFrame run(VideoFilterFrame *input) override;
+
+private:
+    struct Settings {
+        // the background moves 1/2^rate of the way to every frame
+        int rate = 5;
+        int threshold = 20;
+        int downscale = 4;
+        qreal minBlobArea = 0.002;
+        int maxBlobs = 8;
+    };
+
+    template<typename Function>
+    void updateSettings(Function update);
+    QList<QRect> foregroundBlobs(const Settings &settings, const QSize &frameSize, qreal *foreground);
+    void deliverResults();
+
+    mutable QMutex m_settingsMutex;
+    Settings m_settings;
+    bool m_resetRequested = false;
+
+    /* Pipeline thread only */
+    std::vector<uint8_t> m_plane;
+    QSize m_planeSize;
+    // 8.7 fixed point
+    std::vector<int16_t> m_background;
+    std::vector<uint8_t> m_mask;
+    std::vector<uint32_t> m_cellSums;
+    std::vector<uint8_t> m_cells;
+
+    SnapshotBuffer<BackgroundResults> m_results;
+    const SnapshotBuffer<BackgroundResults>::Snapshot *m_pinnedResults = nullptr;
+};
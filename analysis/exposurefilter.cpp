@@ -0,0 +1,270 @@
+#include "exposurefilter.h"
+
+#include <common/imageops.h>
+#include <common/tiles.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// the lowest and highest luma levels counted as clipped
+constexpr int kClipLevels = 3;
+// exposure the loop starts from, us
+constexpr int kInitialExposureTime = 10000;
+// frames the sensor takes to apply a new exposure time
+constexpr int kSettleFrames = 3;
+}
+
+int ExposureStatistics::percentile(qreal fraction) const
+{
+    const quint64 limit = quint64(fraction * pixels);
+    quint64 count = 0;
+    for (int level = 0; level < 256; ++level) {
+        count += luma[level];
+        if (count > limit)
+            return level;
+    }
+    return 255;
+}
+
+ExposureFilter::ExposureFilter(QObject *parent)
+    : AbstractVideoFilter{parent}
+{
+    setObjectName(QStringLiteral("exposure"));
+    m_pinnedStatistics = &m_statistics.latest();
+}
+
+QRectF ExposureFilter::region() const
+{
+    QMutexLocker locker(&m_regionMutex);
+    return m_region;
+}
+
+void ExposureFilter::setRegion(const QRectF &region)
+{
+    QRectF _region = region.intersected(QRectF(0.0, 0.0, 1.0, 1.0));
+    if (_region == QRectF(0.0, 0.0, 1.0, 1.0))
+        _region = QRectF();
+    {
+        QMutexLocker locker(&m_regionMutex);
+        if (m_region == _region)
+            return;
+        m_region = _region;
+    }
+    Q_EMIT settingsChanged();
+}
+
+void ExposureFilter::setSubsample(int step)
+{
+    step = std::clamp(step, 1, 16);
+    if (m_subsample.exchange(step) != step)
+        Q_EMIT settingsChanged();
+}
+
+void ExposureFilter::setTargetBrightness(qreal brightness)
+{
+    brightness = std::clamp<qreal>(brightness, 0.0, 255.0);
+    if (m_targetBrightness.exchange(brightness) != brightness)
+        Q_EMIT settingsChanged();
+}
+
+void ExposureFilter::setMinExposureTime(int us)
+{
+    us = std::max(us, 1);
+    if (m_minExposureTime.exchange(us) != us)
+        Q_EMIT settingsChanged();
+}
+
+void ExposureFilter::setMaxExposureTime(int us)
+{
+    us = std::max(us, 1);
+    if (m_maxExposureTime.exchange(us) != us)
+        Q_EMIT settingsChanged();
+}
+
+QVideoFrame ExposureFilter::run(VideoFilterFrame *input)
+{
+    const QRect frameRect(QPoint(0, 0), input->size());
+    const QRectF region = this->region();
+    const QRect area = region.isEmpty() ? frameRect
+                                        : QRect(qRound(region.x() * frameRect.width()),
+                                                qRound(region.y() * frameRect.height()),
+                                                qRound(region.width() * frameRect.width()),
+                                                qRound(region.height() * frameRect.height())) & frameRect;
+    if (area.isEmpty())
+        return input->videoFrame();
+
+    // measured straight into the snapshot the readers get next
+    const int step = m_subsample;
+    qreal mean = 0.0;
+    qreal clippedBright = 0.0;
+    const bool measured = m_statistics.publish([&](ExposureStatistics &next, const ExposureStatistics &) {
+        if (!measure(input, area, step, &next))
+            return false;
+        mean = next.mean;
+        clippedBright = next.clippedBright;
+        return true;
+    });
+    if (!measured)
+        return input->videoFrame();
+
+    QMetaObject::invokeMethod(this, &ExposureFilter::deliverStatistics, Qt::QueuedConnection);
+    controlExposure(mean, clippedBright);
+    return input->videoFrame();
+}
+
+bool ExposureFilter::measure(const VideoFilterFrame *input, const QRect &area, int step, ExposureStatistics *statistics)
+{
+    statistics->frame = input->sequence();
+    statistics->luma.fill(0);
+    statistics->red.fill(0);
+    statistics->green.fill(0);
+    statistics->blue.fill(0);
+
+    int redOffset = 0, greenOffset = 0, blueOffset = 0;
+    int pixelStride = 1, offset = 0;
+    QVideoFrame frame = input->videoFrame();
+    bool rgb = ImageOps::rgbLayout(frame.pixelFormat(), &redOffset, &greenOffset, &blueOffset);
+    const bool luma = !rgb && ImageOps::lumaLayout(frame.pixelFormat(), &pixelStride, &offset);
+
+    const uint8_t *origin = nullptr;
+    int bytesPerLine = 0;
+    QImage image;
+    if ((rgb || luma) && frame.map(QVideoFrame::ReadOnly)) {
+        bytesPerLine = frame.bytesPerLine(0);
+        origin = frame.bits(0) + size_t(area.y()) * bytesPerLine + size_t(area.x()) * (rgb ? 4 : pixelStride);
+    } else {
+        // e.g. MJPEG, decoded once for all the filters asking for it
+        image = input->image({ QImage::Format_RGB32, QSize(), area });
+        if (image.isNull())
+            return false;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        redOffset = 2, greenOffset = 1, blueOffset = 0;
+#else
+        redOffset = 1, greenOffset = 2, blueOffset = 3;
+#endif
+        rgb = true;
+        origin = image.constBits();
+        bytesPerLine = int(image.bytesPerLine());
+    }
+    statistics->hasColor = rgb;
+
+    // large areas in row tiles across the workers, each into its own bins.
+    // Tiles start at multiples of step so the sampled rows stay the same
+    struct Bins {
+        std::array<quint32, 256> luma {};
+        std::array<quint32, 256> red {};
+        std::array<quint32, 256> green {};
+        std::array<quint32, 256> blue {};
+    };
+    const Tiles::Layout layout { QSize(), rgb ? 4 : pixelStride, 0, step };
+    const QList<Tiles::Tile> tiles = Tiles::split(QRect(QPoint(0, 0), area.size()), layout);
+    const std::vector<Bins> partial = Tiles::map<Bins>(tiles, [&](const Tiles::Tile &tile) {
+        Bins bins;
+        const uint8_t *rows = origin + size_t(tile.rect.y()) * bytesPerLine;
+        if (rgb) {
+            ImageOps::rgbHistograms(rows, bytesPerLine, tile.rect.width(), tile.rect.height(), redOffset, greenOffset,
+                                    blueOffset, step, bins.luma.data(), bins.red.data(), bins.green.data(),
+                                    bins.blue.data());
+        } else {
+            ImageOps::lumaHistogram(rows, bytesPerLine, tile.rect.width(), tile.rect.height(), pixelStride, offset, step,
+                                    bins.luma.data());
+        }
+        return bins;
+    });
+    if (frame.isMapped())
+        frame.unmap();
+
+    for (const Bins &bins : partial) {
+        for (int level = 0; level < 256; ++level) {
+            statistics->luma[level] += bins.luma[level];
+            statistics->red[level] += bins.red[level];
+            statistics->green[level] += bins.green[level];
+            statistics->blue[level] += bins.blue[level];
+        }
+    }
+
+    // everything else comes from the histogram
+    quint64 pixels = 0;
+    quint64 sum = 0;
+    quint64 dark = 0;
+    quint64 bright = 0;
+    for (int level = 0; level < 256; ++level) {
+        const quint32 count = statistics->luma[level];
+        pixels += count;
+        sum += quint64(count) * level;
+        if (level < kClipLevels)
+            dark += count;
+        else if (level >= 256 - kClipLevels)
+            bright += count;
+    }
+    statistics->pixels = quint32(pixels);
+    statistics->mean = pixels ? qreal(sum) / pixels : 0.0;
+    statistics->clippedDark = pixels ? qreal(dark) / pixels : 0.0;
+    statistics->clippedBright = pixels ? qreal(bright) / pixels : 0.0;
+    return pixels > 0;
+}
+
+void ExposureFilter::controlExposure(qreal mean, qreal clippedBright)
+{
+    const qreal target = m_targetBrightness;
+    if (target <= 0.0) {
+        // back to the camera AE
+        if (m_exposureTime > 0) {
+            m_exposureTime = 0;
+            Q_EMIT exposureRequested(0);
+        }
+        return;
+    }
+    if (m_settleFrames > 0) {
+        m_settleFrames--;
+        return;
+    }
+
+    const int minimum = m_minExposureTime;
+    const int maximum = std::max<int>(m_maxExposureTime, minimum);
+    int exposure = 0;
+    if (m_exposureTime == 0) {
+        exposure = std::clamp(kInitialExposureTime, minimum, maximum);
+    } else {
+        qreal ratio = target / std::max<qreal>(mean, 1.0);
+        // blown highlights pull the mean down, don't brighten them further
+        if (clippedBright > 0.05)
+            ratio = std::min<qreal>(ratio, 0.8);
+        // half of the correction in stops at a time, the loop overshoots otherwise
+        exposure = std::clamp(int(m_exposureTime * std::sqrt(ratio)), minimum, maximum);
+        if (std::abs(exposure - m_exposureTime) * 20 < m_exposureTime)
+            return;
+    }
+
+    m_exposureTime = exposure;
+    m_settleFrames = kSettleFrames;
+    Q_EMIT exposureRequested(exposure);
+}
+
+QVariantMap ExposureFilter::statisticsMap() const
+{
+    const ExposureStatistics &statistics = this->statistics();
+    QVariantList histogram;
+    histogram.reserve(256);
+    for (const quint32 count : statistics.luma)
+        histogram.append(count);
+
+    return {
+        { "frame", statistics.frame },
+        { "pixels", statistics.pixels },
+        { "mean", statistics.mean },
+        { "median", statistics.percentile(0.5) },
+        { "clippedDark", statistics.clippedDark },
+        { "clippedBright", statistics.clippedBright },
+        { "histogram", histogram },
+    };
+}
+
+void ExposureFilter::deliverStatistics()
+{
+    const quint64 sequence = m_pinnedStatistics->sequence;
+    m_pinnedStatistics = &m_statistics.latest();
+    if (m_pinnedStatistics->sequence != sequence)
+        Q_EMIT statisticsChanged();
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <QMutex>
+#include <QRectF>
+#include <QVariantMap>
+
+#include <array>
+#include <atomic>
+
+#include "abstractvideofilter.h"
+
+#include <common/snapshotbuffer.h>
+
+struct ExposureStatistics
+{
+    // VideoFilterFrame::sequence() of the measured frame
+    quint64 frame = 0;
+    // pixels sampled
+    quint32 pixels = 0;
+    // the red, green and blue histograms are filled for RGB frames only
+    bool hasColor = false;
+    std::array<quint32, 256> luma {};
+    std::array<quint32, 256> red {};
+    std::array<quint32, 256> green {};
+    std::array<quint32, 256> blue {};
+    // mean luma, 0..255
+    qreal mean = 0.0;
+    // fractions of the sampled pixels at the ends of the luma range
+    qreal clippedDark = 0.0;
+    qreal clippedBright = 0.0;
+
+    // luma below which the given fraction (0..1) of the pixels fall
+    int percentile(qreal fraction) const;
+};
+
+/*
+ * Luma and RGB histograms, mean brightness and clipped pixels of every frame,
+ * or of a part of it, for exposure control. One pass over the frame data
+ * without conversions, every subsample-th pixel of every subsample-th row.
+ *
+ * With a targetBrightness set the filter also runs a simple exposure loop,
+ * requesting exposure times which bring the mean luma to the target through
+ * exposureRequested(), see QLibCamera::setExposureTime().
+ */
+class ExposureFilter : public AbstractVideoFilter
+{
+    Q_OBJECT
+    // normalized part of the frame to measure, the whole frame if empty
+    Q_PROPERTY(QRectF region READ region WRITE setRegion NOTIFY settingsChanged)
+    Q_PROPERTY(int subsample READ subsample WRITE setSubsample NOTIFY settingsChanged)
+    // mean luma the exposure loop aims at, 0 - no exposure control
+    Q_PROPERTY(qreal targetBrightness READ targetBrightness WRITE setTargetBrightness NOTIFY settingsChanged)
+    // exposure time limits of the loop, us
+    Q_PROPERTY(int minExposureTime READ minExposureTime WRITE setMinExposureTime NOTIFY settingsChanged)
+    Q_PROPERTY(int maxExposureTime READ maxExposureTime WRITE setMaxExposureTime NOTIFY settingsChanged)
+    // mean, clippedDark, clippedBright, median, pixels and the luma histogram
+    Q_PROPERTY(QVariantMap statistics READ statisticsMap NOTIFY statisticsChanged)
+
+public:
+    explicit ExposureFilter(QObject *parent = nullptr);
+
+    QRectF region() const;
+    void setRegion(const QRectF &region);
+    int subsample() const { return m_subsample; }
+    void setSubsample(int step);
+    qreal targetBrightness() const { return m_targetBrightness; }
+    void setTargetBrightness(qreal brightness);
+    int minExposureTime() const { return m_minExposureTime; }
+    void setMinExposureTime(int us);
+    int maxExposureTime() const { return m_maxExposureTime; }
+    void setMaxExposureTime(int us);
+
+    // latest statistics, GUI thread
+    const ExposureStatistics &statistics() const { return m_pinnedStatistics->value; }
+    QVariantMap statisticsMap() const;
+
+Q_SIGNALS:
+    void settingsChanged();
+    void statisticsChanged();
+    // emitted from the pipeline thread, connect it queued
+    void exposureRequested(int us);
+
+protected:
+    QVideoFrame run(VideoFilterFrame *input) override;
+
+private:
+    bool measure(const VideoFilterFrame *input, const QRect &area, int step, ExposureStatistics *statistics);
+    void controlExposure(qreal mean, qreal clippedBright);
+    void deliverStatistics();
+
+    mutable QMutex m_regionMutex;
+    QRectF m_region;
+    std::atomic<int> m_subsample { 4 };
+    std::atomic<qreal> m_targetBrightness { 0.0 };
+    std::atomic<int> m_minExposureTime { 100 };
+    std::atomic<int> m_maxExposureTime { 33000 };
+
+    /* Exposure loop, pipeline thread only */
+    int m_exposureTime = 0;
+    int m_settleFrames = 0;
+
+    SnapshotBuffer<ExposureStatistics> m_statistics;
+    const SnapshotBuffer<ExposureStatistics>::Snapshot *m_pinnedStatistics = nullptr;
+};
@@ -0,0 +1,302 @@
+#include "motionfilter.h"
+
+#include <common/imageops.h>
+#include <common/latencyhistogram.h>
+
+#include <utility>
+
+namespace {
+QList<QRectF> toRects(const QVariantList &list)
+{
+    QList<QRectF> rects;
+    for (const QVariant &value : list) {
+        QRectF rect;
+        if (value.canConvert<QRectF>()) {
+            rect = value.toRectF();
+        } else {
+            // [ x, y, width, height ] from the pipeline config
+            const QVariantList numbers = value.toList();
+            if (numbers.size() == 4)
+                rect = QRectF(numbers[0].toReal(), numbers[1].toReal(), numbers[2].toReal(), numbers[3].toReal());
+        }
+        if (rect.isValid())
+            rects.append(rect);
+    }
+    return rects;
+}
+
+QVariantList toVariantList(const QList<QRectF> &rects)
+{
+    QVariantList list;
+    for (const QRectF &rect : rects)
+        list.append(rect);
+    return list;
+}
+
+bool containsPoint(const QList<QRectF> &rects, const QPointF &point)
+{
+    for (const QRectF &rect : rects) {
+        if (rect.contains(point))
+            return true;
+    }
+    return false;
+}
+}
+
+MotionFilter::MotionFilter(QObject *parent)
+    : AbstractVideoFilter{parent}
+{
+    setObjectName(QStringLiteral("motion"));
+    m_pinnedResults = &m_results.latest();
+}
+
+template<typename Function>
+void MotionFilter::updateSettings(Function update)
+{
+    {
+        QMutexLocker locker(&m_settingsMutex);
+        if (!update(m_settings))
+            return;
+        m_maskDirty = true;
+    }
+    Q_EMIT settingsChanged();
+}
+
+int MotionFilter::threshold() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.threshold;
+}
+
+void MotionFilter::setThreshold(int threshold)
+{
+    threshold = qBound(0, threshold, 255);
+    updateSettings([threshold](Settings &settings) {
+        return std::exchange(settings.threshold, threshold) != threshold;
+    });
+}
+
+qreal MotionFilter::activationLevel() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.activationLevel;
+}
+
+void MotionFilter::setActivationLevel(qreal level)
+{
+    updateSettings([level](Settings &settings) {
+        return !qFuzzyCompare(std::exchange(settings.activationLevel, level), level);
+    });
+}
+
+qreal MotionFilter::releaseLevel() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.releaseLevel;
+}
+
+void MotionFilter::setReleaseLevel(qreal level)
+{
+    updateSettings([level](Settings &settings) {
+        return !qFuzzyCompare(std::exchange(settings.releaseLevel, level), level);
+    });
+}
+
+int MotionFilter::holdTime() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.holdTime;
+}
+
+void MotionFilter::setHoldTime(int ms)
+{
+    ms = qMax(0, ms);
+    updateSettings([ms](Settings &settings) {
+        return std::exchange(settings.holdTime, ms) != ms;
+    });
+}
+
+int MotionFilter::downscale() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return m_settings.downscale;
+}
+
+void MotionFilter::setDownscale(int factor)
+{
+    factor = qBound(1, factor, 16);
+    updateSettings([factor](Settings &settings) {
+        return std::exchange(settings.downscale, factor) != factor;
+    });
+}
+
+QVariantList MotionFilter::regions() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return toVariantList(m_settings.regions);
+}
+
+void MotionFilter::setRegions(const QVariantList &regions)
+{
+    const QList<QRectF> rects = toRects(regions);
+    updateSettings([&rects](Settings &settings) {
+        if (settings.regions == rects)
+            return false;
+        settings.regions = rects;
+        return true;
+    });
+}
+
+QVariantList MotionFilter::ignoredRegions() const
+{
+    QMutexLocker locker(&m_settingsMutex);
+    return toVariantList(m_settings.ignoredRegions);
+}
+
+void MotionFilter::setIgnoredRegions(const QVariantList &regions)
+{
+    const QList<QRectF> rects = toRects(regions);
+    updateSettings([&rects](Settings &settings) {
+        if (settings.ignoredRegions == rects)
+            return false;
+        settings.ignoredRegions = rects;
+        return true;
+    });
+}
+
+bool MotionFilter::isGateOpen(const VideoFilterFrame *frame) const
+{
+    // frames the filter couldn't look at go through
+    const QVariant motion = frame->annotation("motion");
+    return !motion.isValid() || motion.toBool();
+}
+
+QVideoFrame MotionFilter::run(VideoFilterFrame *input)
+{
+    Settings settings;
+    bool maskDirty = false;
+    {
+        QMutexLocker locker(&m_settingsMutex);
+        settings = m_settings;
+        maskDirty = std::exchange(m_maskDirty, false);
+    }
+
+    const QSize previousSize = m_planeSize;
+    m_planeSize = input->downscaledLuma(settings.downscale, &m_current);
+    if (m_planeSize.isEmpty())
+        return input->videoFrame();
+
+    const int width = m_planeSize.width();
+    const int height = m_planeSize.height();
+    const int columns = ImageOps::cellCount(width);
+    const int rows = ImageOps::cellCount(height);
+    const size_t cells = size_t(columns) * rows;
+
+    qreal level = 0.0;
+    if (previousSize == m_planeSize && m_previous.size() == m_current.size()) {
+        m_cellSums.resize(cells);
+        ImageOps::cellAbsDiff(m_current.data(), m_previous.data(), width, width, height, m_cellSums.data());
+
+        if (maskDirty || m_mask.size() != cells)
+            updateMask(settings, columns, rows);
+
+        m_changed.assign(cells, 0);
+        int watched = 0;
+        int changed = 0;
+        for (int row = 0; row < rows; ++row) {
+            const int cellHeight = qMin(ImageOps::kCellSize, height - row * ImageOps::kCellSize);
+            for (int column = 0; column < columns; ++column) {
+                const size_t cell = size_t(row) * columns + column;
+                if (!m_mask[cell])
+                    continue;
+                const int cellWidth = qMin(ImageOps::kCellSize, width - column * ImageOps::kCellSize);
+                watched++;
+                if (m_cellSums[cell] > uint32_t(settings.threshold * cellWidth * cellHeight)) {
+                    m_changed[cell] = 1;
+                    changed++;
+                }
+            }
+        }
+        if (watched > 0)
+            level = qreal(changed) / watched;
+    } else {
+        // first frame or new resolution, nothing to compare with yet
+        m_changed.assign(cells, 0);
+    }
+    m_previous.swap(m_current);
+
+    const qint64 startTime = input->videoFrame().startTime();
+    const qint64 now = startTime >= 0 ? startTime / 1000 : LatencyHistogram::now() / 1000000;
+    if (now < m_lastActivity)
+        m_lastActivity = now;
+    if (level >= settings.activationLevel) {
+        m_motion = true;
+        m_lastActivity = now;
+    } else if (m_motion && level >= settings.releaseLevel) {
+        m_lastActivity = now;
+    } else if (m_motion && now - m_lastActivity >= settings.holdTime) {
+        m_motion = false;
+    }
+
+    // while motion is held without changed cells the regions are empty, the
+    // filters downstream look at the whole frame
+    const QList<QRect> boxes = m_motion ? changedBoxes(columns, rows, settings.downscale, input->size())
+                                        : QList<QRect>();
+    input->setRegionsOfInterest(boxes);
+    input->setAnnotation("motion", m_motion);
+    input->setAnnotation("motionLevel", level);
+
+    const bool motion = m_motion;
+    m_results.publish([input, motion, level, &boxes](MotionResults &next, const MotionResults &) {
+        next.motion = motion;
+        next.level = level;
+        next.regions.clear();
+        // the regions of interest stay in the coordinates of the cropped frame
+        for (const QRect &box : boxes)
+            next.regions.append(input->mapToFullFrame(QRectF(box)));
+        return true;
+    });
+    QMetaObject::invokeMethod(this, &MotionFilter::deliverResults, Qt::QueuedConnection);
+
+    return input->videoFrame();
+}
+
+void MotionFilter::updateMask(const Settings &settings, int columns, int rows)
+{
+    const qreal width = m_planeSize.width();
+    const qreal height = m_planeSize.height();
+
+    m_mask.assign(size_t(columns) * rows, 0);
+    for (int row = 0; row < rows; ++row) {
+        for (int column = 0; column < columns; ++column) {
+            const QPointF center(qMin((column + 0.5) * ImageOps::kCellSize, width - 0.5) / width,
+                                 qMin((row + 0.5) * ImageOps::kCellSize, height - 0.5) / height);
+            const bool watched = settings.regions.isEmpty() || containsPoint(settings.regions, center);
+            m_mask[size_t(row) * columns + column] = watched && !containsPoint(settings.ignoredRegions, center);
+        }
+    }
+}
+
+QList<QRect> MotionFilter::changedBoxes(int columns, int rows, int factor, const QSize &frameSize)
+{
+    QList<QRect> boxes;
+    const int cellPixels = ImageOps::kCellSize * factor;
+    const QRect frameRect(QPoint(0, 0), frameSize);
+
+    const std::vector<ImageOps::Blob> blobs = ImageOps::connectedBlobs(m_changed.data(), columns, rows);
+    for (const ImageOps::Blob &blob : blobs) {
+        // a cell of margin around the group, moving objects stick out of it
+        const QRect box(QPoint((blob.left - 1) * cellPixels, (blob.top - 1) * cellPixels),
+                        QPoint((blob.right + 2) * cellPixels - 1, (blob.bottom + 2) * cellPixels - 1));
+        boxes.append(box & frameRect);
+    }
+    return boxes;
+}
+
+void MotionFilter::deliverResults()
+{
+    const quint64 sequence = m_pinnedResults->sequence;
+    m_pinnedResults = &m_results.latest();
+    if (m_pinnedResults->sequence != sequence)
+        Q_EMIT resultsChanged();
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <QMutex>
+#include <QRectF>
+#include <QVariantList>
+
+#include <vector>
+
+#include "abstractvideofilter.h"
+
+#include <common/snapshotbuffer.h>
+
+struct MotionResults
+{
+    bool motion = false;
+    // fraction of the watched cells that changed
+    qreal level = 0.0;
+    // bounding boxes of the changed areas, in the coordinates of a frame
+    // covering the full field of view, see VideoFilterFrame::mapToFullFrame()
+    QVariantList regions;
+};
+
+/*
+ * Cheap gate in front of the expensive filters. Compares the luma plane of
+ * every frame, scaled down, with the previous one in 8x8 cells. Motion starts
+ * when the fraction of changed cells reaches activationLevel and stops once it
+ * stays under releaseLevel for holdTime. Without motion the filters depending
+ * on this one don't run, with motion they get the boxes around the changed
+ * cells as VideoFilterFrame::regionsOfInterest().
+ */
+class MotionFilter : public AbstractVideoFilter
+{
+    Q_OBJECT
+    // mean absolute luma difference of a cell to count it as changed, 0..255
+    Q_PROPERTY(int threshold READ threshold WRITE setThreshold NOTIFY settingsChanged)
+    Q_PROPERTY(qreal activationLevel READ activationLevel WRITE setActivationLevel NOTIFY settingsChanged)
+    Q_PROPERTY(qreal releaseLevel READ releaseLevel WRITE setReleaseLevel NOTIFY settingsChanged)
+    // ms
+    Q_PROPERTY(int holdTime READ holdTime WRITE setHoldTime NOTIFY settingsChanged)
+    // the luma plane is scaled down by this factor
+    Q_PROPERTY(int downscale READ downscale WRITE setDownscale NOTIFY settingsChanged)
+    // normalized rects to watch, the whole frame if empty, and to ignore
+    Q_PROPERTY(QVariantList regions READ regions WRITE setRegions NOTIFY settingsChanged)
+    Q_PROPERTY(QVariantList ignoredRegions READ ignoredRegions WRITE setIgnoredRegions NOTIFY settingsChanged)
+    Q_PROPERTY(bool motion READ motion NOTIFY resultsChanged)
+    Q_PROPERTY(qreal level READ level NOTIFY resultsChanged)
+    Q_PROPERTY(QVariantList changedRegions READ changedRegions NOTIFY resultsChanged)
+
+public:
+    explicit MotionFilter(QObject *parent = nullptr);
+
+    int threshold() const;
+    void setThreshold(int threshold);
+    qreal activationLevel() const;
+    void setActivationLevel(qreal level);
+    qreal releaseLevel() const;
+    void setReleaseLevel(qreal level);
+    int holdTime() const;
+    void setHoldTime(int ms);
+    int downscale() const;
+    void setDownscale(int factor);
+    QVariantList regions() const;
+    void setRegions(const QVariantList &regions);
+    QVariantList ignoredRegions() const;
+    void setIgnoredRegions(const QVariantList &regions);
+
+    // latest results, GUI thread
+    bool motion() const { return m_pinnedResults->value.motion; }
+    qreal level() const { return m_pinnedResults->value.level; }
+    QVariantList changedRegions() const { return m_pinnedResults->value.regions; }
+
+    bool isGateOpen(const VideoFilterFrame *frame) const override;
+
+Q_SIGNALS:
+    void settingsChanged();
+    void resultsChanged();
+
+protected:
+    QVideoFrame run(VideoFilterFrame *input) override;
+
+private:
+    struct Settings {
+        int threshold = 10;
+        qreal activationLevel = 0.01;
+        qreal releaseLevel = 0.004;
+        int holdTime = 2000;
+        int downscale = 4;
+        QList<QRectF> regions;
+        QList<QRectF> ignoredRegions;
+    };
+
+    template<typename Function>
+    void updateSettings(Function update);
+    void updateMask(const Settings &settings, int columns, int rows);
+    QList<QRect> changedBoxes(int columns, int rows, int factor, const QSize &frameSize);
+    void deliverResults();
+
+    mutable QMutex m_settingsMutex;
+    Settings m_settings;
+    bool m_maskDirty = true;
+
+    /* Pipeline thread only */
+    std::vector<uint8_t> m_current;
+    std::vector<uint8_t> m_previous;
+    QSize m_planeSize;
+    std::vector<uint32_t> m_cellSums;
+    // 1 for watched cells
+    std::vector<uint8_t> m_mask;
+    std::vector<uint8_t> m_changed;
+    bool m_motion = false;
+    qint64 m_lastActivity = 0;
+
+    SnapshotBuffer<MotionResults> m_results;
+    const SnapshotBuffer<MotionResults>::Snapshot *m_pinnedResults = nullptr;
+};
@@ -0,0 +1,37 @@
+#include "asyncvideofilter.h"
+
+#include <QSemaphore>
+
+#include <algorithm>
+
+AsyncVideoFilter::AsyncVideoFilter(QObject *parent) : AbstractVideoFilter(parent) {}
+
+void AsyncVideoFilter::setMaxFramesInFlight(int frames)
+{
+    frames = std::max(frames, 1);
+    if (m_framesInFlight == frames)
+        return;
+    m_framesInFlight = frames;
+    Q_EMIT framesInFlightChanged();
+}
+
+void AsyncVideoFilter::runAsync(const std::shared_ptr<VideoFilterFrame> &input, Completion completion)
+{
+    process(input).start([completion = std::move(completion)](QVideoFrame output) {
+        completion(output);
+    });
+}
+
+QVideoFrame AsyncVideoFilter::run(VideoFilterFrame *input)
+{
+    QSemaphore done;
+    QVideoFrame result;
+    // the caller keeps the frame alive until we return
+    std::shared_ptr<VideoFilterFrame> frame(input, [](VideoFilterFrame *) {});
+    process(frame).start([&](QVideoFrame output) {
+        result = std::move(output);
+        done.release();
+    });
+    done.acquire();
+    return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "abstractvideofilter.h"
+
+#include <common/pipelinecoroutine.h>
+
+/*
+ * Filter written as a C++20 coroutine. process() runs on a pipeline worker
+ * until it awaits, e.g. an AcceleratorQueue doing the inference, and the
+ * worker goes on with other filters meanwhile. Up to framesInFlight frames
+ * are processed at once, so the conversion of a frame overlaps with the
+ * inference of the previous one without more threads.
+ */
+class AsyncVideoFilter : public AbstractVideoFilter
+{
+    Q_OBJECT
+    Q_PROPERTY(int framesInFlight READ maxFramesInFlight WRITE setMaxFramesInFlight NOTIFY framesInFlightChanged)
+
+public:
+    explicit AsyncVideoFilter(QObject *parent = nullptr);
+
+    bool isAsync() const override { return true; }
+    int maxFramesInFlight() const override { return m_framesInFlight; }
+    void setMaxFramesInFlight(int frames);
+
+    void runAsync(const std::shared_ptr<VideoFilterFrame> &input, Completion completion) override;
+    // blocks until process() is done, don't call it from a pipeline worker
+    QVideoFrame run(VideoFilterFrame *input) override;
+
+Q_SIGNALS:
+    void framesInFlightChanged();
+
+protected:
+    // returns the output frame, the input one for analysis filters
+    virtual PipelineTask<QVideoFrame> process(std::shared_ptr<VideoFilterFrame> input) = 0;
+
+private:
+    int m_framesInFlight = 1;
+};
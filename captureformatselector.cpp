@@ -0,0 +1,309 @@
+#include "captureformatselector.h"
+#include "qlibcameramanager.h"
+
+#include <QDebug>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QSettings>
+#include <QVideoFrame>
+#include <QVideoFrameFormat>
+
+#include <common/image.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/framebuffer_allocator.h>
+
+#include <algorithm>
+#include <map>
+#include <time.h>
+
+using namespace libcamera;
+
+namespace {
+// frames skipped while the sensor settles and measured after that
+constexpr int kWarmupFrames = 3;
+constexpr int kMeasuredFrames = 20;
+constexpr int kMeasureTimeoutMs = 3000;
+// all the modes together
+constexpr int kSelectTimeoutMs = 15000;
+
+qint64 threadCpuTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+QString settingsKey(const QString &cameraModel)
+{
+    QString key = cameraModel;
+    return key.replace(QLatin1Char('/'), QLatin1Char('_')).replace(QLatin1Char('\\'), QLatin1Char('_'));
+}
+}
+
+CaptureFormatSelector::CaptureFormatSelector(std::shared_ptr<Camera> camera, const QString &cameraModel)
+    : m_camera{std::move(camera)}, m_cameraModel{cameraModel}
+{
+}
+
+CaptureFormatSelector::~CaptureFormatSelector() = default;
+
+void CaptureFormatSelector::setRequirements(const QList<FrameRequirements> &requirements)
+{
+    m_requirements = requirements;
+}
+
+void CaptureFormatSelector::setMinimumFps(double fps)
+{
+    m_minimumFps = fps;
+}
+
+QList<CaptureFormatSelector::Mode> CaptureFormatSelector::candidates(const QList<StreamFormats> &viewfinderInfo) const
+{
+    // the smallest size satisfying every filter, if all of them declare one
+    QSize neededSize = m_requirements.isEmpty() ? QSize() : QSize(0, 0);
+    for (const FrameRequirements &req : m_requirements) {
+        if (!req.maxSize.isValid()) {
+            neededSize = QSize();
+            break;
+        }
+        neededSize = neededSize.expandedTo(req.maxSize);
+    }
+
+    QList<Mode> modes;
+    for (const StreamFormats &formats : viewfinderInfo) {
+        for (const PixelFormat &pixelFormat : formats.pixelformats()) {
+            if (QLibCameraManager::toQtFormat(pixelFormat) == QVideoFrameFormat::Format_Invalid)
+                continue;
+            const std::vector<Size> sizes = formats.sizes(pixelFormat);
+            if (sizes.empty())
+                continue;
+
+            /* Sizes are sorted in ascending order, largest is the fallback */
+            QSize size(sizes.back().width, sizes.back().height);
+            if (neededSize.isValid()) {
+                for (const Size &s : sizes) {
+                    if (int(s.width) >= neededSize.width() && int(s.height) >= neededSize.height()) {
+                        size = QSize(s.width, s.height);
+                        break;
+                    }
+                }
+            }
+            modes.append({ pixelFormat, size });
+        }
+    }
+    return modes;
+}
+
+CaptureFormatSelector::Mode CaptureFormatSelector::storedMode(const QList<StreamFormats> &viewfinderInfo) const
+{
+    return loadDecision(candidates(viewfinderInfo));
+}
+
+CaptureFormatSelector::Mode CaptureFormatSelector::select(const QList<StreamFormats> &viewfinderInfo)
+{
+    const QList<Mode> modes = candidates(viewfinderInfo);
+    if (modes.isEmpty())
+        return {};
+
+    const Mode stored = loadDecision(modes);
+    if (stored.isValid()) {
+        qInfo() << "Using stored capture mode for" << m_cameraModel
+                << stored.format.toString().c_str() << stored.size;
+        return stored;
+    }
+
+    m_measurements.clear();
+    QElapsedTimer timer;
+    timer.start();
+    for (const Mode &mode : modes) {
+        const int remaining = kSelectTimeoutMs - int(timer.elapsed());
+        if (m_cancelled || remaining <= 0)
+            break;
+        Measurement measurement;
+        if (!measure(mode, std::min(remaining, kMeasureTimeoutMs), &measurement))
+            continue;
+        qInfo() << "Capture mode" << mode.format.toString().c_str() << mode.size
+                << "fps:" << measurement.fps << "cost:" << measurement.cost << "ms";
+        m_measurements.append(measurement);
+    }
+    if (m_cancelled)
+        return {};
+
+    const Measurement *best = nullptr;
+    for (const Measurement &m : std::as_const(m_measurements)) {
+        if (m.fps < m_minimumFps)
+            continue;
+        if (!best || m.cost < best->cost)
+            best = &m;
+    }
+    /* Nothing reaches the minimum rate, take the fastest one */
+    if (!best) {
+        for (const Measurement &m : std::as_const(m_measurements)) {
+            if (!best || m.fps > best->fps)
+                best = &m;
+        }
+    }
+    if (!best)
+        return {};
+
+    storeDecision(best->mode);
+    return best->mode;
+}
+
+bool CaptureFormatSelector::measure(const Mode &mode, int timeoutMs, Measurement *result)
+{
+    std::vector<StreamRole> roles{ StreamRole::Viewfinder };
+    std::unique_ptr<CameraConfiguration> config = m_camera->generateConfiguration(roles);
+    if (!config)
+        return false;
+
+    StreamConfiguration &cfg = config->at(0);
+    cfg.pixelFormat = mode.format;
+    cfg.size = Size(mode.size.width(), mode.size.height());
+    if (config->validate() != CameraConfiguration::Valid) {
+        qInfo() << "Capture mode" << cfg.toString().c_str() << "adjusted by the camera, skipped";
+        return false;
+    }
+    if (m_camera->configure(config.get()) < 0)
+        return false;
+
+    Stream *stream = cfg.stream();
+    FrameBufferAllocator allocator(m_camera);
+    if (allocator.allocate(stream) < 0)
+        return false;
+
+    std::map<FrameBuffer *, std::unique_ptr<Image>> mappedBuffers;
+    std::vector<std::unique_ptr<Request>> requests;
+    for (const std::unique_ptr<FrameBuffer> &buffer : allocator.buffers(stream)) {
+        std::unique_ptr<Image> image = Image::fromFrameBuffer(buffer.get(), Image::MapMode::ReadOnly);
+        std::unique_ptr<Request> request = m_camera->createRequest();
+        if (!image || !request || request->addBuffer(stream, buffer.get()) < 0)
+            return false;
+        mappedBuffers[buffer.get()] = std::move(image);
+        requests.push_back(std::move(request));
+    }
+
+    m_camera->requestCompleted.connect(this, &CaptureFormatSelector::requestComplete);
+    if (m_camera->start()) {
+        m_camera->requestCompleted.disconnect(this);
+        return false;
+    }
+    for (std::unique_ptr<Request> &request : requests)
+        m_camera->queueRequest(request.get());
+
+    int frames = 0;
+    uint64_t firstTimestamp = 0;
+    uint64_t lastTimestamp = 0;
+    qint64 cpuTime = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    while (frames < kWarmupFrames + kMeasuredFrames && timer.elapsed() < timeoutMs && !m_cancelled) {
+        Request *request = nullptr;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_doneQueue.isEmpty())
+                m_requestDone.wait(&m_mutex, QDeadlineTimer(timeoutMs - timer.elapsed()));
+            if (m_doneQueue.isEmpty())
+                break;
+            request = m_doneQueue.dequeue();
+        }
+
+        if (request->status() == Request::RequestComplete) {
+            FrameBuffer *buffer = request->buffers().at(stream);
+            if (frames >= kWarmupFrames) {
+                const FrameMetadata &metadata = buffer->metadata();
+                if (frames == kWarmupFrames)
+                    firstTimestamp = metadata.timestamp;
+                lastTimestamp = metadata.timestamp;
+
+                const qint64 start = threadCpuTimeNs();
+                convertFrame(mode, mappedBuffers[buffer].get());
+                cpuTime += threadCpuTimeNs() - start;
+            }
+            frames++;
+        }
+        request->reuse(Request::ReuseBuffers);
+        m_camera->queueRequest(request);
+    }
+
+    m_camera->stop();
+    m_camera->requestCompleted.disconnect(this);
+    {
+        QMutexLocker locker(&m_mutex);
+        m_doneQueue.clear();
+    }
+
+    const int measured = frames - kWarmupFrames;
+    if (measured < 2 || lastTimestamp <= firstTimestamp)
+        return false;
+
+    result->mode = mode;
+    result->fps = (measured - 1) * 1000000000.0 / (lastTimestamp - firstTimestamp);
+    result->cost = cpuTime / 1000000.0 / measured;
+    return true;
+}
+
+void CaptureFormatSelector::convertFrame(const Mode &mode, const Image *image) const
+{
+    /* Same work the capture path does: copy out of the capture buffer and convert */
+    QVideoFrame frame(QVideoFrameFormat(mode.size, QLibCameraManager::toQtFormat(mode.format)));
+    if (!frame.map(QVideoFrame::WriteOnly))
+        return;
+    /* Every plane, NV12 and YUV420 would look cheaper than they are otherwise */
+    {
+        Image::CpuAccess access(image);
+        const int planes = std::min(frame.planeCount(), int(image->numPlanes()));
+        for (int plane = 0; plane < planes; ++plane)
+            image->copyPlane(plane, frame.bits(plane), frame.mappedBytes(plane));
+    }
+    frame.unmap();
+
+    VideoFilterFrame filterFrame(frame);
+    if (m_requirements.isEmpty()) {
+        filterFrame.image({});
+        return;
+    }
+    for (const FrameRequirements &req : m_requirements)
+        filterFrame.image(req);
+}
+
+void CaptureFormatSelector::requestComplete(Request *request)
+{
+    /* libcamera thread, just hand the request over */
+    QMutexLocker locker(&m_mutex);
+    m_doneQueue.enqueue(request);
+    m_requestDone.wakeOne();
+}
+
+CaptureFormatSelector::Mode CaptureFormatSelector::loadDecision(const QList<Mode> &candidates) const
+{
+    QSettings settings;
+    settings.beginGroup(QStringLiteral("autoFormat"));
+    settings.beginGroup(settingsKey(m_cameraModel));
+    const auto format = PixelFormat::fromString(settings.value(QStringLiteral("format")).toString().toStdString());
+    const QSize size = settings.value(QStringLiteral("size")).toSize();
+
+    /* The camera modes or the filters could have changed since */
+    for (const Mode &mode : candidates) {
+        if (mode.format == format && mode.size == size)
+            return mode;
+    }
+    return {};
+}
+
+void CaptureFormatSelector::storeDecision(const Mode &mode) const
+{
+    QSettings settings;
+    settings.beginGroup(QStringLiteral("autoFormat"));
+    settings.beginGroup(settingsKey(m_cameraModel));
+    settings.setValue(QStringLiteral("format"), QString::fromStdString(mode.format.toString()));
+    settings.setValue(QStringLiteral("size"), mode.size);
+}
+
+void CaptureFormatSelector::forgetDecision(const QString &cameraModel)
+{
+    QSettings settings;
+    settings.beginGroup(QStringLiteral("autoFormat"));
+    settings.remove(settingsKey(cameraModel));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QSize>
+#include <QString>
+#include <QWaitCondition>
+
+#include <libcamera/camera.h>
+#include <libcamera/pixel_format.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+#include <atomic>
+#include <memory>
+
+#include "videofilterframe.h"
+
+/*
+ * Picks capture format and resolution for a camera by measuring on the target
+ * machine what each candidate mode costs: capture rate and CPU time spent per
+ * frame to copy it and produce the conversions the attached filters ask for.
+ * The decision is persisted per camera model, so the measurement runs once.
+ *
+ * A measurement takes up to a few seconds per mode, 15 s at most in total,
+ * select() is meant to run on a thread of its own.
+ */
+class CaptureFormatSelector
+{
+public:
+    struct Mode {
+        libcamera::PixelFormat format;
+        QSize size;
+
+        bool isValid() const { return format.isValid() && size.isValid(); }
+    };
+
+    struct Measurement {
+        Mode mode;
+        double fps = 0.0;
+        // CPU time per frame, ms
+        double cost = 0.0;
+    };
+
+    CaptureFormatSelector(std::shared_ptr<libcamera::Camera> camera, const QString &cameraModel);
+    ~CaptureFormatSelector();
+
+    void setRequirements(const QList<FrameRequirements> &requirements);
+    void setMinimumFps(double fps);
+
+    // decision stored for the current candidates, invalid if there is none. Cheap
+    Mode storedMode(const QList<libcamera::StreamFormats> &viewfinderInfo) const;
+    // camera has to be acquired and stopped
+    Mode select(const QList<libcamera::StreamFormats> &viewfinderInfo);
+    // any thread, select() returns an invalid mode soon and stores nothing
+    void cancel() { m_cancelled = true; }
+    QList<Measurement> measurements() const { return m_measurements; }
+
+    static void forgetDecision(const QString &cameraModel);
+
+private:
+    QList<Mode> candidates(const QList<libcamera::StreamFormats> &viewfinderInfo) const;
+    bool measure(const Mode &mode, int timeoutMs, Measurement *result);
+    void convertFrame(const Mode &mode, const Image *image) const;
+    void requestComplete(libcamera::Request *request);
+
+    Mode loadDecision(const QList<Mode> &candidates) const;
+    void storeDecision(const Mode &mode) const;
+
+    std::shared_ptr<libcamera::Camera> m_camera;
+    QString m_cameraModel;
+    QList<FrameRequirements> m_requirements;
+    double m_minimumFps = 15.0;
+    QList<Measurement> m_measurements;
+    std::atomic<bool> m_cancelled { false };
+
+    QMutex m_mutex;
+    QWaitCondition m_requestDone;
+    QQueue<libcamera::Request *> m_doneQueue;
+};
@@ -0,0 +1,50 @@
+#include "acceleratorqueue.h"
+
+#include <pthread.h>
+
+AcceleratorQueue::AcceleratorQueue(const QByteArray &name)
+{
+    m_thread = std::thread(&AcceleratorQueue::loop, this);
+    /* Thread names are limited to 15 characters */
+    pthread_setname_np(m_thread.native_handle(), name.left(15).constData());
+}
+
+AcceleratorQueue::~AcceleratorQueue()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wake.wakeAll();
+    }
+    m_thread.join();
+}
+
+void AcceleratorQueue::post(Job job)
+{
+    QMutexLocker locker(&m_mutex);
+    m_jobs.push_back(std::move(job));
+    m_wake.wakeOne();
+}
+
+int AcceleratorQueue::queueDepth() const
+{
+    QMutexLocker locker(&m_mutex);
+    return int(m_jobs.size());
+}
+
+void AcceleratorQueue::loop()
+{
+    for (;;) {
+        Job job;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_jobs.empty() && !m_stopping)
+                m_wake.wait(&m_mutex);
+            if (m_jobs.empty())
+                return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <type_traits>
+
+#include "pipelinecoroutine.h"
+
+/*
+ * Dedicated thread serializing the calls into an accelerator, or any other
+ * blocking API, in submission order. Pipeline workers hand the blocking call
+ * over and, from a coroutine, await its result without holding the worker.
+ * The jobs still queued when the queue is destroyed run first.
+ */
+class AcceleratorQueue
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit AcceleratorQueue(const QByteArray &name);
+    ~AcceleratorQueue();
+
+    void post(Job job);
+    // jobs waiting, the running one not included
+    int queueDepth() const;
+
+    // co_await queue.run(...) in a filter coroutine
+    template<typename Function>
+    PipelineFuture<std::invoke_result_t<Function>> run(Function function)
+    {
+        PipelinePromise<std::invoke_result_t<Function>> promise;
+        PipelineFuture<std::invoke_result_t<Function>> future = promise.future();
+        post([promise, function = std::move(function)]() mutable {
+            promise.setValue(function());
+        });
+        return future;
+    }
+
+private:
+    Q_DISABLE_COPY(AcceleratorQueue)
+
+    void loop();
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_wake;
+    std::deque<Job> m_jobs;
+    bool m_stopping = false;
+    std::thread m_thread;
+};
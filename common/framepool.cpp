@@ -0,0 +1,330 @@
+#include "framepool.h"
+#include "latencyhistogram.h"
+
+#include <QDebug>
+
+#include <private/qabstractvideobuffer_p.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+// free blocks are checked against the sizes asked for once a second, sizes
+// not asked for during 10 seconds no longer keep blocks
+constexpr qint64 kSweepInterval = 1'000'000'000;
+constexpr qint64 kStaleTime = 10'000'000'000;
+
+/* Video buffer over a pool block, the block returns to the pool with the last frame copy */
+class PooledVideoBuffer : public QAbstractVideoBuffer
+{
+public:
+    PooledVideoBuffer(std::shared_ptr<FramePool::Block> block, int bytesPerLine, size_t size)
+        : QAbstractVideoBuffer(QVideoFrame::NoHandle)
+        , m_block(std::move(block))
+        , m_bytesPerLine(bytesPerLine)
+        , m_size(size)
+    {
+    }
+
+    QVideoFrame::MapMode mapMode() const override { return m_mapMode; }
+
+    MapData map(QVideoFrame::MapMode mode) override
+    {
+        MapData mapData;
+        if (m_mapMode == QVideoFrame::NotMapped && mode != QVideoFrame::NotMapped) {
+            m_mapMode = mode;
+            /* QVideoFrame splits the single plane according to the pixel format */
+            mapData.nPlanes = 1;
+            mapData.bytesPerLine[0] = m_bytesPerLine;
+            mapData.data[0] = m_block->data;
+            mapData.size[0] = int(m_size);
+        }
+        return mapData;
+    }
+
+    void unmap() override { m_mapMode = QVideoFrame::NotMapped; }
+
+private:
+    std::shared_ptr<FramePool::Block> m_block;
+    int m_bytesPerLine = 0;
+    size_t m_size = 0;
+    QVideoFrame::MapMode m_mapMode = QVideoFrame::NotMapped;
+};
+
+void releaseImageBlock(void *info)
+{
+    delete static_cast<std::shared_ptr<FramePool::Block> *>(info);
+}
+}
+
+Q_GLOBAL_STATIC(FramePool, framePoolInstance);
+
+FramePool *FramePool::instance()
+{
+    return framePoolInstance();
+}
+
+FramePool::State::~State()
+{
+    for (auto &[size, block] : freeBlocks)
+        freeBlock(nullptr, block);
+}
+
+FramePool::FramePool() = default;
+
+FramePool::~FramePool()
+{
+    m_state->enabled = false;
+    trim();
+}
+
+bool FramePool::isEnabled() const
+{
+    return m_state->enabled;
+}
+
+void FramePool::setEnabled(bool enabled)
+{
+    if (m_state->enabled == enabled)
+        return;
+    m_state->enabled = enabled;
+    if (!enabled)
+        trim();
+}
+
+void FramePool::tuneMalloc()
+{
+#ifdef __GLIBC__
+    /*
+     * Intermediate buffers Qt allocates on its own (scaled images, JPEG decode)
+     * are kept on the heap and not given back to the system, so they don't
+     * page fault on every frame either. Process wide and for good
+     */
+    mallopt(M_MMAP_THRESHOLD, 32 * 1024 * 1024);
+    mallopt(M_TRIM_THRESHOLD, 256 * 1024 * 1024);
+#endif
+}
+
+size_t FramePool::roundToPages(size_t size)
+{
+    return (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+int FramePool::imageBytesPerLine(int width, QImage::Format format)
+{
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    return ((width * depth + 31) / 32) * 4;
+}
+
+FramePool::Block *FramePool::allocateBlock(size_t size)
+{
+    auto block = new Block;
+    block->size = size;
+
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (address != MAP_FAILED) {
+        block->hugePages = true;
+    } else {
+        /* No reserved huge pages, ask for transparent ones */
+        address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED) {
+            qWarning() << "Failed to allocate frame pool block:" << strerror(errno);
+            delete block;
+            return nullptr;
+        }
+        madvise(address, size, MADV_HUGEPAGE);
+    }
+    block->data = static_cast<uint8_t *>(address);
+
+    if (mlock(address, size) == 0) {
+        block->locked = true;
+        m_state->pinnedBytes += size;
+    } else if (!m_lockWarned.exchange(true)) {
+        qWarning() << "Failed to lock frame pool memory:" << strerror(errno)
+                   << "- check RLIMIT_MEMLOCK";
+    }
+
+    /* Prefault, MAP_POPULATE is only a hint */
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += pageSize)
+        block->data[offset] = 0;
+
+    if (block->hugePages)
+        m_state->hugePageBytes += size;
+    return block;
+}
+
+void FramePool::freeBlock(State *state, Block *block)
+{
+    if (state && block->locked)
+        state->pinnedBytes -= block->size;
+    if (state && block->hugePages)
+        state->hugePageBytes -= block->size;
+    munmap(block->data, block->size);
+    delete block;
+}
+
+void FramePool::recycle(const std::shared_ptr<State> &state, Block *block)
+{
+    if (!state || !state->enabled) {
+        freeBlock(state.get(), block);
+        return;
+    }
+    QMutexLocker locker(&state->mutex);
+    state->freeBlocks.emplace(block->size, block);
+}
+
+std::shared_ptr<FramePool::Block> FramePool::acquire(size_t size)
+{
+    if (!m_state->enabled || size == 0)
+        return nullptr;
+
+    std::call_once(m_mallocTuned, &FramePool::tuneMalloc);
+
+    const size_t blockSize = roundToPages(size);
+    Block *block = nullptr;
+    std::vector<Block *> stale;
+    {
+        QMutexLocker locker(&m_state->mutex);
+        const qint64 now = LatencyHistogram::now();
+        m_state->requestedAt[blockSize] = now;
+        if (now >= m_state->nextSweep) {
+            m_state->nextSweep = now + kSweepInterval;
+            takeStaleBlocks(*m_state, now, &stale);
+        }
+        /* Don't waste a much bigger block on a small request */
+        auto it = m_state->freeBlocks.lower_bound(blockSize);
+        if (it != m_state->freeBlocks.end() && it->first <= blockSize * 2) {
+            block = it->second;
+            m_state->freeBlocks.erase(it);
+        }
+    }
+    for (Block *staleBlock : stale)
+        freeBlock(m_state.get(), staleBlock);
+    if (!block)
+        block = allocateBlock(blockSize);
+    if (!block)
+        return nullptr;
+
+    return std::shared_ptr<Block>(block, [state = std::weak_ptr<State>(m_state)](Block *b) {
+        recycle(state.lock(), b);
+    });
+}
+
+void FramePool::takeStaleBlocks(State &state, qint64 now, std::vector<Block *> *stale)
+{
+    for (auto it = state.requestedAt.begin(); it != state.requestedAt.end();)
+        it = now - it->second > kStaleTime ? state.requestedAt.erase(it) : std::next(it);
+
+    for (auto it = state.freeBlocks.begin(); it != state.freeBlocks.end();) {
+        /* acquire() hands a block out for requests of half its size and more */
+        const auto request = state.requestedAt.lower_bound((it->first + 1) / 2);
+        if (request != state.requestedAt.end() && request->first <= it->first) {
+            ++it;
+            continue;
+        }
+        stale->push_back(it->second);
+        it = state.freeBlocks.erase(it);
+    }
+}
+
+void FramePool::trim()
+{
+    std::multimap<size_t, Block *> freeBlocks;
+    {
+        QMutexLocker locker(&m_state->mutex);
+        freeBlocks.swap(m_state->freeBlocks);
+    }
+    for (auto &[size, block] : freeBlocks)
+        freeBlock(m_state.get(), block);
+}
+
+FramePool::FrameLayout FramePool::frameLayout(const QVideoFrameFormat &format)
+{
+    const QSize size = format.frameSize();
+    const quint64 key = (quint64(format.pixelFormat()) << 40) | (quint64(size.width()) << 20) | quint64(size.height());
+
+    QMutexLocker locker(&m_mutex);
+    auto it = m_frameLayouts.constFind(key);
+    if (it != m_frameLayouts.constEnd())
+        return *it;
+
+    /* Let Qt compute strides and plane sizes once per format */
+    FrameLayout layout;
+    QVideoFrame probe(format);
+    if (probe.map(QVideoFrame::WriteOnly)) {
+        layout.bytesPerLine = probe.bytesPerLine(0);
+        for (int plane = 0; plane < probe.planeCount(); ++plane)
+            layout.size += probe.mappedBytes(plane);
+        probe.unmap();
+    }
+    m_frameLayouts.insert(key, layout);
+    return layout;
+}
+
+void FramePool::reserveFrames(const QVideoFrameFormat &format, int count)
+{
+    const FrameLayout layout = frameLayout(format);
+    if (layout.size == 0)
+        return;
+
+    /* Blocks go back to the pool as soon as the last reference drops */
+    std::vector<std::shared_ptr<Block>> blocks;
+    for (int i = 0; i < count; ++i)
+        blocks.push_back(acquire(layout.size));
+}
+
+void FramePool::reserveImages(const QSize &size, QImage::Format format, int count)
+{
+    const size_t bytes = size_t(imageBytesPerLine(size.width(), format)) * size.height();
+    std::vector<std::shared_ptr<Block>> blocks;
+    for (int i = 0; i < count; ++i)
+        blocks.push_back(acquire(bytes));
+}
+
+QVideoFrame FramePool::videoFrame(const QVideoFrameFormat &format)
+{
+    if (!m_state->enabled)
+        return QVideoFrame(format);
+
+    const FrameLayout layout = frameLayout(format);
+    auto block = acquire(layout.size);
+    if (!block)
+        return QVideoFrame(format);
+
+    return QVideoFrame(new PooledVideoBuffer(std::move(block), layout.bytesPerLine, layout.size), format);
+}
+
+QImage FramePool::image(const QSize &size, QImage::Format format)
+{
+    if (!m_state->enabled)
+        return QImage(size, format);
+
+    const int bytesPerLine = imageBytesPerLine(size.width(), format);
+    auto block = acquire(size_t(bytesPerLine) * size.height());
+    if (!block)
+        return QImage(size, format);
+
+    uint8_t *data = block->data;
+    return QImage(data, size.width(), size.height(), bytesPerLine, format,
+                  releaseImageBlock, new std::shared_ptr<Block>(std::move(block)));
+}
+
+size_t FramePool::pinnedBytes() const
+{
+    return m_state->pinnedBytes;
+}
+
+size_t FramePool::hugePageBytes() const
+{
+    return m_state->hugePageBytes;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QSize>
+#include <QVideoFrame>
+#include <QVideoFrameFormat>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Pool of frame and conversion buffers for low latency deployments.
+ * Buffers are backed by 2MB huge pages when the system has them, locked in
+ * memory and prefaulted, so the frame path neither page faults nor misses the
+ * TLB on freshly allocated memory. Released buffers go back to the pool and
+ * are reused for the next frame of the same size. Free buffers no frame size
+ * asked for during the last seconds fits anymore, e.g. after a resolution
+ * change, are unmapped.
+ * Disabled by default, then it hands out regular heap backed frames and images.
+ *
+ * With glibc, the first buffer handed out also raises the process wide malloc
+ * mmap and trim thresholds (32MB and 256MB), so the buffers Qt allocates on
+ * its own (scaled images, JPEG decode) stay on the heap instead of being
+ * mapped and faulted in for every frame. They stay raised for the life of the
+ * process: setting them turns the glibc dynamic mmap threshold off for good,
+ * no value set back would restore it.
+ */
+class FramePool
+{
+public:
+    struct Block {
+        uint8_t *data = nullptr;
+        size_t size = 0;
+        bool hugePages = false;
+        bool locked = false;
+    };
+
+    static FramePool *instance();
+
+    bool isEnabled() const;
+    void setEnabled(bool enabled);
+
+    // prefaults count buffers able to hold frames of the given format
+    void reserveFrames(const QVideoFrameFormat &format, int count);
+    void reserveImages(const QSize &size, QImage::Format format, int count);
+    // unmaps all the buffers not in use
+    void trim();
+
+    std::shared_ptr<Block> acquire(size_t size);
+
+    QVideoFrame videoFrame(const QVideoFrameFormat &format);
+    QImage image(const QSize &size, QImage::Format format);
+
+    size_t pinnedBytes() const;
+    size_t hugePageBytes() const;
+
+    FramePool();
+    ~FramePool();
+
+private:
+    Q_DISABLE_COPY(FramePool)
+
+    struct FrameLayout {
+        int bytesPerLine = 0;
+        size_t size = 0;
+    };
+
+    // the blocks given out refer to it weakly, frames still held at exit
+    // (e.g. by QML) are unmapped instead of going back to a destroyed pool
+    struct State {
+        std::atomic<bool> enabled { false };
+        std::atomic<size_t> pinnedBytes { 0 };
+        std::atomic<size_t> hugePageBytes { 0 };
+        QMutex mutex;
+        // free blocks by size
+        std::multimap<size_t, Block *> freeBlocks;
+        // when each block size was last asked for
+        std::map<size_t, qint64> requestedAt;
+        qint64 nextSweep = 0;
+
+        // blocks recycled while the pool went away
+        ~State();
+    };
+
+    static size_t roundToPages(size_t size);
+    static int imageBytesPerLine(int width, QImage::Format format);
+    FrameLayout frameLayout(const QVideoFrameFormat &format);
+    Block *allocateBlock(size_t size);
+    // state is null once the pool is gone
+    static void freeBlock(State *state, Block *block);
+    static void recycle(const std::shared_ptr<State> &state, Block *block);
+    // takes the free blocks no recently asked for size fits out of the pool, its lock held
+    static void takeStaleBlocks(State &state, qint64 now, std::vector<Block *> *stale);
+    static void tuneMalloc();
+
+    const std::shared_ptr<State> m_state = std::make_shared<State>();
+    std::atomic<bool> m_lockWarned { false };
+    std::once_flag m_mallocTuned;
+
+    QMutex m_mutex;
+    QHash<quint64, FrameLayout> m_frameLayouts;
+};
@@ -1,13 +1,20 @@
 #include "image.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <errno.h>
 #include <iostream>
+#include <linux/dma-buf.h>
 #include <map>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 using namespace libcamera;
 
 std::unique_ptr<Image> Image::fromFrameBuffer(const FrameBuffer *buffer, MapMode mode)
@@ -68,11 +75,23 @@ std::unique_ptr<Image> Image::fromFrameBuffer(const FrameBuffer *buffer, MapMode
 
 			info.address = static_cast<uint8_t *>(address);
 			image->maps_.emplace_back(info.address, info.mapLength);
+			image->fds_.push_back(fd);
 		}
 
 		image->planes_.emplace_back(info.address + plane.offset, plane.length);
 	}
 
+	/*
+	 * Buffers which are not dmabufs (e.g. memfd) reject the sync ioctl and
+	 * don't need any cache maintenance.
+	 */
+	image->mode_ = mode;
+	image->mappingType_ = MappingType::DmaBuf;
+	if (image->syncDmaBufs(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ) == -ENOTTY)
+		image->mappingType_ = MappingType::Memory;
+	else
+		image->syncDmaBufs(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
 	return image;
 }
 
@@ -100,3 +119,154 @@ Span<const uint8_t> Image::data(unsigned int plane) const
 	assert(plane <= planes_.size());
 	return planes_[plane];
 }
+
+Image::MappingType Image::mappingType() const
+{
+	return mappingType_;
+}
+
+int Image::syncDmaBufs(uint64_t flags) const
+{
+	struct dma_buf_sync sync = {};
+	sync.flags = flags;
+
+	for (int fd : fds_) {
+		int ret;
+		do {
+			ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+		} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+
+		if (ret == -1)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static uint64_t dmaBufSyncAccess(Image::MapMode mode)
+{
+	uint64_t flags = 0;
+
+	if (mode & Image::MapMode::ReadOnly)
+		flags |= DMA_BUF_SYNC_READ;
+
+	if (mode & Image::MapMode::WriteOnly)
+		flags |= DMA_BUF_SYNC_WRITE;
+
+	return flags;
+}
+
+int Image::beginCpuAccess() const
+{
+	if (mappingType_ != MappingType::DmaBuf)
+		return 0;
+
+	int ret = syncDmaBufs(DMA_BUF_SYNC_START | dmaBufSyncAccess(mode_));
+	if (ret < 0)
+		std::cerr << "Failed to begin CPU access: " << strerror(-ret)
+			  << std::endl;
+	return ret;
+}
+
+int Image::endCpuAccess() const
+{
+	if (mappingType_ != MappingType::DmaBuf)
+		return 0;
+
+	int ret = syncDmaBufs(DMA_BUF_SYNC_END | dmaBufSyncAccess(mode_));
+	if (ret < 0)
+		std::cerr << "Failed to end CPU access: " << strerror(-ret)
+			  << std::endl;
+	return ret;
+}
+
+void Image::copyPlane(unsigned int plane, uint8_t *dst, size_t size) const
+{
+	assert(plane < planes_.size());
+	size = std::min(size, planes_[plane].size());
+	/* Capture buffers are often mapped uncached, plain memory goes through the cache */
+	if (mappingType_ == MappingType::DmaBuf)
+		streamingCopy(dst, planes_[plane].data(), size);
+	else
+		memcpy(dst, planes_[plane].data(), size);
+}
+
+void Image::streamingCopy(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__SSE2__)
+	/* Align the source, the loads are the expensive part on uncached memory */
+	size_t head = (16 - (reinterpret_cast<uintptr_t>(src) & 15)) & 15;
+	head = std::min(head, size);
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	const bool alignedDst = (reinterpret_cast<uintptr_t>(dst) & 15) == 0;
+	const size_t blocks = size / 64;
+
+	for (size_t i = 0; i < blocks; ++i) {
+		__m128i *s = reinterpret_cast<__m128i *>(const_cast<uint8_t *>(src));
+#if defined(__SSE4_1__)
+		__m128i r0 = _mm_stream_load_si128(s);
+		__m128i r1 = _mm_stream_load_si128(s + 1);
+		__m128i r2 = _mm_stream_load_si128(s + 2);
+		__m128i r3 = _mm_stream_load_si128(s + 3);
+#else
+		__m128i r0 = _mm_load_si128(s);
+		__m128i r1 = _mm_load_si128(s + 1);
+		__m128i r2 = _mm_load_si128(s + 2);
+		__m128i r3 = _mm_load_si128(s + 3);
+#endif
+		__m128i *d = reinterpret_cast<__m128i *>(dst);
+		if (alignedDst) {
+			_mm_stream_si128(d, r0);
+			_mm_stream_si128(d + 1, r1);
+			_mm_stream_si128(d + 2, r2);
+			_mm_stream_si128(d + 3, r3);
+		} else {
+			_mm_storeu_si128(d, r0);
+			_mm_storeu_si128(d + 1, r1);
+			_mm_storeu_si128(d + 2, r2);
+			_mm_storeu_si128(d + 3, r3);
+		}
+		src += 64;
+		dst += 64;
+	}
+	_mm_sfence();
+
+	memcpy(dst, src, size - blocks * 64);
+#elif defined(__aarch64__)
+	/* ldnp/stnp hint the loads and stores not to allocate in the caches */
+	const size_t blocks = size / 64;
+
+	for (size_t i = 0; i < blocks; ++i) {
+		asm volatile("prfm pldl1strm, [%0, #256]\n"
+			     "ldnp q0, q1, [%0]\n"
+			     "ldnp q2, q3, [%0, #32]\n"
+			     "stnp q0, q1, [%1]\n"
+			     "stnp q2, q3, [%1, #32]\n"
+			     :
+			     : "r"(src), "r"(dst)
+			     : "v0", "v1", "v2", "v3", "memory");
+		src += 64;
+		dst += 64;
+	}
+
+	memcpy(dst, src, size - blocks * 64);
+#else
+	/* No non-temporal loads (32 bit ARM among others), leave it to the libc */
+	memcpy(dst, src, size);
+#endif
+}
+
+Image::CpuAccess::CpuAccess(const Image *image)
+	: image_(image)
+{
+	image_->beginCpuAccess();
+}
+
+Image::CpuAccess::~CpuAccess()
+{
+	image_->endCpuAccess();
+}
@@ -19,6 +19,26 @@ public:
 		ReadWrite = ReadOnly | WriteOnly,
 	};
 
+	enum class MappingType {
+		/* dmabuf, CPU access has to be bracketed for cache maintenance */
+		DmaBuf,
+		/* plain memory, no cache maintenance */
+		Memory,
+	};
+
+	/* Brackets CPU access to the mapped planes for the scope lifetime */
+	class CpuAccess
+	{
+	public:
+		explicit CpuAccess(const Image *image);
+		~CpuAccess();
+
+	private:
+		LIBCAMERA_DISABLE_COPY(CpuAccess)
+
+		const Image *image_;
+	};
+
 	static std::unique_ptr<Image> fromFrameBuffer(const libcamera::FrameBuffer *buffer,
 						      MapMode mode);
 
@@ -29,11 +49,31 @@ public:
 	libcamera::Span<uint8_t> data(unsigned int plane);
 	libcamera::Span<const uint8_t> data(unsigned int plane) const;
 
+	MappingType mappingType() const;
+
+	int beginCpuAccess() const;
+	int endCpuAccess() const;
+
+	/*
+	 * Copies the plane, with non-temporal loads and stores if it is a dmabuf
+	 * mapping, which is much faster when the plane is mapped uncached or
+	 * write-combined and does not evict the CPU caches. Non-temporal copies
+	 * are implemented for SSE2 and AArch64, other CPUs use memcpy. Has to be
+	 * called inside a CPU access bracket.
+	 */
+	void copyPlane(unsigned int plane, uint8_t *dst, size_t size) const;
+	static void streamingCopy(uint8_t *dst, const uint8_t *src, size_t size);
+
 private:
 	LIBCAMERA_DISABLE_COPY(Image)
 
 	Image();
 
+	int syncDmaBufs(uint64_t flags) const;
+
+	MapMode mode_ = MapMode::ReadOnly;
+	MappingType mappingType_ = MappingType::Memory;
+	std::vector<int> fds_;
 	std::vector<libcamera::Span<uint8_t>> maps_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
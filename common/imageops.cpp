@@ -0,0 +1,401 @@
+#include "imageops.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace ImageOps {
+
+bool lumaLayout(QVideoFrameFormat::PixelFormat format, int *pixelStride, int *offset)
+{
+    switch (format) {
+    case QVideoFrameFormat::Format_NV12:
+    case QVideoFrameFormat::Format_NV21:
+    case QVideoFrameFormat::Format_YUV420P:
+    case QVideoFrameFormat::Format_YUV422P:
+    case QVideoFrameFormat::Format_YV12:
+    case QVideoFrameFormat::Format_IMC1:
+    case QVideoFrameFormat::Format_IMC2:
+    case QVideoFrameFormat::Format_IMC3:
+    case QVideoFrameFormat::Format_IMC4:
+    case QVideoFrameFormat::Format_Y8:
+        *pixelStride = 1;
+        *offset = 0;
+        return true;
+    case QVideoFrameFormat::Format_YUYV:
+        *pixelStride = 2;
+        *offset = 0;
+        return true;
+    case QVideoFrameFormat::Format_UYVY:
+        *pixelStride = 2;
+        *offset = 1;
+        return true;
+    case QVideoFrameFormat::Format_P010:
+    case QVideoFrameFormat::Format_P016:
+    case QVideoFrameFormat::Format_Y16:
+        *pixelStride = 2;
+        *offset = 1;
+        return true;
+    case QVideoFrameFormat::Format_ARGB8888:
+    case QVideoFrameFormat::Format_ARGB8888_Premultiplied:
+    case QVideoFrameFormat::Format_XRGB8888:
+    case QVideoFrameFormat::Format_ABGR8888:
+    case QVideoFrameFormat::Format_XBGR8888:
+        *pixelStride = 4;
+        *offset = 2;
+        return true;
+    case QVideoFrameFormat::Format_BGRA8888:
+    case QVideoFrameFormat::Format_BGRA8888_Premultiplied:
+    case QVideoFrameFormat::Format_BGRX8888:
+    case QVideoFrameFormat::Format_RGBA8888:
+    case QVideoFrameFormat::Format_RGBX8888:
+        *pixelStride = 4;
+        *offset = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool rgbLayout(QVideoFrameFormat::PixelFormat format, int *red, int *green, int *blue)
+{
+    switch (format) {
+    case QVideoFrameFormat::Format_ARGB8888:
+    case QVideoFrameFormat::Format_ARGB8888_Premultiplied:
+    case QVideoFrameFormat::Format_XRGB8888:
+        *red = 1;
+        *green = 2;
+        *blue = 3;
+        return true;
+    case QVideoFrameFormat::Format_BGRA8888:
+    case QVideoFrameFormat::Format_BGRA8888_Premultiplied:
+    case QVideoFrameFormat::Format_BGRX8888:
+        *red = 2;
+        *green = 1;
+        *blue = 0;
+        return true;
+    case QVideoFrameFormat::Format_ABGR8888:
+    case QVideoFrameFormat::Format_XBGR8888:
+        *red = 3;
+        *green = 2;
+        *blue = 1;
+        return true;
+    case QVideoFrameFormat::Format_RGBA8888:
+    case QVideoFrameFormat::Format_RGBX8888:
+        *red = 0;
+        *green = 1;
+        *blue = 2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void downsampleLuma(const uint8_t *src, int srcStride, int width, int height,
+                    int pixelStride, int offset, int factor, uint8_t *dst, int dstStride)
+{
+    const int dstWidth = width / factor;
+    const int dstHeight = height / factor;
+    const int step = pixelStride * factor;
+
+    for (int y = 0; y < dstHeight; ++y) {
+        const uint8_t *row = src + size_t(y) * factor * srcStride + offset;
+        uint8_t *out = dst + size_t(y) * dstStride;
+
+        if (factor == 1 && pixelStride == 1) {
+            memcpy(out, row, dstWidth);
+            continue;
+        }
+        for (int x = 0; x < dstWidth; ++x) {
+            const uint8_t *pixel = row + x * step;
+            unsigned sum = 0;
+            for (int i = 0; i < factor; ++i)
+                sum += pixel[i * pixelStride];
+            out[x] = uint8_t(sum / factor);
+        }
+    }
+}
+
+void cellAbsDiff(const uint8_t *a, const uint8_t *b, int stride, int width, int height, uint32_t *sums)
+{
+    const int columns = cellCount(width);
+    memset(sums, 0, sizeof(uint32_t) * columns * cellCount(height));
+
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *rowA = a + size_t(y) * stride;
+        const uint8_t *rowB = b + size_t(y) * stride;
+        uint32_t *cells = sums + (y / kCellSize) * columns;
+        int x = 0;
+
+#if defined(__SSE2__)
+        /* One SAD instruction sums two cells of the row */
+        for (; x + 16 <= width; x += 16) {
+            const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rowA + x));
+            const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rowB + x));
+            const __m128i sad = _mm_sad_epu8(va, vb);
+            cells[x / kCellSize] += uint32_t(_mm_cvtsi128_si32(sad));
+            cells[x / kCellSize + 1] += uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(sad, 8)));
+        }
+#elif defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16) {
+            const uint8x16_t diff = vabdq_u8(vld1q_u8(rowA + x), vld1q_u8(rowB + x));
+            const uint64x2_t sad = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(diff)));
+            cells[x / kCellSize] += uint32_t(vgetq_lane_u64(sad, 0));
+            cells[x / kCellSize + 1] += uint32_t(vgetq_lane_u64(sad, 1));
+        }
+#endif
+        for (; x < width; ++x) {
+            const int diff = int(rowA[x]) - int(rowB[x]);
+            cells[x / kCellSize] += uint32_t(diff < 0 ? -diff : diff);
+        }
+    }
+}
+
+double laplacianVariance(const uint8_t *src, int stride, int width, int height)
+{
+    if (width < 3 || height < 3)
+        return 0.0;
+
+    int64_t sum = 0;
+    uint64_t sumSquares = 0;
+    for (int y = 1; y < height - 1; ++y) {
+        const uint8_t *up = src + size_t(y - 1) * stride;
+        const uint8_t *row = up + stride;
+        const uint8_t *down = row + stride;
+        int x = 1;
+
+        /* Laplacian fits 16 bits, its squares are summed in 32 bit lanes per row */
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        __m128i rowSum = zero;
+        __m128i rowSquares = zero;
+        for (; x + 9 <= width; x += 8) {
+            const auto load = [zero](const uint8_t *p) {
+                return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)), zero);
+            };
+            const __m128i neighbours = _mm_add_epi16(_mm_add_epi16(load(row + x - 1), load(row + x + 1)),
+                                                     _mm_add_epi16(load(up + x), load(down + x)));
+            const __m128i laplacian = _mm_sub_epi16(_mm_slli_epi16(load(row + x), 2), neighbours);
+            rowSum = _mm_add_epi32(rowSum, _mm_madd_epi16(laplacian, ones));
+            rowSquares = _mm_add_epi32(rowSquares, _mm_madd_epi16(laplacian, laplacian));
+        }
+        int32_t sums[4];
+        uint32_t squares[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(sums), rowSum);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(squares), rowSquares);
+        for (int i = 0; i < 4; ++i) {
+            sum += sums[i];
+            sumSquares += squares[i];
+        }
+#elif defined(__ARM_NEON)
+        int32x4_t rowSum = vdupq_n_s32(0);
+        int32x4_t rowSquares = vdupq_n_s32(0);
+        for (; x + 9 <= width; x += 8) {
+            const auto load = [](const uint8_t *p) {
+                return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+            };
+            const int16x8_t neighbours = vaddq_s16(vaddq_s16(load(row + x - 1), load(row + x + 1)),
+                                                   vaddq_s16(load(up + x), load(down + x)));
+            const int16x8_t laplacian = vsubq_s16(vshlq_n_s16(load(row + x), 2), neighbours);
+            rowSum = vpadalq_s16(rowSum, laplacian);
+            rowSquares = vmlal_s16(rowSquares, vget_low_s16(laplacian), vget_low_s16(laplacian));
+            rowSquares = vmlal_s16(rowSquares, vget_high_s16(laplacian), vget_high_s16(laplacian));
+        }
+        const int64x2_t sums = vpaddlq_s32(rowSum);
+        const uint64x2_t squares = vpaddlq_u32(vreinterpretq_u32_s32(rowSquares));
+        sum += vgetq_lane_s64(sums, 0) + vgetq_lane_s64(sums, 1);
+        sumSquares += vgetq_lane_u64(squares, 0) + vgetq_lane_u64(squares, 1);
+#endif
+        for (; x < width - 1; ++x) {
+            const int laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+            sum += laplacian;
+            sumSquares += uint64_t(laplacian * laplacian);
+        }
+    }
+
+    const double count = double(width - 2) * (height - 2);
+    const double mean = double(sum) / count;
+    return double(sumSquares) / count - mean * mean;
+}
+
+void lumaHistogram(const uint8_t *src, int stride, int width, int height,
+                   int pixelStride, int offset, int step, uint32_t *bins)
+{
+    /* Four tables, so runs of equal pixels don't wait on the same counter */
+    uint32_t tables[4][256] = {};
+    const int step4 = step * 4;
+    const int pixelStep = pixelStride * step;
+
+    for (int y = 0; y < height; y += step) {
+        const uint8_t *row = src + size_t(y) * stride + offset;
+        int x = 0;
+        for (; x + step4 <= width; x += step4) {
+            const uint8_t *pixel = row + x * pixelStride;
+            tables[0][pixel[0]]++;
+            tables[1][pixel[pixelStep]]++;
+            tables[2][pixel[2 * pixelStep]]++;
+            tables[3][pixel[3 * pixelStep]]++;
+        }
+        for (; x < width; x += step)
+            tables[0][row[x * pixelStride]]++;
+    }
+
+    for (int i = 0; i < 256; ++i)
+        bins[i] += tables[0][i] + tables[1][i] + tables[2][i] + tables[3][i];
+}
+
+void rgbHistograms(const uint8_t *src, int stride, int width, int height,
+                   int redOffset, int greenOffset, int blueOffset, int step,
+                   uint32_t *luma, uint32_t *red, uint32_t *green, uint32_t *blue)
+{
+    /*
+     * Bound by the four counter updates per pixel: neither vectorizing the
+     * channel extraction nor splitting the tables measured faster than this
+     */
+    for (int y = 0; y < height; y += step) {
+        const uint8_t *row = src + size_t(y) * stride;
+        for (int x = 0; x < width; x += step) {
+            const uint8_t *pixel = row + x * 4;
+            const unsigned r = pixel[redOffset];
+            const unsigned g = pixel[greenOffset];
+            const unsigned b = pixel[blueOffset];
+            red[r]++;
+            green[g]++;
+            blue[b]++;
+            luma[(77 * r + 150 * g + 29 * b + 128) >> 8]++;
+        }
+    }
+}
+
+void cellSums(const uint8_t *src, int stride, int width, int height, uint32_t *sums)
+{
+    const int columns = cellCount(width);
+    memset(sums, 0, sizeof(uint32_t) * columns * cellCount(height));
+
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = src + size_t(y) * stride;
+        uint32_t *cells = sums + (y / kCellSize) * columns;
+        int x = 0;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16) {
+            const __m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x)), zero);
+            cells[x / kCellSize] += uint32_t(_mm_cvtsi128_si32(sad));
+            cells[x / kCellSize + 1] += uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(sad, 8)));
+        }
+#elif defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16) {
+            const uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(row + x))));
+            cells[x / kCellSize] += uint32_t(vgetq_lane_u64(sum, 0));
+            cells[x / kCellSize + 1] += uint32_t(vgetq_lane_u64(sum, 1));
+        }
+#endif
+        for (; x < width; ++x)
+            cells[x / kCellSize] += row[x];
+    }
+}
+
+void updateBackground(const uint8_t *frame, int16_t *background, uint8_t *mask, int count,
+                      int rate, int foregroundRate, int threshold)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    /* 8 pixels per step in 16 bit lanes, the difference of 8.7 values fits */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi8(char(std::min(threshold, 255)));
+    const __m128i rateShift = _mm_cvtsi32_si128(rate);
+    const __m128i foregroundShift = _mm_cvtsi32_si128(foregroundRate);
+    for (; i + 8 <= count; i += 8) {
+        const __m128i pixels = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(frame + i));
+        const __m128i model = _mm_loadu_si128(reinterpret_cast<const __m128i *>(background + i));
+
+        // |frame - background| > threshold, in bytes with saturating subtractions
+        const __m128i modelPixels = _mm_packus_epi16(_mm_srai_epi16(model, 7), zero);
+        const __m128i difference = _mm_or_si128(_mm_subs_epu8(pixels, modelPixels), _mm_subs_epu8(modelPixels, pixels));
+        const __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(difference, limit), zero);
+        // the byte mask widened to the 16 bit lanes
+        const __m128i still16 = _mm_unpacklo_epi8(still, still);
+
+        const __m128i delta = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(pixels, zero), 7), model);
+        const __m128i step = _mm_or_si128(_mm_and_si128(still16, _mm_sra_epi16(delta, rateShift)),
+                                          _mm_andnot_si128(still16, _mm_sra_epi16(delta, foregroundShift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(background + i), _mm_add_epi16(model, step));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(mask + i), _mm_xor_si128(still, _mm_set1_epi8(-1)));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8_t limit = vdup_n_u8(uint8_t(std::min(threshold, 255)));
+    const int16x8_t rateShift = vdupq_n_s16(int16_t(-rate));
+    const int16x8_t foregroundShift = vdupq_n_s16(int16_t(-foregroundRate));
+    for (; i + 8 <= count; i += 8) {
+        const uint8x8_t pixels = vld1_u8(frame + i);
+        const int16x8_t model = vld1q_s16(background + i);
+
+        const uint8x8_t modelPixels = vqmovun_s16(vshrq_n_s16(model, 7));
+        const uint8x8_t foreground = vcgt_u8(vabd_u8(pixels, modelPixels), limit);
+        const uint16x8_t foreground16 = vmovl_u8(foreground);
+
+        const int16x8_t delta = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(pixels, 7)), model);
+        // shifting left by a negative count is an arithmetic right shift
+        const int16x8_t step = vbslq_s16(vtstq_u16(foreground16, foreground16), vshlq_s16(delta, foregroundShift),
+                                         vshlq_s16(delta, rateShift));
+        vst1q_s16(background + i, vaddq_s16(model, step));
+        vst1_u8(mask + i, foreground);
+    }
+#endif
+    for (; i < count; ++i) {
+        const int delta = toBackground(frame[i]) - background[i];
+        const int difference = frame[i] - (background[i] >> 7);
+        const bool foreground = (difference < 0 ? -difference : difference) > threshold;
+        background[i] = int16_t(background[i] + (delta >> (foreground ? foregroundRate : rate)));
+        mask[i] = foreground ? 255 : 0;
+    }
+}
+
+std::vector<Blob> connectedBlobs(uint8_t *grid, int columns, int rows)
+{
+    std::vector<Blob> blobs;
+    std::vector<int> stack;
+
+    for (int start = 0; start < columns * rows; ++start) {
+        if (!grid[start])
+            continue;
+
+        Blob blob { columns, rows, -1, -1, 0 };
+        grid[start] = 0;
+        stack.push_back(start);
+        while (!stack.empty()) {
+            const int cell = stack.back();
+            stack.pop_back();
+            const int column = cell % columns;
+            const int row = cell / columns;
+            blob.left = std::min(blob.left, column);
+            blob.right = std::max(blob.right, column);
+            blob.top = std::min(blob.top, row);
+            blob.bottom = std::max(blob.bottom, row);
+            blob.cells++;
+
+            for (int y = std::max(row - 1, 0); y <= std::min(row + 1, rows - 1); ++y) {
+                for (int x = std::max(column - 1, 0); x <= std::min(column + 1, columns - 1); ++x) {
+                    const int neighbour = y * columns + x;
+                    if (grid[neighbour]) {
+                        grid[neighbour] = 0;
+                        stack.push_back(neighbour);
+                    }
+                }
+            }
+        }
+        blobs.push_back(blob);
+    }
+    return blobs;
+}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <QVideoFrameFormat>
+
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * Pixel kernels for the analysis filters, working straight on mapped frame
+ * planes. Vectorized with SSE2 or NEON where it pays off, plain C otherwise.
+ */
+namespace ImageOps {
+
+// side of the cells cellAbsDiff() sums over
+constexpr int kCellSize = 8;
+
+/*
+ * Where the luma bytes are in plane 0 of the format: every pixelStride bytes
+ * starting at offset. RGB formats give the green channel, close enough to luma
+ * for change detection, 16 bit formats their most significant byte.
+ * Returns false for formats without such a plane (e.g. JPEG).
+ */
+bool lumaLayout(QVideoFrameFormat::PixelFormat format, int *pixelStride, int *offset);
+
+/*
+ * Byte offsets of the channels of 32 bit RGB formats. Returns false for the
+ * other formats.
+ */
+bool rgbLayout(QVideoFrameFormat::PixelFormat format, int *red, int *green, int *blue);
+
+/*
+ * Luma plane scaled down by factor: every factor-th row, averaging factor
+ * pixels horizontally. dst holds width / factor by height / factor pixels.
+ */
+void downsampleLuma(const uint8_t *src, int srcStride, int width, int height,
+                    int pixelStride, int offset, int factor, uint8_t *dst, int dstStride);
+
+/*
+ * Sums of absolute differences between a and b over kCellSize square cells,
+ * row by row. sums has cellCount(width) * cellCount(height) entries, partial
+ * cells on the right and bottom edges included.
+ */
+void cellAbsDiff(const uint8_t *a, const uint8_t *b, int stride, int width, int height, uint32_t *sums);
+
+/*
+ * Focus measure: variance of the 4-neighbour Laplacian over an 8 bit plane,
+ * border pixels left out. Sharp edges give high values, motion or focus blur
+ * low ones. Comparable between frames of the same scene only.
+ */
+double laplacianVariance(const uint8_t *src, int stride, int width, int height);
+
+/*
+ * Adds every step-th pixel of every step-th row to the 256 bins of a luma
+ * histogram, the luma laid out as described by lumaLayout().
+ */
+void lumaHistogram(const uint8_t *src, int stride, int width, int height,
+                   int pixelStride, int offset, int step, uint32_t *bins);
+
+/*
+ * Same for 32 bit RGB pixels: the luma (BT.601 weights) and the histograms of
+ * the channels, at the byte offsets from rgbLayout().
+ */
+void rgbHistograms(const uint8_t *src, int stride, int width, int height,
+                   int redOffset, int greenOffset, int blueOffset, int step,
+                   uint32_t *luma, uint32_t *red, uint32_t *green, uint32_t *blue);
+
+/*
+ * Sums of the pixels over kCellSize square cells, laid out as in cellAbsDiff().
+ */
+void cellSums(const uint8_t *src, int stride, int width, int height, uint32_t *sums);
+
+/*
+ * Running background of a plane: per pixel exponential average in 8.7 fixed
+ * point, moving 1/2^rate of the way towards every new frame, 1/2^foregroundRate
+ * where the frame differs from it by more than threshold. Such pixels are set
+ * to 255 in mask, the others to 0.
+ */
+void updateBackground(const uint8_t *frame, int16_t *background, uint8_t *mask, int count,
+                      int rate, int foregroundRate, int threshold);
+
+inline int16_t toBackground(uint8_t pixel)
+{
+    return int16_t(pixel << 7);
+}
+
+struct Blob
+{
+    // cells, inclusive
+    int left = 0;
+    int top = 0;
+    int right = 0;
+    int bottom = 0;
+    int cells = 0;
+};
+
+/*
+ * 8-connected groups of the non-zero cells of a columns by rows grid. The grid
+ * is cleared on the way.
+ */
+std::vector<Blob> connectedBlobs(uint8_t *grid, int columns, int rows);
+
+inline int cellCount(int pixels)
+{
+    return (pixels + kCellSize - 1) / kCellSize;
+}
+
+}
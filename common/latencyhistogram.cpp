@@ -0,0 +1,104 @@
+#include "latencyhistogram.h"
+
+#include <algorithm>
+
+#include <time.h>
+
+qint64 LatencyHistogram::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int LatencyHistogram::bucketIndex(quint64 value)
+{
+    if (value < quint64(kSubBuckets))
+        return int(value);
+    const int exponent = 63 - __builtin_clzll(value);
+    const int subBucket = int(value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + subBucket;
+}
+
+quint64 LatencyHistogram::bucketValue(int index)
+{
+    if (index < kSubBuckets)
+        return quint64(index);
+    const int exponent = index / kSubBuckets + kSubBucketBits - 1;
+    const quint64 subBucket = quint64(index % kSubBuckets);
+    const int shift = exponent - kSubBucketBits;
+    /* Middle of the bucket */
+    return ((kSubBuckets + subBucket) << shift) + ((quint64(1) << shift) >> 1);
+}
+
+void LatencyHistogram::record(qint64 ns)
+{
+    if (ns < 0)
+        ns = 0;
+    m_buckets[bucketIndex(quint64(ns))].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(quint64(ns), std::memory_order_relaxed);
+
+    qint64 current = m_min.load(std::memory_order_relaxed);
+    while (ns < current && !m_min.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+    }
+    current = m_max.load(std::memory_order_relaxed);
+    while (ns > current && !m_max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+    }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    /*
+     * Not atomic as a whole, a sample recorded meanwhile may be missing from
+     * some of the fields. The count is taken from the buckets so percentiles
+     * stay consistent.
+     */
+    Snapshot snapshot;
+    for (int i = 0; i < kBucketCount; ++i) {
+        snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+    if (snapshot.count == 0)
+        return snapshot;
+    snapshot.min = m_min.load(std::memory_order_relaxed);
+    snapshot.max = m_max.load(std::memory_order_relaxed);
+    snapshot.mean = double(m_sum.load(std::memory_order_relaxed)) / snapshot.count;
+    return snapshot;
+}
+
+void LatencyHistogram::reset()
+{
+    for (std::atomic<quint64> &bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store(std::numeric_limits<qint64>::max(), std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+qint64 LatencyHistogram::Snapshot::percentile(double fraction) const
+{
+    if (count == 0)
+        return 0;
+    const quint64 rank = std::max<quint64>(1, quint64(fraction * count + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < kBucketCount; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::clamp<qint64>(qint64(std::min<quint64>(bucketValue(i), quint64(max))), min, max);
+    }
+    return max;
+}
+
+QVariantMap LatencyHistogram::Snapshot::toVariantMap() const
+{
+    const auto ms = [](double ns) { return ns / 1000000.0; };
+    return {
+        { QStringLiteral("count"), count },
+        { QStringLiteral("mean"), ms(mean) },
+        { QStringLiteral("min"), ms(min) },
+        { QStringLiteral("max"), ms(max) },
+        { QStringLiteral("p50"), ms(percentile(0.5)) },
+        { QStringLiteral("p90"), ms(percentile(0.9)) },
+        { QStringLiteral("p99"), ms(percentile(0.99)) },
+    };
+}
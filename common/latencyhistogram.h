@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QVariantMap>
+
+#include <array>
+#include <atomic>
+#include <limits>
+
+/*
+ * Lock-free latency histogram in nanoseconds. Buckets are log-linear like in
+ * HdrHistogram: every power of two is split into 16 linear sub-buckets, so any
+ * recorded value is off by at most 1/16 from the reported one while the whole
+ * 64 bit range fits in a fixed array. Recording is a couple of relaxed atomic
+ * adds, cheap enough to stay enabled in production.
+ */
+class LatencyHistogram
+{
+public:
+    struct Snapshot {
+        quint64 count = 0;
+        qint64 min = 0;
+        qint64 max = 0;
+        double mean = 0.0;
+        std::array<quint64, 976> buckets {};
+
+        // value below which the given fraction (0..1) of samples fall
+        qint64 percentile(double fraction) const;
+        // count, mean, min, max, p50, p90, p99 in milliseconds for QML
+        QVariantMap toVariantMap() const;
+    };
+
+    static qint64 now();
+
+    void record(qint64 ns);
+    Snapshot snapshot() const;
+    void reset();
+
+private:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kBucketCount = (64 - kSubBucketBits + 1) * kSubBuckets;
+    static_assert(kBucketCount == std::tuple_size<decltype(Snapshot::buckets)>::value);
+
+    static int bucketIndex(quint64 value);
+    static quint64 bucketValue(int index);
+
+    std::array<std::atomic<quint64>, kBucketCount> m_buckets {};
+    std::atomic<quint64> m_sum { 0 };
+    std::atomic<qint64> m_min { std::numeric_limits<qint64>::max() };
+    std::atomic<qint64> m_max { 0 };
+};
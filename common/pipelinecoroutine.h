@@ -0,0 +1,199 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "pipelineexecutor.h"
+
+/*
+ * Coroutine building blocks for filters waiting on accelerators or I/O.
+ *
+ * PipelineTask<T> is the return type of a filter coroutine. It starts
+ * suspended and runs either awaited by another coroutine or detached with
+ * start(), which hands the result to a callback.
+ *
+ * PipelineFuture<T> is awaited for a result produced by another thread,
+ * typically an AcceleratorQueue. The waiting coroutine holds no thread, it is
+ * resumed on the pipeline worker it was suspended on once the result is set
+ * through the PipelinePromise<T>.
+ *
+ * Filters don't throw, an exception escaping a coroutine terminates, as it
+ * would from AbstractVideoFilter::run() on a pipeline worker.
+ */
+template<typename T>
+class PipelineTask
+{
+public:
+    struct promise_type;
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+        {
+            promise_type &promise = handle.promise();
+            if (promise.continuation)
+                return promise.continuation;
+
+            // detached with start(), nobody else owns the coroutine
+            std::function<void(T)> callback = std::move(promise.callback);
+            T value = std::move(*promise.value);
+            handle.destroy();
+            if (callback)
+                callback(std::move(value));
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        std::optional<T> value;
+        std::coroutine_handle<> continuation;
+        std::function<void(T)> callback;
+
+        PipelineTask get_return_object()
+        {
+            return PipelineTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        FinalAwaiter final_suspend() const noexcept { return {}; }
+        template<typename U>
+        void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+
+    PipelineTask() = default;
+    PipelineTask(PipelineTask &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+    PipelineTask &operator=(PipelineTask &&other) noexcept
+    {
+        if (this != &other) {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    ~PipelineTask()
+    {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool isValid() const { return bool(m_handle); }
+
+    // runs the coroutine up to its first suspension, callback gets the result
+    // on the thread that completes it
+    void start(std::function<void(T)> callback)
+    {
+        std::coroutine_handle<promise_type> handle = std::exchange(m_handle, {});
+        handle.promise().callback = std::move(callback);
+        handle.resume();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+    T await_resume() { return std::move(*m_handle.promise().value); }
+
+private:
+    explicit PipelineTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    Q_DISABLE_COPY(PipelineTask)
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template<typename T>
+class PipelinePromise;
+
+template<typename T>
+class PipelineFuture
+{
+public:
+    bool await_ready() const
+    {
+        std::lock_guard<std::mutex> locker(m_state->mutex);
+        return m_state->value.has_value();
+    }
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+        std::lock_guard<std::mutex> locker(m_state->mutex);
+        if (m_state->value)
+            return false;
+        m_state->waiter = awaiting;
+        m_state->worker = PipelineExecutor::instance()->currentWorker();
+        return true;
+    }
+    T await_resume()
+    {
+        std::lock_guard<std::mutex> locker(m_state->mutex);
+        return std::move(*m_state->value);
+    }
+
+private:
+    friend class PipelinePromise<T>;
+
+    struct State {
+        std::mutex mutex;
+        std::optional<T> value;
+        std::coroutine_handle<> waiter;
+        int worker = -1;
+    };
+
+    explicit PipelineFuture(std::shared_ptr<State> state) : m_state(std::move(state)) {}
+
+    std::shared_ptr<State> m_state;
+};
+
+template<typename T>
+class PipelinePromise
+{
+public:
+    PipelinePromise() : m_state(std::make_shared<typename PipelineFuture<T>::State>()) {}
+
+    PipelineFuture<T> future() const { return PipelineFuture<T>(m_state); }
+
+    // resumes the awaiting coroutine on a pipeline worker, never inline
+    void setValue(T value) const
+    {
+        std::coroutine_handle<> waiter;
+        int worker = -1;
+        {
+            std::lock_guard<std::mutex> locker(m_state->mutex);
+            m_state->value.emplace(std::move(value));
+            waiter = std::exchange(m_state->waiter, {});
+            worker = m_state->worker;
+        }
+        if (waiter)
+            PipelineExecutor::instance()->submit([waiter]() { waiter.resume(); }, worker);
+    }
+
+private:
+    std::shared_ptr<typename PipelineFuture<T>::State> m_state;
+};
+
+/*
+ * co_await resumeOnPipeline() continues the coroutine on a pipeline worker,
+ * e.g. to leave a thread it was resumed on by a third party library.
+ */
+struct PipelineResume {
+    int locality = -1;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> awaiting) const
+    {
+        PipelineExecutor::instance()->submit([awaiting]() { awaiting.resume(); }, locality);
+    }
+    void await_resume() const noexcept {}
+};
+
+inline PipelineResume resumeOnPipeline(int locality = -1)
+{
+    return PipelineResume { locality };
+}
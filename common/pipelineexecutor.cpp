@@ -0,0 +1,375 @@
+#include "pipelineexecutor.h"
+
+#include "latencyhistogram.h"
+
+#include <QDebug>
+#include <QStringList>
+
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+namespace {
+// worker the current thread runs, to keep follow-up tasks on it
+thread_local const PipelineExecutor *t_executor = nullptr;
+thread_local int t_workerIndex = -1;
+}
+
+Q_GLOBAL_STATIC(PipelineExecutor, pipelineExecutorInstance);
+
+PipelineExecutor *PipelineExecutor::instance()
+{
+    return pipelineExecutorInstance();
+}
+
+PipelineExecutor::PipelineExecutor() = default;
+
+PipelineExecutor::~PipelineExecutor()
+{
+    QMutexLocker locker(&m_configMutex);
+    stop();
+}
+
+void PipelineExecutor::configure(int workerCount, const QList<int> &cpus)
+{
+    QMutexLocker locker(&m_configMutex);
+    if (!m_started) {
+        start(workerCount, cpus);
+        return;
+    }
+
+    const std::shared_ptr<WorkerSet> old = workers();
+    start(workerCount, cpus);
+    const std::shared_ptr<WorkerSet> current = workers();
+
+    /* The queued tasks move over before the old workers are joined, the new
+       ones would otherwise count them as pending without finding them.
+       Submitters still holding the old list find the queues retired and retry */
+    const int count = int(current->workers.size());
+    int next = 0;
+    for (const std::unique_ptr<Worker> &worker : old->workers) {
+        std::deque<Entry> tasks;
+        {
+            QMutexLocker workerLocker(&worker->mutex);
+            worker->retired = true;
+            worker->deadlineTasks = 0;
+            tasks.swap(worker->tasks);
+        }
+        for (Entry &entry : tasks) {
+            Worker &target = *current->workers[next++ % count];
+            QMutexLocker targetLocker(&target.mutex);
+            if (entry.hasDeadline)
+                target.deadlineTasks++;
+            target.tasks.push_back(std::move(entry));
+        }
+    }
+    /* Wakes the new workers for the moved tasks too, and those a submit
+       woke among the old ones instead */
+    {
+        QMutexLocker sleepLocker(&m_sleepMutex);
+        old->retired = true;
+        m_wake.wakeAll();
+    }
+    /* The old workers only finish the task they are running */
+    for (const std::unique_ptr<Worker> &worker : old->workers)
+        worker->thread.join();
+}
+
+void PipelineExecutor::setLocalityPreference(bool enabled)
+{
+    m_localityPreference = enabled;
+}
+
+void PipelineExecutor::ensureStarted()
+{
+    QMutexLocker locker(&m_configMutex);
+    if (!m_started)
+        start(0, {});
+}
+
+void PipelineExecutor::start(int workerCount, const QList<int> &cpus)
+{
+    if (workerCount <= 0)
+        workerCount = cpus.isEmpty() ? int(std::max(1u, std::thread::hardware_concurrency())) : int(cpus.size());
+
+    {
+        QMutexLocker locker(&m_sleepMutex);
+        m_stopping = false;
+    }
+    auto set = std::make_shared<WorkerSet>();
+    for (int i = 0; i < workerCount; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->cpu = cpus.isEmpty() ? -1 : cpus.at(i % cpus.size());
+        set->workers.push_back(std::move(worker));
+    }
+    /* Threads start after the list is complete, they steal from each other */
+    for (int i = 0; i < workerCount; ++i) {
+        Worker &worker = *set->workers[i];
+        worker.thread = std::thread(&PipelineExecutor::workerLoop, this, set.get(), i);
+
+        const QByteArray name = QByteArrayLiteral("pipeline-") + QByteArray::number(i);
+        pthread_setname_np(worker.thread.native_handle(), name.constData());
+        if (worker.cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(worker.cpu, &set);
+            const int ret = pthread_setaffinity_np(worker.thread.native_handle(), sizeof(set), &set);
+            if (ret)
+                qWarning() << "Failed to pin pipeline worker" << i << "to CPU" << worker.cpu << ":" << strerror(ret);
+        }
+    }
+    {
+        QMutexLocker locker(&m_workersMutex);
+        m_workers = std::move(set);
+    }
+    m_started = true;
+    qInfo() << "Pipeline executor started with" << workerCount << "workers" << (cpus.isEmpty() ? "" : "pinned to") << cpus;
+}
+
+void PipelineExecutor::stop()
+{
+    if (!m_started)
+        return;
+    {
+        QMutexLocker locker(&m_sleepMutex);
+        m_stopping = true;
+        m_wake.wakeAll();
+    }
+    /* Workers leave once all the queues are empty */
+    const std::shared_ptr<WorkerSet> set = workers();
+    for (const std::unique_ptr<Worker> &worker : set->workers)
+        worker->thread.join();
+    {
+        QMutexLocker locker(&m_workersMutex);
+        m_workers = std::make_shared<WorkerSet>();
+    }
+    m_started = false;
+}
+
+std::shared_ptr<PipelineExecutor::WorkerSet> PipelineExecutor::workers() const
+{
+    QMutexLocker locker(&m_workersMutex);
+    return m_workers;
+}
+
+void PipelineExecutor::submit(Task task, int locality, qint64 deadline)
+{
+    if (!m_started)
+        ensureStarted();
+
+    for (;;) {
+        const std::shared_ptr<WorkerSet> set = workers();
+        const int count = int(set->workers.size());
+        int target;
+        if (locality >= 0 && m_localityPreference)
+            target = locality % count;
+        else if (t_executor == this && t_workerIndex < count)
+            target = t_workerIndex;
+        else
+            target = int(m_nextWorker++ % unsigned(count));
+
+        Worker &worker = *set->workers[target];
+        QMutexLocker locker(&worker.mutex);
+        /* configure() took the queue over, go to the new workers */
+        if (worker.retired)
+            continue;
+        if (deadline > 0)
+            worker.deadlineTasks++;
+        worker.tasks.push_back({ std::move(task), deadline > 0 ? deadline : LatencyHistogram::now(), deadline > 0 });
+        break;
+    }
+    m_pending++;
+
+    /* Take the lock so a worker going to sleep doesn't miss the task */
+    QMutexLocker locker(&m_sleepMutex);
+    m_wake.wakeOne();
+}
+
+void PipelineExecutor::parallelFor(int count, const std::function<void(int)> &body, int maxThreads)
+{
+    if (count <= 0)
+        return;
+    if (!m_started)
+        ensureStarted();
+
+    struct Batch {
+        std::atomic<int> next { 0 };
+        std::atomic<int> done { 0 };
+        int count = 0;
+        const std::function<void(int)> *body = nullptr;
+        QMutex mutex;
+        QWaitCondition finished;
+
+        void work()
+        {
+            int index;
+            while ((index = next++) < count) {
+                (*body)(index);
+                if (++done == count) {
+                    QMutexLocker locker(&mutex);
+                    finished.wakeAll();
+                }
+            }
+        }
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->count = count;
+    batch->body = &body;
+
+    const int poolSize = int(workers()->workers.size());
+    int threads = std::min(count, maxThreads > 0 ? std::min(maxThreads, poolSize) : poolSize);
+    /* The calling worker is one of them */
+    const int self = currentWorker();
+    if (self < 0)
+        threads = std::min(count, threads + 1);
+    for (int i = 1; i < threads; ++i) {
+        const int locality = self >= 0 ? (self + i) % poolSize : -1;
+        submit([batch]() { batch->work(); }, locality);
+    }
+
+    batch->work();
+    QMutexLocker locker(&batch->mutex);
+    while (batch->done < count)
+        batch->finished.wait(&batch->mutex);
+}
+
+bool PipelineExecutor::takeLocal(WorkerSet &set, int index, Task *task)
+{
+    Worker &worker = *set.workers[index];
+    QMutexLocker locker(&worker.mutex);
+    if (worker.tasks.empty())
+        return false;
+    if (worker.deadlineTasks > 0) {
+        *task = takeEarliest(worker);
+        return true;
+    }
+    /* Newest first, its data is most likely still in the cache */
+    *task = std::move(worker.tasks.back().task);
+    worker.tasks.pop_back();
+    return true;
+}
+
+PipelineExecutor::Task PipelineExecutor::takeEarliest(Worker &worker)
+{
+    /* The queues are a few tasks deep, a scan is cheaper than keeping a heap */
+    auto earliest = worker.tasks.begin();
+    for (auto it = worker.tasks.begin(); it != worker.tasks.end(); ++it) {
+        if (it->deadline < earliest->deadline)
+            earliest = it;
+    }
+    Task task = std::move(earliest->task);
+    if (earliest->hasDeadline)
+        worker.deadlineTasks--;
+    worker.tasks.erase(earliest);
+    return task;
+}
+
+bool PipelineExecutor::steal(WorkerSet &set, int index, Task *task)
+{
+    const int count = int(set.workers.size());
+    for (int i = 1; i < count; ++i) {
+        Worker &victim = *set.workers[(index + i) % count];
+        /* A busy queue is being used by its owner, try the next one */
+        if (!victim.mutex.tryLock())
+            continue;
+        if (!victim.tasks.empty()) {
+            if (victim.deadlineTasks > 0) {
+                *task = takeEarliest(victim);
+            } else {
+                *task = std::move(victim.tasks.front().task);
+                victim.tasks.pop_front();
+            }
+            victim.mutex.unlock();
+            set.workers[index]->stolen++;
+            return true;
+        }
+        victim.mutex.unlock();
+    }
+    return false;
+}
+
+void PipelineExecutor::workerLoop(WorkerSet *set, int index)
+{
+    t_executor = this;
+    t_workerIndex = index;
+    Worker &worker = *set->workers[index];
+
+    for (;;) {
+        Task task;
+        if (takeLocal(*set, index, &task) || steal(*set, index, &task)) {
+            m_pending--;
+            task();
+            worker.executed++;
+            continue;
+        }
+
+        QMutexLocker locker(&m_sleepMutex);
+        /* Replaced, the tasks left in the queues move to the new workers */
+        if (set->retired)
+            break;
+        /* A queue busy with its owner couldn't be stolen from, look again
+           shortly rather than spinning on it */
+        if (m_pending > 0) {
+            m_wake.wait(&m_sleepMutex, 1);
+            continue;
+        }
+        if (m_stopping)
+            break;
+        m_wake.wait(&m_sleepMutex);
+    }
+
+    t_executor = nullptr;
+    t_workerIndex = -1;
+}
+
+int PipelineExecutor::workerCount() const
+{
+    return int(workers()->workers.size());
+}
+
+int PipelineExecutor::currentWorker() const
+{
+    return t_executor == this ? t_workerIndex : -1;
+}
+
+QList<PipelineExecutor::WorkerStatistics> PipelineExecutor::statistics() const
+{
+    const std::shared_ptr<WorkerSet> set = workers();
+    QList<WorkerStatistics> result;
+    for (const std::unique_ptr<Worker> &worker : set->workers) {
+        WorkerStatistics statistics;
+        statistics.cpu = worker->cpu;
+        {
+            QMutexLocker workerLocker(&worker->mutex);
+            statistics.queueDepth = int(worker->tasks.size());
+        }
+        statistics.executed = worker->executed;
+        statistics.stolen = worker->stolen;
+        result.append(statistics);
+    }
+    return result;
+}
+
+QList<int> PipelineExecutor::parseCpuList(const QString &list)
+{
+    QList<int> cpus;
+    const QStringList parts = list.split(QLatin1Char(','), Qt::SkipEmptyParts);
+    for (const QString &part : parts) {
+        const QStringList range = part.trimmed().split(QLatin1Char('-'));
+        bool firstOk = false;
+        bool lastOk = false;
+        const int first = range.at(0).toInt(&firstOk);
+        const int last = range.size() > 1 ? range.at(1).toInt(&lastOk) : first;
+        if (!firstOk || (range.size() > 1 && !lastOk) || range.size() > 2 || first < 0 || last < first) {
+            qWarning() << "Ignoring invalid CPU list entry" << part;
+            continue;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            if (!cpus.contains(cpu))
+                cpus.append(cpu);
+        }
+    }
+    return cpus;
+}
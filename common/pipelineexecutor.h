@@ -0,0 +1,131 @@
+#pragma once
+
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+ * Work-stealing executor dedicated to the video pipeline, so filters neither
+ * compete with QML and image loading for the global QThreadPool nor bounce
+ * between cores. Every worker has its own queue: tasks submitted with the same
+ * locality hint (a camera) go to the same worker, tasks submitted from a
+ * worker stay on it, and idle workers steal the oldest tasks of busy ones.
+ * Workers may be pinned to CPUs.
+ */
+class PipelineExecutor
+{
+public:
+    using Task = std::function<void()>;
+
+    struct WorkerStatistics {
+        int cpu = -1;
+        int queueDepth = 0;
+        quint64 executed = 0;
+        // tasks this worker took from the other workers queues
+        quint64 stolen = 0;
+    };
+
+    static PipelineExecutor *instance();
+
+    /*
+     * Replaces the workers. workerCount 0 means one per CPU in cpus, or per
+     * online CPU. Worker i is pinned to cpus[i % cpus.size()], empty cpus
+     * leaves the workers unpinned. May be called while tasks are submitted:
+     * the old workers finish the task they run and the tasks still queued move
+     * over to the new ones. The workers start with the default configuration
+     * on the first submit when it isn't called before.
+     */
+    void configure(int workerCount, const QList<int> &cpus = {});
+    // keep tasks with the same locality hint on the same worker
+    void setLocalityPreference(bool enabled);
+
+    /*
+     * deadline is a LatencyHistogram::now() time the task should be done by,
+     * 0 for none. While a queue holds tasks with deadlines it is served
+     * earliest deadline first, tasks without one count as due when submitted,
+     * so they are neither starved nor jump ahead of late frames.
+     */
+    void submit(Task task, int locality = -1, qint64 deadline = 0);
+
+    /*
+     * Runs body(0) .. body(count - 1) on up to maxThreads workers (0 - all of
+     * them) and returns once all the calls are done. The calling thread takes
+     * part, so it may be a worker itself without blocking the pool, and indices
+     * are only handed out to threads already running, a helper task starting
+     * late finds nothing left to do.
+     */
+    void parallelFor(int count, const std::function<void(int)> &body, int maxThreads = 0);
+
+    int workerCount() const;
+    // index of the worker running the calling thread, -1 outside the workers.
+    // Passed as locality, keeps a follow-up task on the same worker
+    int currentWorker() const;
+    QList<WorkerStatistics> statistics() const;
+
+    // "0-3,6" -> 0 1 2 3 6
+    static QList<int> parseCpuList(const QString &list);
+
+    PipelineExecutor();
+    ~PipelineExecutor();
+
+private:
+    Q_DISABLE_COPY(PipelineExecutor)
+
+    struct Entry {
+        Task task;
+        // the task deadline, or submission time for tasks without one
+        qint64 deadline = 0;
+        bool hasDeadline = false;
+    };
+    struct Worker {
+        QMutex mutex;
+        std::deque<Entry> tasks;
+        // tasks in the queue submitted with a deadline
+        int deadlineTasks = 0;
+        std::thread thread;
+        int cpu = -1;
+        std::atomic<quint64> executed { 0 };
+        std::atomic<quint64> stolen { 0 };
+        // the queue was handed over to a new set of workers, guarded by mutex
+        bool retired = false;
+    };
+    // the workers of one configuration
+    struct WorkerSet {
+        std::vector<std::unique_ptr<Worker>> workers;
+        // being replaced, its threads leave without draining the queues.
+        // Guarded by m_sleepMutex
+        bool retired = false;
+    };
+
+    void ensureStarted();
+    void start(int workerCount, const QList<int> &cpus);
+    void stop();
+    std::shared_ptr<WorkerSet> workers() const;
+    void workerLoop(WorkerSet *set, int index);
+    static bool takeLocal(WorkerSet &set, int index, Task *task);
+    static bool steal(WorkerSet &set, int index, Task *task);
+    // the earliest deadline task of a queue holding deadlines, its lock held
+    static Task takeEarliest(Worker &worker);
+
+    // guards starting and stopping the workers
+    mutable QMutex m_configMutex;
+    std::atomic<bool> m_started { false };
+    // copied by submitters and swapped by configure()
+    mutable QMutex m_workersMutex;
+    std::shared_ptr<WorkerSet> m_workers = std::make_shared<WorkerSet>();
+    std::atomic<bool> m_localityPreference { true };
+    std::atomic<unsigned> m_nextWorker { 0 };
+
+    QMutex m_sleepMutex;
+    QWaitCondition m_wake;
+    std::atomic<int> m_pending { 0 };
+    bool m_stopping = false;
+};
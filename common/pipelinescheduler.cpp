@@ -0,0 +1,169 @@
+#include "pipelinescheduler.h"
+
+#include "latencyhistogram.h"
+#include "pipelineexecutor.h"
+
+#include <QDebug>
+
+#include <algorithm>
+
+namespace {
+constexpr qint64 kPeriod = 1000000000;
+// fraction of the workers time spent in filters, and of the frames late,
+// above which load is shed and below which it is taken back
+constexpr qreal kHighLoad = 0.85;
+constexpr qreal kLowLoad = 0.5;
+constexpr qreal kHighMissRate = 0.05;
+constexpr qreal kLowMissRate = 0.01;
+// periods with headroom before a step is taken back, shedding takes effect at once
+constexpr int kRelaxedPeriods = 5;
+
+// per camera: analysis on every 2nd frame, every 4th frame, preview on every 2nd frame
+constexpr int kStages = 3;
+}
+
+Q_GLOBAL_STATIC(PipelineScheduler, pipelineSchedulerInstance);
+
+PipelineScheduler *PipelineScheduler::instance()
+{
+    return pipelineSchedulerInstance();
+}
+
+void PipelineScheduler::Budget::recordWork(qint64 ns)
+{
+    m_work += ns;
+    PipelineScheduler::instance()->maybeEvaluate();
+}
+
+void PipelineScheduler::Budget::recordDeadline(bool met)
+{
+    if (met)
+        m_met++;
+    else
+        m_missed++;
+    PipelineScheduler::instance()->maybeEvaluate();
+}
+
+void PipelineScheduler::Budget::recordFrame()
+{
+    PipelineScheduler::instance()->maybeEvaluate();
+}
+
+QVariantMap PipelineScheduler::Budget::statisticsMap() const
+{
+    QMutexLocker locker(&PipelineScheduler::instance()->m_mutex);
+    return {
+        { "priority", int(m_priority) },
+        // percent of all the workers time
+        { "load", m_load * 100.0 },
+        { "missedDeadlines", m_missRate * 100.0 },
+        { "totalMissedDeadlines", m_totalMissed },
+        { "analysisDivisor", int(m_analysisDivisor) },
+        { "previewDivisor", int(m_previewDivisor) },
+    };
+}
+
+std::shared_ptr<PipelineScheduler::Budget> PipelineScheduler::registerBudget(const QString &name, int priority)
+{
+    auto budget = std::make_shared<Budget>();
+    budget->m_name = name;
+    budget->m_priority = priority;
+
+    QMutexLocker locker(&m_mutex);
+    m_budgets.append(budget);
+    return budget;
+}
+
+void PipelineScheduler::setEnabled(bool enabled)
+{
+    m_enabled = enabled;
+}
+
+void PipelineScheduler::maybeEvaluate()
+{
+    const qint64 now = LatencyHistogram::now();
+    qint64 next = m_nextEvaluation.load(std::memory_order_relaxed);
+    if (now < next || !m_nextEvaluation.compare_exchange_strong(next, now + kPeriod))
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    evaluate(now);
+}
+
+void PipelineScheduler::evaluate(qint64 now)
+{
+    const qint64 period = m_periodStart ? now - m_periodStart : 0;
+    m_periodStart = now;
+    const qint64 capacity = period * std::max(PipelineExecutor::instance()->workerCount(), 1);
+
+    QList<std::shared_ptr<Budget>> budgets;
+    qint64 work = 0;
+    quint64 met = 0;
+    quint64 missed = 0;
+    for (auto it = m_budgets.begin(); it != m_budgets.end();) {
+        std::shared_ptr<Budget> budget = it->lock();
+        if (!budget) {
+            it = m_budgets.erase(it);
+            continue;
+        }
+        ++it;
+        const qint64 budgetWork = budget->m_work.exchange(0);
+        const quint64 budgetMet = budget->m_met.exchange(0);
+        const quint64 budgetMissed = budget->m_missed.exchange(0);
+        budget->m_load = capacity > 0 ? qreal(budgetWork) / capacity : 0.0;
+        budget->m_missRate = budgetMet + budgetMissed ? qreal(budgetMissed) / (budgetMet + budgetMissed) : 0.0;
+        budget->m_totalMissed += budgetMissed;
+        work += budgetWork;
+        met += budgetMet;
+        missed += budgetMissed;
+        budgets.append(budget);
+    }
+    if (capacity <= 0)
+        return;
+
+    const qreal load = qreal(work) / capacity;
+    const qreal missRate = met + missed ? qreal(missed) / (met + missed) : 0.0;
+    const int maxLevel = m_enabled ? kStages * int(budgets.size()) : 0;
+    int level = std::min(int(m_level), maxLevel);
+    if ((load > kHighLoad || missRate > kHighMissRate) && level < maxLevel) {
+        level++;
+        m_relaxedPeriods = 0;
+    } else if (load < kLowLoad && missRate < kLowMissRate && level > 0) {
+        if (++m_relaxedPeriods >= kRelaxedPeriods) {
+            level--;
+            m_relaxedPeriods = 0;
+        }
+    } else {
+        m_relaxedPeriods = 0;
+    }
+
+    if (level != m_level) {
+        qInfo().nospace() << "Pipeline load " << qRound(load * 100) << "%, " << qRound(missRate * 100)
+                          << "% deadlines missed, load shedding level " << int(m_level) << " -> " << level;
+        m_level = level;
+    }
+
+    // lowest priority first, in registration order among equal ones
+    std::stable_sort(budgets.begin(), budgets.end(), [](const auto &a, const auto &b) {
+        return a->priority() < b->priority();
+    });
+    QList<int> analysis(budgets.size(), 1);
+    QList<int> preview(budgets.size(), 1);
+    for (int step = 0; step < level; ++step) {
+        const int index = step % budgets.size();
+        switch (step / budgets.size()) {
+        case 0: analysis[index] = 2; break;
+        case 1: analysis[index] = 4; break;
+        default: preview[index] = 2; break;
+        }
+    }
+    for (qsizetype i = 0; i < budgets.size(); ++i) {
+        Budget &budget = *budgets.at(i);
+        const bool analysisChanged = budget.m_analysisDivisor.exchange(analysis.at(i)) != analysis.at(i);
+        const bool previewChanged = budget.m_previewDivisor.exchange(preview.at(i)) != preview.at(i);
+        if (analysisChanged || previewChanged) {
+            qInfo() << "Camera" << budget.m_name << "analysis on every" << analysis.at(i) << "frame, preview on every"
+                    << preview.at(i) << "frame";
+        }
+    }
+}
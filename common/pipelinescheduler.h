@@ -0,0 +1,97 @@
+#pragma once
+
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QVariantMap>
+
+#include <atomic>
+#include <memory>
+
+/*
+ * Arbitrates the pipeline workers between cameras. Every camera gets a
+ * Budget its filter graph reports to: CPU time spent in the filters and
+ * frames done before or after their deadline. Once a second the scheduler
+ * compares the work with what the workers can do, checked whenever a budget
+ * records work, a deadline or a frame.
+ *
+ * Overcommitted (busy workers or deadlines missed) it sheds load one step at
+ * a time, lowest priority cameras first: analysis filters get every second,
+ * then every fourth frame, then the preview drops to every second frame. The
+ * steps are taken back in reverse order once there is headroom again.
+ *
+ * The filter tasks themselves are run earliest deadline first by the
+ * PipelineExecutor, see VideoFilterGraph.
+ */
+class PipelineScheduler
+{
+public:
+    class Budget
+    {
+    public:
+        QString name() const { return m_name; }
+        // higher runs longer at full rate
+        int priority() const { return m_priority; }
+        void setPriority(int priority) { m_priority = priority; }
+
+        // pipeline threads
+        void recordWork(qint64 ns);
+        void recordDeadline(bool met);
+        // every frame the camera shows, keeps the evaluation going while
+        // the filters are shed or idle and report no work
+        void recordFrame();
+
+        // analysis filters run on every n-th frame only
+        int analysisDivisor() const { return m_analysisDivisor; }
+        // the preview shows every n-th frame only
+        int previewDivisor() const { return m_previewDivisor; }
+
+        // CPU use and deadlines of the last period, the shedding in effect
+        QVariantMap statisticsMap() const;
+
+    private:
+        friend class PipelineScheduler;
+
+        QString m_name;
+        std::atomic<int> m_priority { 0 };
+        std::atomic<qint64> m_work { 0 };
+        std::atomic<quint64> m_met { 0 };
+        std::atomic<quint64> m_missed { 0 };
+        std::atomic<int> m_analysisDivisor { 1 };
+        std::atomic<int> m_previewDivisor { 1 };
+
+        /* Last period, guarded by the scheduler mutex */
+        qreal m_load = 0.0;
+        qreal m_missRate = 0.0;
+        quint64 m_totalMissed = 0;
+    };
+
+    static PipelineScheduler *instance();
+
+    // one per camera, unregistered when the last reference goes
+    std::shared_ptr<Budget> registerBudget(const QString &name, int priority = 0);
+
+    bool isEnabled() const { return m_enabled; }
+    // without it nothing is shed, budgets are still reported
+    void setEnabled(bool enabled);
+
+    // shedding steps taken
+    int level() const { return m_level; }
+
+    PipelineScheduler() = default;
+
+private:
+    Q_DISABLE_COPY(PipelineScheduler)
+
+    void maybeEvaluate();
+    void evaluate(qint64 now);
+
+    std::atomic<bool> m_enabled { true };
+    std::atomic<qint64> m_nextEvaluation { 0 };
+    std::atomic<int> m_level { 0 };
+
+    QMutex m_mutex;
+    QList<std::weak_ptr<Budget>> m_budgets;
+    qint64 m_periodStart = 0;
+    int m_relaxedPeriods = 0;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <QtGlobal>
+
+#include <array>
+#include <atomic>
+#include <thread>
+
+/*
+ * Triple buffer handing filter results from the pipeline threads over to a
+ * reader thread, usually the GUI one. Writers fill a spare slot and publish it
+ * with a single atomic exchange, the reader picks up the newest published slot
+ * the same way, so a result is never torn and the reader neither locks nor
+ * copies. Every published value gets the next sequence number, the reader can
+ * tell whether it has already seen it.
+ *
+ * Any thread may publish, writers are serialized among themselves. Only one
+ * thread at a time may read.
+ */
+template <typename T>
+class SnapshotBuffer
+{
+public:
+    struct Snapshot {
+        quint64 sequence = 0;
+        T value {};
+    };
+
+    /*
+     * fill(T &next, const T &current) writes the new value into next, reusing
+     * its storage from an older snapshot. current is the latest published
+     * value. Returning false discards next and publishes nothing.
+     */
+    template <typename Fill>
+    bool publish(Fill &&fill)
+    {
+        while (m_writing.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+
+        Snapshot &next = m_slots[m_back];
+        if (!fill(next.value, m_slots[m_lastPublished].value)) {
+            m_writing.clear(std::memory_order_release);
+            return false;
+        }
+        next.sequence = ++m_sequence;
+        m_lastPublished = m_back;
+        m_back = m_middle.exchange(quint8(m_back | kFresh), std::memory_order_acq_rel) & kIndexMask;
+        m_published.store(next.sequence, std::memory_order_release);
+
+        m_writing.clear(std::memory_order_release);
+        return true;
+    }
+
+    void publish(const T &value)
+    {
+        publish([&value](T &next, const T &) {
+            next = value;
+            return true;
+        });
+    }
+
+    // reader side: the newest published snapshot, valid until the next call
+    const Snapshot &latest()
+    {
+        if (m_middle.load(std::memory_order_relaxed) & kFresh)
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & kIndexMask;
+        return m_slots[m_front];
+    }
+
+    // sequence number of the newest published snapshot, from any thread
+    quint64 publishedSequence() const { return m_published.load(std::memory_order_acquire); }
+
+private:
+    static constexpr quint8 kFresh = 0x4;
+    static constexpr quint8 kIndexMask = 0x3;
+
+    std::array<Snapshot, 3> m_slots;
+    // slot owned by the writers, by the reader, and the one in between
+    quint8 m_back = 0;
+    quint8 m_front = 1;
+    std::atomic<quint8> m_middle { 2 };
+    // writer side only, slot holding the last published value
+    quint8 m_lastPublished = 2;
+
+    std::atomic_flag m_writing = ATOMIC_FLAG_INIT;
+    quint64 m_sequence = 0;
+    std::atomic<quint64> m_published { 0 };
+};
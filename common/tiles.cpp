@@ -0,0 +1,48 @@
+#include "tiles.h"
+
+#include "pipelineexecutor.h"
+
+#include <algorithm>
+
+namespace Tiles {
+
+QList<Tile> split(const QRect &area, const Layout &layout, const QRect &bounds)
+{
+    QList<Tile> tiles;
+    if (area.isEmpty())
+        return tiles;
+
+    const QRect limits = bounds.isEmpty() ? area : bounds;
+    const int width = layout.tileSize.width() > 0 ? std::min(layout.tileSize.width(), area.width()) : area.width();
+    int height = layout.tileSize.height();
+    if (height <= 0) {
+        const qsizetype rowBytes = qsizetype(width + 2 * layout.halo) * std::max(layout.bytesPerPixel, 1);
+        height = int(std::max<qsizetype>(kTileBytes / rowBytes, 1));
+    }
+    const int alignment = std::max(layout.rowAlignment, 1);
+    height = std::max((height + alignment - 1) / alignment * alignment, alignment);
+
+    for (int top = area.top(); top <= area.bottom(); top += height) {
+        for (int left = area.left(); left <= area.right(); left += width) {
+            Tile tile;
+            tile.index = int(tiles.size());
+            tile.rect = QRect(left, top, width, height) & area;
+            tile.source = tile.rect.adjusted(-layout.halo, -layout.halo, layout.halo, layout.halo) & limits;
+            tiles.append(tile);
+        }
+    }
+    return tiles;
+}
+
+void run(const QList<Tile> &tiles, const std::function<void(const Tile &)> &kernel, int maxThreads)
+{
+    if (tiles.size() == 1) {
+        kernel(tiles.first());
+        return;
+    }
+    PipelineExecutor::instance()->parallelFor(int(tiles.size()), [&tiles, &kernel](int index) {
+        kernel(tiles.at(index));
+    }, maxThreads);
+}
+
+}
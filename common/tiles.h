@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QList>
+#include <QRect>
+
+#include <functional>
+#include <vector>
+
+/*
+ * Splits a frame, or a part of it, into tiles small enough to stay in the
+ * cache and runs a kernel on them across the PipelineExecutor workers, so a
+ * filter working on large frames uses all the cores without threads of its
+ * own. Tiles are full rows of the area unless a tile width is given, rows are
+ * what the frame planes are laid out in.
+ *
+ * Kernels reading around the pixels they write (e.g. a 3x3 neighbourhood) ask
+ * for a halo: the tile source is the tile grown by that many pixels, clipped
+ * to the bounds. Tiles don't overlap, writing the tile rect needs no locking.
+ */
+namespace Tiles {
+
+// bytes of one tile the kernel reads, well inside a per-core L2 cache
+constexpr qsizetype kTileBytes = 128 * 1024;
+
+struct Tile
+{
+    int index = 0;
+    // pixels the kernel produces
+    QRect rect;
+    // rect grown by the halo, the pixels the kernel may read
+    QRect source;
+};
+
+struct Layout
+{
+    // 0 width - the whole area width, 0 height - rows fitting kTileBytes
+    QSize tileSize;
+    // bytes per pixel of the plane, for the tile height
+    int bytesPerPixel = 1;
+    int halo = 0;
+    // tile tops at multiples of this from the area top, e.g. a subsampling step
+    int rowAlignment = 1;
+};
+
+// the tiles of area, halos clipped to bounds (the area itself if empty)
+QList<Tile> split(const QRect &area, const Layout &layout, const QRect &bounds = QRect());
+
+// runs kernel on every tile and returns once all are done, on the calling
+// thread alone for a single tile. maxThreads 0 - all the workers
+void run(const QList<Tile> &tiles, const std::function<void(const Tile &)> &kernel, int maxThreads = 0);
+
+/*
+ * Like run(), with one result per tile joined in tile order, e.g. partial
+ * histograms to add up.
+ */
+template<typename Result, typename Kernel>
+std::vector<Result> map(const QList<Tile> &tiles, Kernel kernel, int maxThreads = 0)
+{
+    std::vector<Result> results(tiles.size());
+    run(tiles, [&results, &kernel](const Tile &tile) { results[tile.index] = kernel(tile); }, maxThreads);
+    return results;
+}
+
+}
@@ -0,0 +1,293 @@
+#include "framefanout.h"
+
+#include <QQuickItem>
+
+#include <common/pipelineexecutor.h>
+
+#include <algorithm>
+#include <utility>
+
+QVariantMap FrameConsumer::Statistics::toVariantMap() const
+{
+    return {
+        { "name", name },
+        { "delivered", delivered },
+        { "dropped", dropped },
+        { "throttled", throttled },
+        { "shed", shed },
+        { "previewDropped", previewDropped },
+        { "queueWait", queueWait.toVariantMap() },
+        { "consumeTime", consumeTime.toVariantMap() },
+    };
+}
+
+FrameConsumer::FrameConsumer(const QString &name)
+    : m_name{name}
+{
+}
+
+FrameConsumer::~FrameConsumer() = default;
+
+void FrameConsumer::setMaxRate(qreal rate)
+{
+    m_maxRate = std::max<qreal>(rate, 0.0);
+}
+
+void FrameConsumer::setDropPolicy(DropPolicy policy, int queueDepth)
+{
+    m_dropPolicy = policy;
+    m_queueDepth = std::max(queueDepth, 1);
+}
+
+FrameConsumer::Statistics FrameConsumer::statistics() const
+{
+    Statistics statistics;
+    statistics.name = m_name;
+    statistics.delivered = m_delivered.load();
+    statistics.dropped = m_dropped.load();
+    statistics.throttled = m_throttled.load();
+    statistics.shed = m_shed.load();
+    statistics.previewDropped = m_previewDropped.load();
+    statistics.queueWait = m_queueWait.snapshot();
+    statistics.consumeTime = m_consumeTime.snapshot();
+    return statistics;
+}
+
+void FrameConsumer::resetStatistics()
+{
+    m_delivered = 0;
+    m_dropped = 0;
+    m_throttled = 0;
+    m_shed = 0;
+    m_previewDropped = 0;
+    m_queueWait.reset();
+    m_consumeTime.reset();
+}
+
+bool FrameConsumer::offer(const QVideoFrame &frame, qint64 now)
+{
+    const qreal maxRate = m_maxRate;
+    QMutexLocker locker(&m_mutex);
+    if (maxRate > 0.0) {
+        const qint64 interval = qint64(1e9 / maxRate);
+        if (m_lastAcceptedAt && now - m_lastAcceptedAt < interval) {
+            m_throttled++;
+            return false;
+        }
+        m_lastAcceptedAt = now;
+    }
+
+    const size_t depth = m_dropPolicy == LatestOnly ? 1 : size_t(m_queueDepth.load());
+    while (m_queue.size() >= depth) {
+        m_queue.pop_front();
+        m_dropped++;
+    }
+    m_queue.push_back({ frame, now });
+    return !std::exchange(m_running, true);
+}
+
+void FrameConsumer::drain()
+{
+    for (;;) {
+        Pending pending;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_queue.empty()) {
+                m_running = false;
+                return;
+            }
+            pending = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        const qint64 start = LatencyHistogram::now();
+        m_queueWait.record(start - pending.publishedAt);
+        consume(pending.frame);
+        m_consumeTime.record(LatencyHistogram::now() - start);
+        m_delivered++;
+    }
+}
+
+VideoSinkConsumer::VideoSinkConsumer(QVideoSink *sink, const QString &name)
+    : FrameConsumer{name}
+    , m_slot{std::make_shared<Slot>()}
+{
+    setPreview(true);
+    if (!sink)
+        return;
+    m_slot->sink = sink;
+    // direct, on the thread destroying the sink, it waits for a frame being handed over
+    m_connections.append(QObject::connect(sink, &QObject::destroyed, [slot = m_slot]() {
+        QMutexLocker locker(&slot->mutex);
+        slot->sink = nullptr;
+    }));
+
+    // the sink of a VideoOutput is a child of the item
+    const bool paced = !qEnvironmentVariableIsSet("QLIBCAM_PACED_PREVIEW")
+                       || qEnvironmentVariableIntValue("QLIBCAM_PACED_PREVIEW");
+    auto item = qobject_cast<QQuickItem *>(sink->parent());
+    QQuickWindow *window = item && paced ? item->window() : nullptr;
+    if (!window)
+        return;
+    m_slot->window = window;
+    m_connections.append(QObject::connect(window, &QObject::destroyed, [slot = m_slot]() {
+        QMutexLocker locker(&slot->mutex);
+        slot->window = nullptr;
+    }));
+    // emitted on the render thread with the threaded render loop
+    m_connections.append(QObject::connect(window, &QQuickWindow::frameSwapped, window, [slot = m_slot]() {
+        QMutexLocker locker(&slot->mutex);
+        const QVideoFrame frame = std::exchange(slot->pending, QVideoFrame());
+        if (slot->sink && frame.isValid())
+            slot->sink->setVideoFrame(frame);
+    }, Qt::DirectConnection));
+}
+
+VideoSinkConsumer::~VideoSinkConsumer()
+{
+    for (const QMetaObject::Connection &connection : std::as_const(m_connections))
+        QObject::disconnect(connection);
+}
+
+QVideoSink *VideoSinkConsumer::sink() const
+{
+    QMutexLocker locker(&m_slot->mutex);
+    return m_slot->sink;
+}
+
+void VideoSinkConsumer::detach()
+{
+    QMutexLocker locker(&m_slot->mutex);
+    m_slot->sink = nullptr;
+    m_slot->window = nullptr;
+    m_slot->pending = QVideoFrame();
+}
+
+void VideoSinkConsumer::consume(const QVideoFrame &frame)
+{
+    QMutexLocker locker(&m_slot->mutex);
+    if (!m_slot->sink)
+        return;
+    if (!m_slot->window) {
+        // the sink hands the frame on to the render thread
+        m_slot->sink->setVideoFrame(frame);
+        return;
+    }
+
+    if (std::exchange(m_slot->pending, frame).isValid()) {
+        locker.unlock();
+        previewFrameDropped();
+        return;
+    }
+    // an idle window doesn't swap on its own
+    QMetaObject::invokeMethod(m_slot->window, &QQuickWindow::update, Qt::QueuedConnection);
+}
+
+FunctionConsumer::FunctionConsumer(const QString &name, Function function)
+    : FrameConsumer{name}
+    , m_function{std::move(function)}
+{
+}
+
+void FunctionConsumer::consume(const QVideoFrame &frame)
+{
+    if (m_function)
+        m_function(frame);
+}
+
+FrameFanout::~FrameFanout()
+{
+    waitForDone();
+}
+
+void FrameFanout::addConsumer(std::shared_ptr<FrameConsumer> consumer)
+{
+    if (!consumer)
+        return;
+    QMutexLocker locker(&m_mutex);
+    if (m_consumers->contains(consumer))
+        return;
+    auto consumers = std::make_shared<Consumers>(*m_consumers);
+    consumers->append(std::move(consumer));
+    m_consumers = std::move(consumers);
+}
+
+void FrameFanout::removeConsumer(const std::shared_ptr<FrameConsumer> &consumer)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_consumers->contains(consumer))
+        return;
+    auto consumers = std::make_shared<Consumers>(*m_consumers);
+    consumers->removeAll(consumer);
+    m_consumers = std::move(consumers);
+}
+
+QList<std::shared_ptr<FrameConsumer>> FrameFanout::consumers() const
+{
+    QMutexLocker locker(&m_mutex);
+    return *m_consumers;
+}
+
+void FrameFanout::publish(const QVideoFrame &frame, bool shedPreview)
+{
+    std::shared_ptr<const Consumers> consumers;
+    {
+        QMutexLocker locker(&m_mutex);
+        consumers = m_consumers;
+    }
+
+    const qint64 now = LatencyHistogram::now();
+    for (const std::shared_ptr<FrameConsumer> &consumer : *consumers) {
+        if (shedPreview && consumer->m_preview) {
+            consumer->m_shed++;
+            continue;
+        }
+        if (!consumer->offer(frame, now))
+            continue;
+        {
+            QMutexLocker locker(&m_tasksMutex);
+            m_runningTasks++;
+        }
+        // the task keeps a removed consumer alive until it is done
+        PipelineExecutor::instance()->submit([this, consumer]() {
+            consumer->drain();
+            taskFinished();
+        });
+    }
+}
+
+void FrameFanout::taskFinished()
+{
+    QMutexLocker locker(&m_tasksMutex);
+    if (--m_runningTasks == 0)
+        m_tasksDone.wakeAll();
+}
+
+void FrameFanout::waitForDone()
+{
+    const Consumers consumers = this->consumers();
+    for (const std::shared_ptr<FrameConsumer> &consumer : consumers) {
+        QMutexLocker locker(&consumer->m_mutex);
+        consumer->m_queue.clear();
+    }
+
+    QMutexLocker locker(&m_tasksMutex);
+    while (m_runningTasks > 0)
+        m_tasksDone.wait(&m_tasksMutex);
+}
+
+QVariantList FrameFanout::statisticsMap() const
+{
+    QVariantList result;
+    const Consumers consumers = this->consumers();
+    for (const std::shared_ptr<FrameConsumer> &consumer : consumers)
+        result.append(consumer->statistics().toVariantMap());
+    return result;
+}
+
+void FrameFanout::resetStatistics()
+{
+    const Consumers consumers = this->consumers();
+    for (const std::shared_ptr<FrameConsumer> &consumer : consumers)
+        consumer->resetStatistics();
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <QList>
+#include <QMutex>
+#include <QQuickWindow>
+#include <QString>
+#include <QVariantList>
+#include <QVideoFrame>
+#include <QVideoSink>
+#include <QWaitCondition>
+
+#include <common/latencyhistogram.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+/*
+ * A consumer of the frames of a camera: a video sink, a recorder, a publisher,
+ * another filter graph. Every consumer has its own queue and takes the frames
+ * on the pipeline workers, one at a time and in order, so a slow one drops its
+ * own frames and never delays the others. Consumers blocking for long (disk,
+ * network) should still hand the frame on to their own thread or an
+ * AcceleratorQueue, like the filters do.
+ *
+ * Frames are shared, not copied: a pool buffer goes back to the FramePool when
+ * the last consumer is done with it. Frames waiting in a BoundedQueue keep
+ * their buffers, the pool grows by the queue depth.
+ */
+class FrameConsumer
+{
+public:
+    enum DropPolicy {
+        // only the newest frame waits, an older waiting one is dropped
+        LatestOnly,
+        // up to queueDepth frames wait, the oldest is dropped beyond
+        BoundedQueue,
+    };
+
+    struct Statistics {
+        QString name;
+        quint64 delivered = 0;
+        // replaced in the queue by newer frames
+        quint64 dropped = 0;
+        // over maxRate
+        quint64 throttled = 0;
+        // preview frames skipped under overload, see PipelineScheduler
+        quint64 shed = 0;
+        // taken but replaced by a newer frame before the display showed them
+        quint64 previewDropped = 0;
+        // from the frame being published to consume() taking it
+        LatencyHistogram::Snapshot queueWait;
+        LatencyHistogram::Snapshot consumeTime;
+
+        QVariantMap toVariantMap() const;
+    };
+
+    explicit FrameConsumer(const QString &name);
+    virtual ~FrameConsumer();
+
+    QString name() const { return m_name; }
+
+    // frames per second, 0 for no limit
+    qreal maxRate() const { return m_maxRate; }
+    void setMaxRate(qreal rate);
+
+    DropPolicy dropPolicy() const { return m_dropPolicy; }
+    int queueDepth() const { return m_queueDepth; }
+    // queueDepth only matters for BoundedQueue
+    void setDropPolicy(DropPolicy policy, int queueDepth = 4);
+
+    Statistics statistics() const;
+    void resetStatistics();
+
+protected:
+    // a pipeline worker, never two calls at once
+    virtual void consume(const QVideoFrame &frame) = 0;
+    // preview consumers show every n-th frame only while the pipeline sheds load
+    void setPreview(bool preview) { m_preview = preview; }
+    void previewFrameDropped() { m_previewDropped++; }
+
+private:
+    Q_DISABLE_COPY(FrameConsumer)
+    friend class FrameFanout;
+
+    struct Pending {
+        QVideoFrame frame;
+        qint64 publishedAt = 0;
+    };
+
+    // queues the frame, true if a task has to be started to take it
+    bool offer(const QVideoFrame &frame, qint64 now);
+    void drain();
+
+    const QString m_name;
+    std::atomic<qreal> m_maxRate { 0.0 };
+    std::atomic<DropPolicy> m_dropPolicy { LatestOnly };
+    std::atomic<int> m_queueDepth { 4 };
+    bool m_preview = false;
+
+    mutable QMutex m_mutex;
+    std::deque<Pending> m_queue;
+    bool m_running = false;
+    qint64 m_lastAcceptedAt = 0;
+
+    std::atomic<quint64> m_delivered { 0 };
+    std::atomic<quint64> m_dropped { 0 };
+    std::atomic<quint64> m_throttled { 0 };
+    std::atomic<quint64> m_shed { 0 };
+    std::atomic<quint64> m_previewDropped { 0 };
+    LatencyHistogram m_queueWait;
+    LatencyHistogram m_consumeTime;
+};
+
+/*
+ * Shows the frames in a QVideoSink, e.g. of a VideoOutput in QML. Paced to the
+ * display: the newest frame waits for the next frame swap of the window and is
+ * handed to the sink then, the frames arriving in between replace it before
+ * the sink converts or uploads anything. A 60 fps camera on a 30 Hz panel
+ * shows every second frame and counts the others as previewDropped.
+ *
+ * The window of a VideoOutput sink is found when the consumer is created,
+ * QLIBCAM_PACED_PREVIEW=0 shows every frame right away. Other sinks show every
+ * frame as soon as it arrives.
+ */
+class VideoSinkConsumer : public FrameConsumer
+{
+public:
+    explicit VideoSinkConsumer(QVideoSink *sink, const QString &name = QStringLiteral("videoSink"));
+    ~VideoSinkConsumer() override;
+
+    // null once the sink is destroyed or the consumer detached
+    QVideoSink *sink() const;
+
+    // stops handing frames to the sink, returns once a frame being handed
+    // over is done. For consumers removed from the fanout, which may still
+    // be delivered a frame they took
+    void detach();
+
+protected:
+    void consume(const QVideoFrame &frame) override;
+
+private:
+    // shared with the frame swap handler, it may run on the render thread
+    // while the consumer goes away. The pointers are only used under the
+    // mutex and cleared under it when their objects are destroyed
+    struct Slot {
+        QMutex mutex;
+        QVideoSink *sink = nullptr;
+        QQuickWindow *window = nullptr;
+        QVideoFrame pending;
+    };
+
+    std::shared_ptr<Slot> m_slot;
+    QList<QMetaObject::Connection> m_connections;
+};
+
+class FunctionConsumer : public FrameConsumer
+{
+public:
+    using Function = std::function<void(const QVideoFrame &)>;
+
+    FunctionConsumer(const QString &name, Function function);
+
+protected:
+    void consume(const QVideoFrame &frame) override;
+
+private:
+    Function m_function;
+};
+
+/*
+ * Hands every published frame of a camera to all its consumers. Publishing
+ * only queues the frame with each consumer and never waits for one, the
+ * consumers list is copied on write so it may change while frames flow.
+ */
+class FrameFanout
+{
+public:
+    FrameFanout() = default;
+    ~FrameFanout();
+
+    void addConsumer(std::shared_ptr<FrameConsumer> consumer);
+    // a frame the consumer already took may still be delivered
+    void removeConsumer(const std::shared_ptr<FrameConsumer> &consumer);
+    QList<std::shared_ptr<FrameConsumer>> consumers() const;
+
+    // any thread. With shedPreview the preview consumers skip the frame
+    void publish(const QVideoFrame &frame, bool shedPreview = false);
+
+    // drops the waiting frames and waits for the consumers busy with one
+    void waitForDone();
+
+    QVariantList statisticsMap() const;
+    void resetStatistics();
+
+private:
+    Q_DISABLE_COPY(FrameFanout)
+
+    using Consumers = QList<std::shared_ptr<FrameConsumer>>;
+
+    void taskFinished();
+
+    mutable QMutex m_mutex;
+    std::shared_ptr<const Consumers> m_consumers = std::make_shared<const Consumers>();
+
+    QMutex m_tasksMutex;
+    QWaitCondition m_tasksDone;
+    int m_runningTasks = 0;
+};
@@ -0,0 +1,185 @@
+#include "frameratepolicy.h"
+
+#include <QDebug>
+
+#include "qlibcamera.h"
+
+#include <backgroundfilter.h>
+#include <motionfilter.h>
+#include <tensorflowfilter.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+// ramp up measurement gives up after this, ms
+constexpr qint64 kRampUpTimeout = 5000;
+}
+
+FrameRatePolicy::FrameRatePolicy(QLibCamera *camera)
+    : QObject{camera}
+    , m_camera{camera}
+{
+    if (qEnvironmentVariableIsSet("QLIBCAM_IDLE_FRAME_RATE"))
+        m_idleFrameRate = std::max<qreal>(qEnvironmentVariable("QLIBCAM_IDLE_FRAME_RATE").toDouble(), 0.0);
+
+    m_idleTimer.setSingleShot(true);
+    m_idleTimer.setInterval(10000);
+    connect(&m_idleTimer, &QTimer::timeout, this, &FrameRatePolicy::enterIdle);
+}
+
+void FrameRatePolicy::setIdleFrameRate(qreal rate)
+{
+    rate = std::max<qreal>(rate, 0.0);
+    if (qFuzzyCompare(m_idleFrameRate, rate))
+        return;
+    m_idleFrameRate = rate;
+    if (m_idle) {
+        if (rate > 0.0)
+            m_camera->setIdleFrameRate(rate);
+        else
+            reportActivity();
+    }
+    Q_EMIT settingsChanged();
+}
+
+int FrameRatePolicy::idleTimeout() const
+{
+    return m_idleTimer.interval();
+}
+
+void FrameRatePolicy::setIdleTimeout(int ms)
+{
+    ms = std::max(ms, 0);
+    if (m_idleTimer.interval() == ms)
+        return;
+    m_idleTimer.setInterval(ms);
+    Q_EMIT settingsChanged();
+}
+
+void FrameRatePolicy::setFilters(const QList<AbstractVideoFilter *> &filters)
+{
+    for (const QPointer<AbstractVideoFilter> &filter : std::as_const(m_filters)) {
+        if (filter)
+            disconnect(filter, nullptr, this, nullptr);
+    }
+    m_filters.clear();
+
+    for (AbstractVideoFilter *filter : filters) {
+        if (auto motion = qobject_cast<MotionFilter *>(filter)) {
+            connect(motion, &MotionFilter::resultsChanged, this, [this, motion]() {
+                if (motion->motion())
+                    reportActivity();
+            });
+        } else if (auto background = qobject_cast<BackgroundFilter *>(filter)) {
+            connect(background, &BackgroundFilter::resultsChanged, this, [this, background]() {
+                if (!background->blobs().isEmpty())
+                    reportActivity();
+            });
+        } else if (auto tensorflow = qobject_cast<TensorFlowFilter *>(filter)) {
+            connect(tensorflow, &TensorFlowFilter::processingFinished, this, [this](FilterResult *result) {
+                if (!result->names().isEmpty())
+                    reportActivity();
+            });
+        } else {
+            continue;
+        }
+        m_filters.append(filter);
+    }
+
+    // nothing would bring an idle camera back
+    if (m_filters.isEmpty()) {
+        m_idleTimer.stop();
+        if (m_idle)
+            reportActivity();
+    } else if (!m_idle) {
+        m_idleTimer.start();
+    }
+}
+
+void FrameRatePolicy::reportActivity()
+{
+    if (!m_filters.isEmpty())
+        m_idleTimer.start();
+    if (!m_idle)
+        return;
+
+    const qint64 idleTime = m_idleSince.elapsed();
+    m_idle = false;
+    m_activeTransitions++;
+    m_idleTime += idleTime;
+    m_camera->setIdleFrameRate(0.0);
+    const qreal frameRate = m_camera->frameRate();
+    qInfo() << "Camera" << m_camera->id() << "active after" << idleTime << "ms idle, frame rate"
+            << (frameRate > 0.0 ? QString::number(frameRate) : QStringLiteral("default"));
+
+    // frames already queued come at the idle rate, count until they stop
+    disconnect(m_frameConnection);
+    m_rampTimer.start();
+    m_lastFrameTime = -1;
+    m_rampFrames = 0;
+    m_frameConnection = connect(m_camera, &QLibCamera::videoFrameReady, this, &FrameRatePolicy::frameArrived);
+    Q_EMIT idleChanged();
+}
+
+void FrameRatePolicy::enterIdle()
+{
+    if (m_idle || m_idleFrameRate <= 0.0)
+        return;
+    if (!m_camera->isCapturing()) {
+        m_idleTimer.start();
+        return;
+    }
+    const qreal frameRate = m_camera->frameRate();
+    if (frameRate > 0.0 && frameRate <= m_idleFrameRate)
+        return;
+
+    disconnect(m_frameConnection);
+    m_idle = true;
+    m_idleTransitions++;
+    m_idleSince.start();
+    m_camera->setIdleFrameRate(m_idleFrameRate);
+    qInfo() << "Camera" << m_camera->id() << "idle for" << m_idleTimer.interval() << "ms, frame rate" << m_idleFrameRate;
+    Q_EMIT idleChanged();
+}
+
+void FrameRatePolicy::frameArrived(const QVideoFrame &frame)
+{
+    // sensor timestamps when the frames have them, us
+    const qint64 time = frame.startTime() >= 0 ? frame.startTime() : m_rampTimer.nsecsElapsed() / 1000;
+    if (m_idleFrameRate <= 0.0) {
+        disconnect(m_frameConnection);
+        return;
+    }
+    const qint64 previous = std::exchange(m_lastFrameTime, time);
+    m_rampFrames++;
+    if (previous < 0)
+        return;
+
+    const qint64 idleInterval = qint64(1000000.0 / m_idleFrameRate);
+    const bool fullRate = time - previous < idleInterval / 2;
+    if (!fullRate && m_rampTimer.elapsed() < kRampUpTimeout)
+        return;
+
+    disconnect(m_frameConnection);
+    if (fullRate) {
+        m_lastRampUpTime = m_rampTimer.elapsed();
+        m_lastRampUpFrames = m_rampFrames;
+        qInfo() << "Camera" << m_camera->id() << "back to full rate in" << m_lastRampUpTime << "ms," << m_rampFrames
+                << "frames";
+    } else {
+        qWarning() << "Camera" << m_camera->id() << "didn't get back to full rate in" << kRampUpTimeout << "ms";
+    }
+}
+
+QVariantMap FrameRatePolicy::statisticsMap() const
+{
+    return {
+        { "idle", m_idle },
+        { "idleTransitions", m_idleTransitions },
+        { "activeTransitions", m_activeTransitions },
+        { "idleTime", m_idleTime + (m_idle ? m_idleSince.elapsed() : 0) },
+        { "lastRampUpTime", m_lastRampUpTime },
+        { "lastRampUpFrames", m_lastRampUpFrames },
+    };
+}
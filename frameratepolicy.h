@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+#include <QVariantMap>
+#include <QVideoFrame>
+
+class AbstractVideoFilter;
+class QLibCamera;
+
+/*
+ * Lowers the sensor frame rate of a camera nobody looks at. While the motion,
+ * background or TensorFlow filters of the camera report nothing for
+ * idleTimeout, the camera runs at idleFrameRate through FrameDurationLimits,
+ * fewer frames to copy, convert and filter. The idle rate caps the frameRate
+ * property of the camera without changing it, and the camera keeps only a
+ * couple of requests queued meanwhile. The first frame with activity lifts the
+ * cap, the change goes with the next queued request.
+ *
+ * Transitions are logged and counted, with the time the camera took to get
+ * back to full rate, in statisticsMap().
+ */
+class FrameRatePolicy : public QObject
+{
+    Q_OBJECT
+    // frame rate of an idle camera, 0 - never lower it. QLIBCAM_IDLE_FRAME_RATE by default
+    Q_PROPERTY(qreal idleFrameRate READ idleFrameRate WRITE setIdleFrameRate NOTIFY settingsChanged)
+    // ms without activity before the camera goes idle
+    Q_PROPERTY(int idleTimeout READ idleTimeout WRITE setIdleTimeout NOTIFY settingsChanged)
+    Q_PROPERTY(bool idle READ isIdle NOTIFY idleChanged)
+
+public:
+    explicit FrameRatePolicy(QLibCamera *camera);
+
+    qreal idleFrameRate() const { return m_idleFrameRate; }
+    void setIdleFrameRate(qreal rate);
+    int idleTimeout() const;
+    void setIdleTimeout(int ms);
+    bool isIdle() const { return m_idle; }
+
+    // watches the activity of these filters, the camera passes its filters
+    void setFilters(const QList<AbstractVideoFilter *> &filters);
+    // anything else seeing activity, keeps the camera at full rate
+    Q_INVOKABLE void reportActivity();
+
+    QVariantMap statisticsMap() const;
+
+Q_SIGNALS:
+    void settingsChanged();
+    void idleChanged();
+
+private:
+    void enterIdle();
+    void frameArrived(const QVideoFrame &frame);
+
+    QLibCamera *m_camera = nullptr;
+    QList<QPointer<AbstractVideoFilter>> m_filters;
+    qreal m_idleFrameRate = 0.0;
+    QTimer m_idleTimer;
+    bool m_idle = false;
+
+    /* Ramp up back to full rate */
+    QMetaObject::Connection m_frameConnection;
+    QElapsedTimer m_rampTimer;
+    qint64 m_lastFrameTime = -1;
+    int m_rampFrames = 0;
+
+    /* Metrics */
+    quint64 m_idleTransitions = 0;
+    quint64 m_activeTransitions = 0;
+    // ms, the current idle period not included
+    qint64 m_idleTime = 0;
+    QElapsedTimer m_idleSince;
+    qint64 m_lastRampUpTime = -1;
+    int m_lastRampUpFrames = 0;
+};
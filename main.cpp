@@ -7,6 +7,7 @@
 
 #include "qlibcameramanager.h"
 #include "qlibcamera.h"
+#include "pluginvideofilter.h"
 #include <signal.h>
 
 #include <QGuiApplication>
@@ -14,8 +15,13 @@
 #include <QQmlContext>
 
 #include <QtDebug>
+#include <common/pipelineexecutor.h>
+#include <common/pipelinescheduler.h>
 #include <SBarcodeFilter.h>
 #include <tensorflowfilter.h>
+#include <motionfilter.h>
+#include <backgroundfilter.h>
+#include <exposurefilter.h>
 
 void signalHandler([[maybe_unused]] int signal)
 {
@@ -31,19 +37,101 @@ int main(int argc, char **argv)
 	sigaction(SIGINT, &sa, nullptr);
 
     QGuiApplication app(argc, argv);
+    app.setOrganizationName("qlibcam");
 
     qmlRegisterUncreatableType<QLibCameraManager>("CamerasManager", 1, 0,"CamerasManager","");
     qmlRegisterUncreatableType<QLibCamera>("CamerasManager", 1, 0,"LibCamera","");
     qmlRegisterSingletonInstance<QLibCameraManager>("CamerasManager", 1, 0, "CamerasManager",
                                                  QLibCameraManager::instance());
 
-    SBarcodeFilter barcodeFilter;
-    barcodeFilter.setActive(true);
-    QLibCameraManager::instance()->addCameraFilter(&barcodeFilter);
+    if (qEnvironmentVariableIntValue("QLIBCAM_FRAME_POOL"))
+        QLibCameraManager::instance()->setFramePoolEnabled(true);
 
-    TensorFlowFilter tfFilter;
-    tfFilter.setActive(true);
-    QLibCameraManager::instance()->addCameraFilter(&tfFilter);
+    if (qEnvironmentVariableIsSet("QLIBCAM_PIPELINE_WORKERS") || qEnvironmentVariableIsSet("QLIBCAM_PIPELINE_CPUS")) {
+        PipelineExecutor::instance()->configure(qEnvironmentVariableIntValue("QLIBCAM_PIPELINE_WORKERS"),
+                                                PipelineExecutor::parseCpuList(qEnvironmentVariable("QLIBCAM_PIPELINE_CPUS")));
+    }
+    if (qEnvironmentVariableIsSet("QLIBCAM_PIPELINE_LOCALITY"))
+        PipelineExecutor::instance()->setLocalityPreference(qEnvironmentVariableIntValue("QLIBCAM_PIPELINE_LOCALITY"));
+    if (qEnvironmentVariableIsSet("QLIBCAM_LOAD_SHEDDING"))
+        PipelineScheduler::instance()->setEnabled(qEnvironmentVariableIntValue("QLIBCAM_LOAD_SHEDDING"));
+
+    // every camera gets its own filters
+
+    // QLIBCAM_MOTION_GATE=1 runs the filters below only while something moves in the picture
+    if (qEnvironmentVariableIntValue("QLIBCAM_MOTION_GATE")) {
+        QLibCameraManager::instance()->registerFilterFactory("motion", [](QLibCamera *) {
+            auto filter = new MotionFilter;
+            filter->setActive(true);
+            return filter;
+        });
+    }
+    // luma histogram and exposure statistics, enabled from the pipeline configuration.
+    // QLIBCAM_EXPOSURE_TARGET=110 enables it with an exposure loop driving the mean luma there
+    QLibCameraManager::instance()->registerFilterFactory("exposure", [](QLibCamera *camera) {
+        auto filter = new ExposureFilter;
+        QObject::connect(filter, &ExposureFilter::exposureRequested, camera, &QLibCamera::setExposureTime);
+        if (qEnvironmentVariableIsSet("QLIBCAM_EXPOSURE_TARGET")) {
+            filter->setTargetBrightness(qEnvironmentVariable("QLIBCAM_EXPOSURE_TARGET").toDouble());
+            filter->setActive(true);
+        }
+        return filter;
+    });
+
+    // QLIBCAM_BACKGROUND=1 runs the filters below only on the objects standing out of a learned background
+    if (qEnvironmentVariableIntValue("QLIBCAM_BACKGROUND")) {
+        QLibCameraManager::instance()->registerFilterFactory("background", [](QLibCamera *camera) {
+            auto filter = new BackgroundFilter;
+            filter->setActive(true);
+            if (AbstractVideoFilter *motion = camera->filter("motion"))
+                filter->addDependency(motion);
+            return filter;
+        });
+    }
+    const auto gate = [](QLibCamera *camera, AbstractVideoFilter *filter) {
+        for (const char *name : { "motion", "background" }) {
+            if (AbstractVideoFilter *gateFilter = camera->filter(name))
+                filter->addDependency(gateFilter);
+        }
+    };
+
+    QLibCameraManager::instance()->registerFilterFactory("barcode", [gate](QLibCamera *camera) {
+        auto filter = new SBarcodeFilter;
+        filter->setActive(true);
+        gate(camera, filter);
+        return filter;
+    });
+
+    // QLIBCAM_SHARE_MODELS=1 loads the model and opens the TPU once for all cameras,
+    // QLIBCAM_BATCH_INFERENCE=1 also runs their frames through it in batches
+    auto modelSharing = qEnvironmentVariableIntValue("QLIBCAM_SHARE_MODELS") ? TensorFlowFilter::SharedModel
+                                                                            : TensorFlowFilter::OwnModel;
+    if (qEnvironmentVariableIntValue("QLIBCAM_BATCH_INFERENCE"))
+        modelSharing = TensorFlowFilter::BatchedModel;
+    QLibCameraManager::instance()->registerFilterFactory("tensorflow", [modelSharing, gate](QLibCamera *camera) {
+        auto filter = new TensorFlowFilter(modelSharing);
+        filter->setActive(true);
+        gate(camera, filter);
+        return filter;
+    });
+
+    // filters from plugins, QLIBCAM_PLUGIN_FILTERS=key1,key2
+    VideoFilterPlugins::instance()->load(VideoFilterPlugins::defaultPaths());
+    const QStringList pluginFilters = qEnvironmentVariable("QLIBCAM_PLUGIN_FILTERS").split(',', Qt::SkipEmptyParts);
+    for (const QString &key : pluginFilters) {
+        const QString pluginKey = key.trimmed();
+        QLibCameraManager::instance()->registerFilterFactory(pluginKey, [pluginKey](QLibCamera *) {
+            PluginVideoFilter *filter = VideoFilterPlugins::instance()->create(pluginKey);
+            if (filter)
+                filter->setActive(true);
+            return filter;
+        });
+    }
+
+    // QLIBCAM_PIPELINE_CONFIG=pipeline.json, see pipelineconfig.h. Loaded after
+    // the factories, the configuration picks the filters of every camera
+    if (qEnvironmentVariableIsSet("QLIBCAM_PIPELINE_CONFIG"))
+        QLibCameraManager::instance()->loadPipelineConfig(qEnvironmentVariable("QLIBCAM_PIPELINE_CONFIG"));
 
     QQmlApplicationEngine engine;
     const QUrl url("qrc:/main.qml");
@@ -53,8 +141,6 @@ int main(int argc, char **argv)
                 QCoreApplication::exit(-1);
         }, Qt::QueuedConnection);
 
-    engine.rootContext()->setContextProperty("barcodeFilter", &barcodeFilter);
-    engine.rootContext()->setContextProperty("tf2Filter", &tfFilter);
     engine.load(url);
 
 	ret = app.exec();
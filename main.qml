@@ -62,23 +62,27 @@ ApplicationWindow {
     }
 
     Connections {
-        target: tf2Filter
+        target: currentCamera !== null ? currentCamera.filter("tensorflow") : null
         function onProcessingFinished(results) {
             var r = results.rects();
             var names = results.names();
             var confidences = results.confidences();
             var colors = results.colors();
             resetRects();
+            // results are in full frame coordinates, map them to the cropped frame shown
+            var crop = currentCamera !== null ? currentCamera.cropRegion : Qt.rect(0, 0, 1, 1);
+            var fw = videoOutput.sourceRect.width;
+            var fh = videoOutput.sourceRect.height;
             for (var i = 0; i < r.length; i++) {
-                var xr = videoOutput.width / videoOutput.sourceRect.width;
-                var yr = videoOutput.height / videoOutput.sourceRect.height;
+                var xr = videoOutput.width / fw / crop.width;
+                var yr = videoOutput.height / fh / crop.height;
                 var rect = tf2FilterBox.createObject(videoOutput);
                 rect.text = names[i]
                 rect.conf = confidences[i]
                 rect.boxColor = colors[i]
 
-                rect.x = /*video.x + */r[i].x * xr;
-                rect.y = /*video.y + */r[i].y * yr;
+                rect.x = /*video.x + */(r[i].x - crop.x * fw) * xr;
+                rect.y = /*video.y + */(r[i].y - crop.y * fh) * yr;
                 rect.width = r[i].width * xr;
                 rect.height = r[i].height * yr;
             }
@@ -121,9 +125,18 @@ ApplicationWindow {
                 }
             }
 
+            CheckBox {
+                id: autoFormatCheckBox
+                text: "Auto"
+                height: 50
+                enabled: currentCamera !== null && currentCamera.isCapturing === false
+                checked: currentCamera !== null && currentCamera.autoFormat
+                onToggled: currentCamera.autoFormat = checked
+            }
+
             ComboBox {
                 id: comboBoxFormats
-                enabled: currentCamera !== null && currentCamera.isCapturing === false
+                enabled: currentCamera !== null && currentCamera.isCapturing === false && !autoFormatCheckBox.checked
                 width: 100
                 height: 50
                 currentIndex: -1
@@ -140,20 +153,23 @@ ApplicationWindow {
                         // when model changes, the currentIndex is reset to 0 as soon as count becomes > 0
                         // so we need to set it after model is set
                         comboBoxResolutions.currentIndex = comboBoxResolutions.count - 1
-                        currentCamera.setPrefferedFormat(comboBoxFormats.currentValue)
+                        // the pipeline configuration file has the last word
+                        if (CamerasManager.pipelineConfigFile === "")
+                            currentCamera.setPrefferedFormat(comboBoxFormats.currentValue)
                     }
                 }
             }
 
             ComboBox {
                 id: comboBoxResolutions
-                enabled: currentCamera !== null && currentCamera.isCapturing === false
+                enabled: currentCamera !== null && currentCamera.isCapturing === false && !autoFormatCheckBox.checked
                 width: 100
                 height: 50
                 currentIndex: -1
                 onCurrentValueChanged: {
                     console.warn("Resolution selected:", comboBoxResolutions.currentValue)
-                    currentCamera.setPrefferedResolution(comboBoxResolutions.currentValue)
+                    if (CamerasManager.pipelineConfigFile === "")
+                        currentCamera.setPrefferedResolution(comboBoxResolutions.currentValue)
                 }
             }
 
@@ -162,13 +178,19 @@ ApplicationWindow {
     VideoOutput {
         id: videoOutput
         anchors.fill: parent
+        // before the item and its sink go away, no frame reaches it after this
+        Component.onDestruction: {
+            if (currentCamera !== null)
+                currentCamera.videoSink = null
+        }
     }
 
     footer: RowLayout {
         TextField {
             id: textField
             Layout.fillWidth: true
-            text: barcodeFilter.captured
+            property var barcodeFilter: currentCamera !== null ? currentCamera.filter("barcode") : null
+            text: barcodeFilter ? barcodeFilter.captured : ""
         }
     }
 }
@@ -0,0 +1,248 @@
+#include "pipelineconfig.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <common/pipelineexecutor.h>
+
+namespace {
+bool fail(QString *error, const QString &message)
+{
+    if (error)
+        *error = message;
+    return false;
+}
+
+bool parseStringList(const QJsonValue &value, QStringList *list)
+{
+    if (value.isString()) {
+        *list = { value.toString() };
+        return true;
+    }
+    if (!value.isArray())
+        return false;
+    list->clear();
+    const QJsonArray array = value.toArray();
+    for (const QJsonValue &item : array) {
+        if (!item.isString())
+            return false;
+        list->append(item.toString());
+    }
+    return true;
+}
+
+bool parseExecutor(const QJsonObject &object, ExecutorConfig *executor, QString *error)
+{
+    if (object.contains("workers")) {
+        if (!object.value("workers").isDouble() || object.value("workers").toInt(-1) < 0)
+            return fail(error, "executor.workers must be a non negative number");
+        executor->workers = object.value("workers").toInt();
+    }
+    if (object.contains("cpus")) {
+        const QJsonValue cpus = object.value("cpus");
+        if (cpus.isString()) {
+            executor->cpus = PipelineExecutor::parseCpuList(cpus.toString());
+        } else if (cpus.isArray()) {
+            const QJsonArray array = cpus.toArray();
+            for (const QJsonValue &cpu : array) {
+                if (!cpu.isDouble())
+                    return fail(error, "executor.cpus must be a CPU list string or an array of numbers");
+                executor->cpus.append(cpu.toInt());
+            }
+        } else {
+            return fail(error, "executor.cpus must be a CPU list string or an array of numbers");
+        }
+    }
+    if (object.contains("locality")) {
+        if (!object.value("locality").isBool())
+            return fail(error, "executor.locality must be a boolean");
+        executor->locality = object.value("locality").toBool();
+    }
+    return true;
+}
+
+bool parseFilter(const QJsonValue &value, FilterConfig *filter, const QString &where, QString *error)
+{
+    // "barcode" is a shorthand for { "factory": "barcode" }
+    if (value.isString()) {
+        filter->factory = value.toString();
+        return true;
+    }
+    if (!value.isObject())
+        return fail(error, where + " must be a factory name or an object");
+
+    const QJsonObject object = value.toObject();
+    filter->factory = object.value("factory").toString();
+    if (filter->factory.isEmpty())
+        return fail(error, where + ".factory is missing");
+    if (object.contains("active")) {
+        if (!object.value("active").isBool())
+            return fail(error, where + ".active must be a boolean");
+        filter->active = object.value("active").toBool();
+    }
+    if (object.contains("maxRate")) {
+        if (!object.value("maxRate").isDouble() || object.value("maxRate").toDouble() < 0.0)
+            return fail(error, where + ".maxRate must be a non negative number");
+        filter->maxRate = object.value("maxRate").toDouble();
+    }
+    if (object.contains("deadline")) {
+        if (!object.value("deadline").isDouble() || object.value("deadline").toInt() < 0)
+            return fail(error, where + ".deadline must be a non negative number");
+        filter->deadline = object.value("deadline").toInt();
+    }
+    if (object.contains("after") && !parseStringList(object.value("after"), &filter->after))
+        return fail(error, where + ".after must be a list of factory names");
+    if (object.contains("properties")) {
+        if (!object.value("properties").isObject())
+            return fail(error, where + ".properties must be an object");
+        filter->properties = object.value("properties").toObject().toVariantMap();
+    }
+    return true;
+}
+
+bool parseCamera(const QJsonValue &value, CameraConfig *camera, const QString &where, QString *error)
+{
+    if (!value.isObject())
+        return fail(error, where + " must be an object");
+
+    const QJsonObject object = value.toObject();
+    camera->match = object.value("match").toString("*");
+    camera->format = object.value("format").toString();
+
+    const QString resolution = object.value("resolution").toString();
+    if (!resolution.isEmpty()) {
+        const QStringList size = resolution.split('x');
+        if (size.size() != 2 || size.at(0).toInt() <= 0 || size.at(1).toInt() <= 0)
+            return fail(error, where + ".resolution must look like 1280x720");
+        camera->resolution = QSize(size.at(0).toInt(), size.at(1).toInt());
+    }
+    if (object.contains("bufferCount")) {
+        if (!object.value("bufferCount").isDouble() || object.value("bufferCount").toInt() <= 0)
+            return fail(error, where + ".bufferCount must be a positive number");
+        camera->bufferCount = object.value("bufferCount").toInt();
+    }
+    if (object.contains("frameRate")) {
+        if (!object.value("frameRate").isDouble() || object.value("frameRate").toDouble() <= 0.0)
+            return fail(error, where + ".frameRate must be a positive number");
+        camera->frameRate = object.value("frameRate").toDouble();
+    }
+    if (object.contains("priority")) {
+        if (!object.value("priority").isDouble())
+            return fail(error, where + ".priority must be a number");
+        camera->priority = object.value("priority").toInt();
+    }
+    if (object.contains("autoFormat")) {
+        if (!object.value("autoFormat").isBool())
+            return fail(error, where + ".autoFormat must be a boolean");
+        camera->autoFormat = object.value("autoFormat").toBool();
+    }
+    if (object.contains("analysisRegion")) {
+        const QJsonArray region = object.value("analysisRegion").toArray();
+        if (region.size() != 4)
+            return fail(error, where + ".analysisRegion must be [x, y, width, height], normalized");
+        camera->analysisRegion = QRectF(region.at(0).toDouble(), region.at(1).toDouble(),
+                                        region.at(2).toDouble(), region.at(3).toDouble());
+    }
+    if (object.contains("streams")) {
+        if (!parseStringList(object.value("streams"), &camera->streams))
+            return fail(error, where + ".streams must be a list of stream roles");
+        // the capture only configures the viewfinder stream so far
+        for (const QString &stream : std::as_const(camera->streams)) {
+            if (stream == "raw" || stream == "still" || stream == "video")
+                return fail(error, where + ".streams: role " + stream + " is not supported, only viewfinder");
+            if (stream != "viewfinder")
+                return fail(error, where + ".streams: unknown role " + stream);
+        }
+    }
+    camera->autostart = object.value("autostart").toBool(false);
+
+    if (object.contains("filters")) {
+        if (!object.value("filters").isArray())
+            return fail(error, where + ".filters must be an array");
+        const QJsonArray array = object.value("filters").toArray();
+        QList<FilterConfig> filters;
+        for (int i = 0; i < array.size(); ++i) {
+            FilterConfig filter;
+            if (!parseFilter(array.at(i), &filter, QString("%1.filters[%2]").arg(where).arg(i), error))
+                return false;
+            filters.append(filter);
+        }
+        camera->filters = filters;
+    }
+    return true;
+}
+}
+
+bool CameraConfig::matches(const QString &cameraId, const QString &model) const
+{
+    return match.isEmpty() || match == "*" || match == cameraId || match == model;
+}
+
+const CameraConfig *PipelineConfig::camera(const QString &cameraId, const QString &model) const
+{
+    for (const CameraConfig &camera : cameras) {
+        if (camera.matches(cameraId, model))
+            return &camera;
+    }
+    return nullptr;
+}
+
+std::optional<PipelineConfig> PipelineConfig::fromJson(const QByteArray &json, QString *error)
+{
+    QJsonParseError parseError;
+    const QJsonDocument document = QJsonDocument::fromJson(json, &parseError);
+    if (document.isNull()) {
+        fail(error, QString("offset %1: %2").arg(parseError.offset).arg(parseError.errorString()));
+        return std::nullopt;
+    }
+    if (!document.isObject()) {
+        fail(error, "top level must be an object");
+        return std::nullopt;
+    }
+
+    PipelineConfig config;
+    const QJsonObject object = document.object();
+    if (object.contains("executor")) {
+        if (!object.value("executor").isObject()) {
+            fail(error, "executor must be an object");
+            return std::nullopt;
+        }
+        ExecutorConfig executor;
+        if (!parseExecutor(object.value("executor").toObject(), &executor, error))
+            return std::nullopt;
+        config.executor = executor;
+    }
+    if (object.contains("framePool")) {
+        if (!object.value("framePool").isBool()) {
+            fail(error, "framePool must be a boolean");
+            return std::nullopt;
+        }
+        config.framePool = object.value("framePool").toBool();
+    }
+    if (object.contains("cameras")) {
+        if (!object.value("cameras").isArray()) {
+            fail(error, "cameras must be an array");
+            return std::nullopt;
+        }
+        const QJsonArray cameras = object.value("cameras").toArray();
+        for (int i = 0; i < cameras.size(); ++i) {
+            CameraConfig camera;
+            if (!parseCamera(cameras.at(i), &camera, QString("cameras[%1]").arg(i), error))
+                return std::nullopt;
+            config.cameras.append(camera);
+        }
+    }
+    return config;
+}
+
+std::optional<PipelineConfig> PipelineConfig::load(const QString &fileName, QString *error)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        fail(error, file.errorString());
+        return std::nullopt;
+    }
+    return fromJson(file.readAll(), error);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <QList>
+#include <QRectF>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+#include <optional>
+
+/*
+ * Declarative description of the capture pipeline, loaded from a JSON file by
+ * QLibCameraManager::loadPipelineConfig():
+ *
+ * {
+ *     "executor": { "workers": 4, "cpus": "2-5", "locality": true },
+ *     "framePool": true,
+ *     "cameras": [
+ *         {
+ *             "match": "*",
+ *             "format": "YUYV",
+ *             "resolution": "1280x720",
+ *             "bufferCount": 4,
+ *             "frameRate": 30,
+ *             "priority": 1,
+ *             "streams": [ "viewfinder" ],
+ *             "autostart": true,
+ *             "filters": [
+ *                 { "factory": "tensorflow", "maxRate": 5, "deadline": 150 },
+ *                 { "factory": "barcode", "maxRate": 10, "after": [ "tensorflow" ],
+ *                   "properties": { "captureRect": [ 320, 180, 640, 360 ] } }
+ *             ]
+ *         }
+ *     ]
+ * }
+ *
+ * Cameras are matched by id or model, the first matching entry wins and "*"
+ * matches any camera. Everything is optional, what is left out keeps the
+ * values set from code.
+ */
+struct FilterConfig
+{
+    // name of a factory registered with QLibCameraManager::registerFilterFactory()
+    QString factory;
+    std::optional<bool> active;
+    // frames per second of analysis filters, 0 for no limit
+    std::optional<qreal> maxRate;
+    // ms from the capture, 0 for the default
+    std::optional<int> deadline;
+    // factories of the filters that have to finish with the frame first
+    QStringList after;
+    // Qt properties of the filter
+    QVariantMap properties;
+};
+
+struct CameraConfig
+{
+    QString match;
+    // libcamera pixel format name
+    QString format;
+    QSize resolution;
+    int bufferCount = 0;
+    qreal frameRate = 0.0;
+    // shedding order under overload, see PipelineScheduler
+    std::optional<int> priority;
+    std::optional<bool> autoFormat;
+    // crops the preview too, see QLibCamera::analysisRegion
+    QRectF analysisRegion;
+    QStringList streams;
+    bool autostart = false;
+    // the filters of the camera, in order. Unset for all the registered factories
+    std::optional<QList<FilterConfig>> filters;
+
+    bool matches(const QString &cameraId, const QString &model) const;
+};
+
+struct ExecutorConfig
+{
+    int workers = 0;
+    QList<int> cpus;
+    bool locality = true;
+
+    bool operator==(const ExecutorConfig &other) const
+    {
+        return workers == other.workers && cpus == other.cpus && locality == other.locality;
+    }
+    bool operator!=(const ExecutorConfig &other) const { return !(*this == other); }
+};
+
+struct PipelineConfig
+{
+    std::optional<ExecutorConfig> executor;
+    std::optional<bool> framePool;
+    QList<CameraConfig> cameras;
+
+    // first entry matching the camera, nullptr if none
+    const CameraConfig *camera(const QString &cameraId, const QString &model) const;
+
+    static std::optional<PipelineConfig> fromJson(const QByteArray &json, QString *error = nullptr);
+    static std::optional<PipelineConfig> load(const QString &fileName, QString *error = nullptr);
+};
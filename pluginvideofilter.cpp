@@ -0,0 +1,255 @@
+#include "pluginvideofilter.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QLibrary>
+#include <QPluginLoader>
+
+#include <common/framepool.h>
+
+#include <cstddef>
+#include <cstring>
+
+namespace {
+// size and abiVersion, every plugin has them
+constexpr quint32 kMinimumInfoSize = offsetof(VideoFilterPluginInfo, kind);
+
+// fields past the size the plugin was built with keep their defaults
+VideoFilterPluginInfo pluginInfo(VideoFilterPlugin *plugin, const QString &key)
+{
+    const VideoFilterPluginInfo reported = plugin->info(key);
+    VideoFilterPluginInfo info;
+    if (reported.size < kMinimumInfoSize) {
+        info.size = reported.size;
+        return info;
+    }
+    memcpy(static_cast<void *>(&info), &reported, std::min<size_t>(reported.size, sizeof(info)));
+    return info;
+}
+
+void fillView(VideoFilterFrameView *view, QVideoFrame &frame)
+{
+    view->pixelFormat = quint32(frame.pixelFormat());
+    view->width = frame.width();
+    view->height = frame.height();
+    view->planeCount = std::min(frame.planeCount(), 4);
+    for (int plane = 0; plane < view->planeCount; ++plane) {
+        view->planes[plane] = frame.bits(plane);
+        view->bytesPerLine[plane] = frame.bytesPerLine(plane);
+    }
+}
+}
+
+PluginVideoFilter::PluginVideoFilter(const QString &key, const VideoFilterPluginInfo &info,
+                                     VideoFilterPluginInstance *instance, QObject *parent)
+    : AbstractVideoFilter{parent}, m_key{key}, m_info{info}, m_instance{instance}
+{
+    setObjectName(key);
+    m_pinnedResults = &m_results.latest();
+}
+
+PluginVideoFilter::~PluginVideoFilter() = default;
+
+QVariantMap PluginVideoFilter::parameters() const
+{
+    return m_parameters;
+}
+
+void PluginVideoFilter::setParameters(const QVariantMap &parameters)
+{
+    if (m_parameters == parameters)
+        return;
+    m_parameters = parameters;
+    {
+        QMutexLocker locker(&m_processMutex);
+        m_instance->setParameters(parameters);
+    }
+    Q_EMIT parametersChanged();
+}
+
+AbstractVideoFilter::FilterKind PluginVideoFilter::kind() const
+{
+    return m_info.kind == VideoFilterPluginInfo::Processing ? ProcessingFilter : AnalysisFilter;
+}
+
+FrameRequirements PluginVideoFilter::requirements() const
+{
+    return { QImage::Format(m_info.inputFormat), m_info.maxSize, QRect() };
+}
+
+QVideoFrame PluginVideoFilter::run(VideoFilterFrame *input)
+{
+    VideoFilterFrameView inputView;
+    inputView.sequence = input->sequence();
+    inputView.timestamp = input->videoFrame().startTime();
+    const QRectF region = input->sourceRegion();
+    inputView.sourceRegion[0] = region.x();
+    inputView.sourceRegion[1] = region.y();
+    inputView.sourceRegion[2] = region.width();
+    inputView.sourceRegion[3] = region.height();
+
+    QVideoFrame frame;
+    QImage image;
+    if (m_info.inputFormat == QImage::Format_Invalid) {
+        // the captured frame itself
+        frame = input->videoFrame();
+        if (!frame.map(QVideoFrame::ReadOnly))
+            return input->videoFrame();
+        fillView(&inputView, frame);
+    } else {
+        // shared with the other filters asking for the same conversion
+        image = input->image(requirements());
+        if (image.isNull())
+            return input->videoFrame();
+        inputView.isImage = 1;
+        inputView.pixelFormat = quint32(image.format());
+        inputView.width = image.width();
+        inputView.height = image.height();
+        inputView.planeCount = 1;
+        inputView.planes[0] = const_cast<uchar *>(image.constBits());
+        inputView.bytesPerLine[0] = int(image.bytesPerLine());
+    }
+
+    QVideoFrame output;
+    VideoFilterFrameView outputView = inputView;
+    VideoFilterFrameView *outputViewPtr = nullptr;
+    if (kind() == ProcessingFilter && frame.isValid()) {
+        output = FramePool::instance()->videoFrame(frame.surfaceFormat());
+        if (output.map(QVideoFrame::WriteOnly)) {
+            fillView(&outputView, output);
+            outputViewPtr = &outputView;
+        }
+    }
+
+    // results of this very frame, not of a call running concurrently
+    bool written = false;
+    QVariantMap results;
+    if (m_info.threading == VideoFilterPluginInfo::NonReentrant) {
+        QMutexLocker locker(&m_processMutex);
+        written = m_instance->process(inputView, outputViewPtr);
+        results = m_instance->results();
+    } else {
+        written = m_instance->process(inputView, outputViewPtr);
+        results = m_instance->results();
+    }
+
+    if (frame.isMapped())
+        frame.unmap();
+    if (output.isMapped())
+        output.unmap();
+
+    if (!results.isEmpty()) {
+        m_results.publish(results);
+        QMetaObject::invokeMethod(this, &PluginVideoFilter::deliverResults, Qt::QueuedConnection);
+    }
+
+    if (written && outputViewPtr) {
+        output.setStartTime(frame.startTime());
+        return output;
+    }
+    return input->videoFrame();
+}
+
+void PluginVideoFilter::deliverResults()
+{
+    const quint64 sequence = m_pinnedResults->sequence;
+    m_pinnedResults = &m_results.latest();
+    if (m_pinnedResults->sequence != sequence)
+        Q_EMIT resultsChanged();
+}
+
+Q_GLOBAL_STATIC(VideoFilterPlugins, videoFilterPluginsInstance);
+
+VideoFilterPlugins *VideoFilterPlugins::instance()
+{
+    return videoFilterPluginsInstance();
+}
+
+VideoFilterPlugins::VideoFilterPlugins() = default;
+
+VideoFilterPlugins::~VideoFilterPlugins()
+{
+    // doesn't unload the libraries, filters created by the plugins may outlive us
+    qDeleteAll(m_loaders);
+}
+
+QStringList VideoFilterPlugins::defaultPaths()
+{
+    const QString paths = qEnvironmentVariable("QLIBCAM_PLUGINS_PATH");
+    if (!paths.isEmpty())
+        return paths.split(QLatin1Char(':'), Qt::SkipEmptyParts);
+    return { QCoreApplication::applicationDirPath() + QStringLiteral("/plugins") };
+}
+
+int VideoFilterPlugins::load(const QStringList &paths)
+{
+    int found = 0;
+    for (const QString &path : paths) {
+        const QDir dir(path);
+        const QStringList files = dir.entryList(QDir::Files);
+        for (const QString &file : files) {
+            const QString fileName = dir.absoluteFilePath(file);
+            if (!QLibrary::isLibrary(fileName))
+                continue;
+
+            auto loader = new QPluginLoader(fileName);
+            auto plugin = qobject_cast<VideoFilterPlugin *>(loader->instance());
+            if (!plugin) {
+                qWarning() << "Not a video filter plugin:" << fileName << loader->errorString();
+                delete loader;
+                continue;
+            }
+
+            QMutexLocker locker(&m_mutex);
+            const QStringList pluginKeys = plugin->keys();
+            for (const QString &key : pluginKeys) {
+                const VideoFilterPluginInfo info = pluginInfo(plugin, key);
+                if (info.size < kMinimumInfoSize) {
+                    qWarning() << "Video filter" << key << "from" << fileName << "has an invalid info structure of"
+                               << info.size << "bytes";
+                    continue;
+                }
+                if (info.abiVersion > QLIBCAM_FILTER_ABI_VERSION) {
+                    qWarning() << "Video filter" << key << "needs a newer application, ABI version" << info.abiVersion;
+                    continue;
+                }
+                // the output view is a copy of the captured frame, there is none for a converted image
+                if (info.kind == VideoFilterPluginInfo::Processing && info.inputFormat != 0) {
+                    qWarning() << "Video filter" << key << "from" << fileName
+                               << "is a processing filter with an input format, processing filters take the captured frame";
+                    continue;
+                }
+                if (m_plugins.contains(key)) {
+                    qWarning() << "Video filter" << key << "from" << fileName << "is already loaded";
+                    continue;
+                }
+                m_plugins.insert(key, plugin);
+                found++;
+                qInfo() << "Loaded video filter" << key << "from" << fileName;
+            }
+            m_loaders.append(loader);
+        }
+    }
+    return found;
+}
+
+QStringList VideoFilterPlugins::keys() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_plugins.keys();
+}
+
+PluginVideoFilter *VideoFilterPlugins::create(const QString &key, QObject *parent) const
+{
+    QMutexLocker locker(&m_mutex);
+    VideoFilterPlugin *plugin = m_plugins.value(key);
+    if (!plugin) {
+        qWarning() << "No video filter plugin for" << key;
+        return nullptr;
+    }
+    VideoFilterPluginInstance *instance = plugin->create(key);
+    if (!instance)
+        return nullptr;
+    return new PluginVideoFilter(key, pluginInfo(plugin, key), instance, parent);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <QVariantMap>
+
+#include <memory>
+
+#include "abstractvideofilter.h"
+#include "videofilterplugin.h"
+
+#include <common/snapshotbuffer.h>
+
+class QPluginLoader;
+
+/*
+ * Video filter implemented by a plugin. Hands the plugin views over the frame
+ * data and publishes its results to QML.
+ */
+class PluginVideoFilter : public AbstractVideoFilter
+{
+    Q_OBJECT
+    Q_PROPERTY(QString key READ key CONSTANT FINAL)
+    Q_PROPERTY(QVariantMap parameters READ parameters WRITE setParameters NOTIFY parametersChanged FINAL)
+    Q_PROPERTY(QVariantMap results READ results NOTIFY resultsChanged FINAL)
+
+public:
+    PluginVideoFilter(const QString &key, const VideoFilterPluginInfo &info,
+                      VideoFilterPluginInstance *instance, QObject *parent = nullptr);
+    ~PluginVideoFilter() override;
+
+    QString key() const { return m_key; }
+
+    QVariantMap parameters() const;
+    void setParameters(const QVariantMap &parameters);
+
+    // latest results of the plugin, GUI thread
+    QVariantMap results() const { return m_pinnedResults->value; }
+
+    FilterKind kind() const override;
+    FrameRequirements requirements() const override;
+
+Q_SIGNALS:
+    void parametersChanged();
+    void resultsChanged();
+
+protected:
+    QVideoFrame run(VideoFilterFrame *input) override;
+
+private:
+    void deliverResults();
+
+    QString m_key;
+    VideoFilterPluginInfo m_info;
+    std::unique_ptr<VideoFilterPluginInstance> m_instance;
+    // serializes process() and results() of non reentrant plugins and parameters updates
+    QMutex m_processMutex;
+    QVariantMap m_parameters;
+    SnapshotBuffer<QVariantMap> m_results;
+    const SnapshotBuffer<QVariantMap>::Snapshot *m_pinnedResults = nullptr;
+};
+
+/*
+ * Filter plugins found in the plugin directories, by filter key.
+ */
+class VideoFilterPlugins
+{
+public:
+    static VideoFilterPlugins *instance();
+
+    // QLIBCAM_PLUGINS_PATH, colon separated, or the plugins directory next to the binary
+    static QStringList defaultPaths();
+
+    // loads every plugin in the directories, returns the number of filters found
+    int load(const QStringList &paths);
+    QStringList keys() const;
+    PluginVideoFilter *create(const QString &key, QObject *parent = nullptr) const;
+
+    VideoFilterPlugins();
+    ~VideoFilterPlugins();
+
+private:
+    Q_DISABLE_COPY(VideoFilterPlugins)
+
+    mutable QMutex m_mutex;
+    QList<QPluginLoader *> m_loaders;
+    QHash<QString, VideoFilterPlugin *> m_plugins;
+};
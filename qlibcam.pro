@@ -1,23 +1,64 @@
 QT += core gui widgets multimedia multimedia-private quick qml concurrent
 
-CONFIG += c++17
+CONFIG += c++20
 TARGET = qlibcam
 TEMPLATE = app
 
-SOURCES += common/image.cpp \
+SOURCES += analysis/backgroundfilter.cpp \
+           analysis/exposurefilter.cpp \
+           analysis/motionfilter.cpp \
+           common/acceleratorqueue.cpp \
+           common/framepool.cpp \
+           common/image.cpp \
+           common/imageops.cpp \
+           common/latencyhistogram.cpp \
+           common/pipelineexecutor.cpp \
+           common/pipelinescheduler.cpp \
+           common/tiles.cpp \
+           ML/inferencebatcher.cpp \
            ML/tensorflowfilter.cpp \
            ML/tensorflowtpuneuralnetwork.cpp \
            abstractvideofilter.cpp \
+           asyncvideofilter.cpp \
+           captureformatselector.cpp \
+           framefanout.cpp \
+           frameratepolicy.cpp \
            main.cpp \
+           pipelineconfig.cpp \
+           pluginvideofilter.cpp \
            qlibcamera.cpp \
-           qlibcameramanager.cpp
-HEADERS += common/image.h \
+           qlibcameramanager.cpp \
+           videofilterframe.cpp \
+           videofiltergraph.cpp
+HEADERS += analysis/backgroundfilter.h \
+           analysis/exposurefilter.h \
+           analysis/motionfilter.h \
+           common/acceleratorqueue.h \
+           common/framepool.h \
+           common/image.h \
+           common/imageops.h \
+           common/latencyhistogram.h \
+           common/pipelinecoroutine.h \
+           common/pipelineexecutor.h \
+           common/pipelinescheduler.h \
+           common/snapshotbuffer.h \
+           common/tiles.h \
            ML/abstractneuralnetwork.h \
+           ML/inferencebatcher.h \
            ML/tensorflowfilter.h \
            ML/tensorflowtpuneuralnetwork.h \
            abstractvideofilter.h \
+           asyncvideofilter.h \
+           captureformatselector.h \
+           framefanout.h \
+           frameratepolicy.h \
+           pipelineconfig.h \
+           pluginvideofilter.h \
            qlibcamera.h \
-           qlibcameramanager.h
+           qlibcameramanager.h \
+           videofilterframe.h \
+           videofiltergraph.h \
+           videofilterplugin.h
 
 RESOURCES += resources.qrc
 
@@ -37,4 +78,4 @@ include(scodes/SCodes.pri)
 
 TENSORFLOW_PATH = $$PWD/ML/tpu
 LIBS += -L$$TENSORFLOW_PATH/lib -ltensorflow-lite -ledgetpu
-INCLUDEPATH += $$PWD/ML $$PWD/ML/tpu/include $$PWD/ML/tpu/include/edgetpu
+INCLUDEPATH += $$PWD/analysis $$PWD/ML $$PWD/ML/tpu/include $$PWD/ML/tpu/include/edgetpu
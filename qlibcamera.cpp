@@ -13,15 +13,35 @@
 #include <libcamera/stream.h>
 #include <libcamera/pixel_format.h>
 #include "abstractvideofilter.h"
+#include "captureformatselector.h"
+#include <common/framepool.h>
 
 #include <QDebug>
 #include <QQmlListProperty>
 
+#include <algorithm>
+#include <utility>
+
 using namespace libcamera;
 
+namespace {
+// every camera keeps its filters on its own pipeline worker
+std::atomic<int> s_nextLocalityHint { 0 };
+// requests queued to the camera while it is idle
+constexpr int kIdleRequestsInFlight = 2;
+}
+
 QLibCamera::QLibCamera(QLibCameraManager* manager, const QString& cameraID, QObject *parent)
     : QThread{parent}, m_manager{manager}, m_cameraID{cameraID}
 {
+    // set up before the camera, the getters don't check for a failed one
+    m_budget = PipelineScheduler::instance()->registerBudget(m_cameraID);
+    m_filterGraph.setBudget(m_budget);
+    m_frameRatePolicy = new FrameRatePolicy(this);
+    connect(this, &QLibCamera::videoFiltersChanged, m_frameRatePolicy, [this]() {
+        m_frameRatePolicy->setFilters(m_videoFilters);
+    });
+
     auto camManager = m_manager->cameraManager();
     if (!camManager) {
         qWarning() << "Failed to get camera manager";
@@ -57,7 +77,16 @@ QLibCamera::QLibCamera(QLibCameraManager* manager, const QString& cameraID, QObj
     retrieveViefinderInfo();
 
     QObject::connect(this, &QLibCamera::frameReady, this, &QLibCamera::processCapture, Qt::QueuedConnection);
-    connect(&m_filtersWatcher, &QFutureWatcher<bool>::finished, this, &QLibCamera::handleFiltersFinished);
+    m_filterGraph.setFinishedCallback([this]() { Q_EMIT videoFiltersFinished(); });
+    m_filterGraph.setOutputCallback([this](const QVideoFrame &frame) { presentFrame(frame); });
+    m_filterGraph.setLocalityHint(s_nextLocalityHint++);
+
+    m_statisticsTimer.setInterval(1000);
+    connect(&m_statisticsTimer, &QTimer::timeout, this, [this]() {
+        if (m_isCapturing && !m_videoFilters.isEmpty())
+            Q_EMIT statisticsChanged();
+    });
+    m_statisticsTimer.start();
 
     start(QThread::TimeCriticalPriority);
 }
@@ -65,8 +94,15 @@ QLibCamera::QLibCamera(QLibCameraManager* manager, const QString& cameraID, QObj
 QLibCamera::~QLibCamera()
 {
     stopCapture();
+    if (m_formatSelection) {
+        m_formatSelection->wait();
+        delete m_formatSelection;
+        m_camera->release();
+    }
     m_threadLoop->exit();
     wait(1000);
+    m_filterGraph.waitForDone();
+    m_fanout.waitForDone();
 }
 
 QVideoSink *QLibCamera::videoSink() const
@@ -79,9 +115,60 @@ void QLibCamera::setVideoSink(QVideoSink *newVideoSink)
     if (m_videoSink == newVideoSink)
         return;
     m_videoSink = newVideoSink;
+    if (m_videoSinkConsumer) {
+        m_fanout.removeConsumer(m_videoSinkConsumer);
+        // a frame the old consumer already took doesn't reach the old sink
+        m_videoSinkConsumer->detach();
+        m_videoSinkConsumer.reset();
+    }
+    if (m_videoSink) {
+        m_videoSinkConsumer = std::make_shared<VideoSinkConsumer>(m_videoSink);
+        m_fanout.addConsumer(m_videoSinkConsumer);
+        watchSinkOwner(m_videoSink);
+    }
     Q_EMIT videoSinkChanged();
 }
 
+void QLibCamera::addVideoSink(QVideoSink *sink, qreal maxRate)
+{
+    if (!sink)
+        return;
+    auto consumer = std::make_shared<VideoSinkConsumer>(sink);
+    consumer->setMaxRate(maxRate);
+    m_fanout.addConsumer(consumer);
+    watchSinkOwner(sink);
+}
+
+void QLibCamera::removeVideoSink(QVideoSink *sink)
+{
+    const auto consumers = m_fanout.consumers();
+    for (const std::shared_ptr<FrameConsumer> &consumer : consumers) {
+        auto sinkConsumer = std::dynamic_pointer_cast<VideoSinkConsumer>(consumer);
+        if (sinkConsumer && sinkConsumer != m_videoSinkConsumer && sinkConsumer->sink() == sink) {
+            m_fanout.removeConsumer(consumer);
+            sinkConsumer->detach();
+        }
+    }
+}
+
+void QLibCamera::watchSinkOwner(QVideoSink *sink)
+{
+    // destroyed() of the sink itself comes after ~QVideoSink, a pipeline
+    // worker could still hand it a frame. Its parent emits destroyed() before
+    // the children are deleted, detach the consumer then. An owner deleting
+    // the sink in its own destructor is too late for this, main.qml resets
+    // the property on Component.onDestruction
+    QObject *owner = sink->parent();
+    if (!owner)
+        return;
+    connect(owner, &QObject::destroyed, this, [this, sink]() {
+        if (m_videoSink == sink)
+            setVideoSink(nullptr);
+        else
+            removeVideoSink(sink);
+    }, Qt::DirectConnection);
+}
+
 void QLibCamera::listControls() const
 {
     for (const auto &[id, info] : m_camera->controls()) {
@@ -142,14 +229,18 @@ void QLibCamera::retrieveViefinderInfo()
 
 QSize QLibCamera::frameSize() const
 {
+    QMutexLocker locker(&m_mutex);
     return m_frameSize;
 }
 
 void QLibCamera::setFrameSize(const QSize &newFrameSize)
 {
-    if (m_frameSize == newFrameSize)
-        return;
-    m_frameSize = newFrameSize;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_frameSize == newFrameSize)
+            return;
+        m_frameSize = newFrameSize;
+    }
     Q_EMIT frameSizeChanged();
 }
 
@@ -179,6 +270,10 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
         qWarning() << "Already capturing";
         return -EBUSY;
     }
+    if (m_formatSelection) {
+        qWarning() << "Still measuring the capture modes";
+        return -EBUSY;
+    }
 
     const auto stdId = m_cameraID.toStdString();
 
@@ -187,6 +282,26 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
         return -EINVAL;
     }
 
+    PixelFormat pixelFormat = m_prefferedPixelFormat;
+    QSize resolution = m_prefferedResolution;
+    if (m_autoFormat) {
+        // a finished measurement is used even if it found nothing, it isn't repeated
+        std::optional<CaptureFormatSelector::Mode> mode = std::exchange(m_selectedMode, std::nullopt);
+        if (!mode) {
+            const QList<FrameRequirements> requirements = filterRequirements();
+            CaptureFormatSelector selector(m_camera, m_cameraModel);
+            selector.setRequirements(requirements);
+            mode = selector.storedMode(m_viewfinderInfo);
+            // measuring takes seconds, it runs on a thread of its own
+            if (!mode->isValid())
+                return startFormatSelection(roles, requirements);
+        }
+        if (mode->isValid()) {
+            pixelFormat = mode->format;
+            resolution = mode->size;
+        }
+    }
+
     std::vector<libcamera::StreamRole> _roles;
 
     // if (roles.testFlag(StreamingRole::RawStreamingRole)) {
@@ -215,23 +330,23 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
     }
 
     // choose format and resolution
-    if (m_prefferedPixelFormat.isValid()) {
-        vfConfig.pixelFormat = m_prefferedPixelFormat;
-        m_frameFormat = QLibCameraManager::toQtFormat(m_prefferedPixelFormat);
-        qDebug() << "Using preffered format" << m_prefferedPixelFormat.toString() << m_frameFormat;
+    if (pixelFormat.isValid()) {
+        vfConfig.pixelFormat = pixelFormat;
+        m_frameFormat = QLibCameraManager::toQtFormat(pixelFormat);
+        qDebug() << "Using preffered format" << pixelFormat.toString() << m_frameFormat;
     } else {
         vfConfig.pixelFormat = formats[0];
         m_frameFormat = QLibCameraManager::toQtFormat(formats[0]);
     }
 
-    if (m_prefferedResolution.isValid()) {
-        vfConfig.size = Size(m_prefferedResolution.width(), m_prefferedResolution.height());
-        m_frameSize = m_prefferedResolution;
+    if (resolution.isValid()) {
+        vfConfig.size = Size(resolution.width(), resolution.height());
     } else {
         const auto sizes = vfConfig.formats().sizes(vfConfig.pixelFormat);
         vfConfig.size = sizes[sizes.size() - 1];
-        m_frameSize = QSize(vfConfig.size.width, vfConfig.size.height);
     }
+    if (m_bufferCount > 0)
+        vfConfig.bufferCount = m_bufferCount;
     /* Allow user to override configuration. */
     // if (StreamKeyValueParser::updateConfiguration(config_.get(),
     //                                               options_[OptStream])) {
@@ -255,6 +370,9 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
         return ret;
     }
 
+    /* Crop limits depend on the sensor mode chosen by configure() */
+    updateScalerCropLimits();
+
     /* Store stream allocation. */
     m_viewFinderStream = m_cameraConfig->at(0).stream();
     if (m_cameraConfig->size() == 2)
@@ -266,7 +384,10 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
      * Configure the viewfinder. If no color space is reported, default to
      * sYCC.
      */
-    m_frameSize = QSize(vfConfig.size.width, vfConfig.size.height);
+    {
+        QMutexLocker locker(&m_mutex);
+        m_frameSize = QSize(vfConfig.size.width, vfConfig.size.height);
+    }
     auto pixelFormat = vfConfig.pixelFormat;
     auto stride = vfConfig.stride;
     qInfo() << "Viewfinder configuration: " << m_frameSize << pixelFormat.toString().c_str() << stride << vfConfig.toString().c_str();
@@ -289,6 +410,9 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
             std::unique_ptr<Image> image =
                 Image::fromFrameBuffer(buffer.get(), Image::MapMode::ReadOnly);
             assert(image != nullptr);
+            if (m_mappedBuffers.empty())
+                qInfo() << "Capture buffers mapping:"
+                        << (image->mappingType() == Image::MappingType::DmaBuf ? "dmabuf" : "memory");
             m_mappedBuffers[buffer.get()] = std::move(image);
 
             /* Store buffers on the free list. */
@@ -318,19 +442,26 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
         m_requests.push_back(std::move(request));
     }
 
+    /* Prefault frames for the copies in flight and the filters conversions */
+    if (FramePool::instance()->isEnabled())
+        reserveFramePool();
+
     /* Start the title timer and the camera. */
     m_lastBufferTime = 0;
 
-    auto controls_ = m_camera->properties();
-
-    int64_t frame_time = 1000000 / 30.0; // in us
-    controls_.set(controls::FrameDurationLimits,
-                  libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
-    // controls_.set(controls::FrameDuration,frame_time);
-    // controls_.set(controls::ExposureTime, 300);
-
     m_camera->requestCompleted.connect(this, &QLibCamera::requestComplete);
 
+    {
+        QMutexLocker locker(&m_mutex);
+        m_cropRegion = QRectF(0.0, 0.0, 1.0, 1.0);
+        if (!m_analysisRegion.isNull() && !m_scalerCropMaximum.isNull())
+            m_pendingControls.set(controls::ScalerCrop, scalerCropForRegion(m_analysisRegion));
+        if (m_frameRate > 0.0 || m_idleFrameRate > 0.0)
+            queueFrameDurationLimits();
+        if (m_exposureTime > 0 || m_analogueGain > 0.0)
+            queueExposureControls();
+    }
+
     ret = m_camera->start(/*&controls_*/);
     if (ret) {
         qInfo() << "Failed to start capture";
@@ -348,12 +479,30 @@ int QLibCamera::startCapture(const QLibCameraManager::StreamingRoles& roles)
         }
     }
 
-    m_isCapturing = true;
+    m_roles = roles;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isCapturing = true;
+    }
     Q_EMIT isCapturingChanged();
 
     return 0;
 }
 
+int QLibCamera::restartCapture()
+{
+    if (!m_isCapturing)
+        return 0;
+    const QLibCameraManager::StreamingRoles roles = m_roles;
+    stopCapture();
+    return startCapture(roles);
+}
+
+QLibCameraManager::StreamingRoles QLibCamera::captureRoles() const
+{
+    return m_roles;
+}
+
 void QLibCamera::cameraCleanup(bool stopCapture)
 {
     if (stopCapture && m_camera) {
@@ -371,6 +520,12 @@ void QLibCamera::cameraCleanup(bool stopCapture)
 
 void QLibCamera::stopCapture()
 {
+    if (m_formatSelection) {
+        // the camera is released once the measurement returns
+        m_startAfterSelection = false;
+        m_formatSelector->cancel();
+        return;
+    }
     if (!m_isCapturing) {
         qWarning() << "Not capturing";
         return;
@@ -378,7 +533,13 @@ void QLibCamera::stopCapture()
 
     cameraCleanup(true);
     m_captureRaw = false;
-    m_isCapturing = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isCapturing = false;
+        m_pendingControls.clear();
+        m_requestsInFlight = 0;
+        m_heldRequests.clear();
+    }
     Q_EMIT isCapturingChanged();
     m_freeQueue.clear();
     m_cameraConfig.reset();
@@ -399,13 +560,9 @@ void QLibCamera::requestComplete(Request *request)
      */
     {
         QMutexLocker locker(&m_mutex);
+        m_requestsInFlight--;
         m_doneQueue.enqueue(request);
     }
-    //int64_t frame_time = 1000000 / 10.0; // in us
-    //std::int64_t value_pair[2] = {frame_time, frame_time};
-    //request->controls().set(libcamera::controls::FrameDurationLimits, libcamera::Span<const std::int64_t, 2>(value_pair));
-    request->controls().set(libcamera::controls::AeEnable, false);
-    request->controls().set(libcamera::controls::ExposureTime, 300);
     //qDebug() << "requestComplete" << (QThread::currentThread() == qApp->thread() ? "Main thread" : "Worker thread");
     processCapture();
 }
@@ -427,6 +584,10 @@ void QLibCamera::processCapture()
         request = m_doneQueue.dequeue();
     }
 
+    const auto scalerCrop = request->metadata().get(controls::ScalerCrop);
+    if (scalerCrop)
+        updateCropRegion(*scalerCrop);
+
     /* Process buffers. */
     if (request->buffers().count(m_viewFinderStream))
         processViewfinder(request->buffers().at(m_viewFinderStream));
@@ -439,11 +600,6 @@ void QLibCamera::processCapture()
     m_freeQueue.enqueue(request);
 }
 
-void QLibCamera::handleFiltersFinished()
-{
-    Q_EMIT videoFiltersFinished();
-}
-
 void QLibCamera::processViewfinder(FrameBuffer *buffer)
 {
     //framesCaptured_++;
@@ -465,12 +621,18 @@ void QLibCamera::processViewfinder(FrameBuffer *buffer)
     //     << "fps:" << Qt::fixed << qSetRealNumberPrecision(2) << fps << "format:" << m_frameFormat;
 
     /* Render the frame on the viewfinder. */
-    size_t size = buffer->metadata().planes()[0].bytesused;
-
-    QVideoFrame frame = QVideoFrame(QVideoFrameFormat(m_frameSize, m_frameFormat));
+    QVideoFrame frame = FramePool::instance()->videoFrame(QVideoFrameFormat(m_frameSize, m_frameFormat));
     if (frame.map(QVideoFrame::WriteOnly)) {
-        auto image  = m_mappedBuffers[buffer].get();
-        memcpy(frame.bits(0), image->data(0).data(), size);
+        const Image *image = m_mappedBuffers[buffer].get();
+        {
+            Image::CpuAccess access(image);
+            // every plane, NV12 and YUV420 have their chroma in the second and third
+            const int planes = std::min(frame.planeCount(), int(image->numPlanes()));
+            for (int plane = 0; plane < planes; ++plane) {
+                const size_t size = std::min<size_t>(metadata.planes()[plane].bytesused, frame.mappedBytes(plane));
+                image->copyPlane(plane, frame.bits(plane), size);
+            }
+        }
         frame.unmap();
         // Convert JPEG to RGBA8888
         // For video sink it should be done automatically, but for filters we want to have it in RGBA8888
@@ -478,22 +640,33 @@ void QLibCamera::processViewfinder(FrameBuffer *buffer)
         if (m_frameFormat == QVideoFrameFormat::Format_Jpeg) {
             const auto img = frame.toImage().convertToFormat(QImage::Format_RGBA8888);
             QVideoFrameFormat fmt(img.size(), QVideoFrameFormat::Format_RGBA8888);
-            frame = QVideoFrame(fmt);
+            frame = FramePool::instance()->videoFrame(fmt);
             frame.map(QVideoFrame::WriteOnly);
             memcpy(frame.bits(0), img.bits(), img.sizeInBytes());
             frame.unmap();
         }
-        if (m_videoSink) {
-            m_videoSink->setVideoFrame(frame);
-        }
-        if (m_videoFilters.isEmpty() == false && m_filtersWatcher.isRunning() == false) {
-            QFuture<bool> future = QtConcurrent::run(&QLibCamera::filtersRunner, this, frame);
-            m_filtersWatcher.setFuture(future);
+        // with processing filters, active or not, every frame reaches the sink
+        // from the filter graph, otherwise show the captured one right away
+        frame.setStartTime(qint64(metadata.timestamp / 1000));
+        if (!m_filterGraph.hasOutput())
+            presentFrame(frame);
+        if (m_videoFilters.isEmpty() == false) {
+            m_filterGraph.post(frame, cropRegion());
         }
     }
     renderComplete(buffer);
 }
 
+void QLibCamera::presentFrame(const QVideoFrame &frame)
+{
+    m_budget->recordFrame();
+    // the scheduler thins the preview out last, when shedding analysis wasn't enough
+    const int divisor = m_budget->previewDivisor();
+    const bool shed = divisor > 1 && m_presentedFrames++ % divisor != 0;
+    m_fanout.publish(frame, shed);
+    Q_EMIT videoFrameReady(frame);
+}
+
 void QLibCamera::processRaw(FrameBuffer *buffer,
                                    [[maybe_unused]] const ControlList &metadata)
 {
@@ -545,12 +718,32 @@ void QLibCamera::renderComplete(FrameBuffer *buffer)
             qWarning() << "No free buffer available for RAW capture";
         }
     }
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_idleFrameRate > 0.0 && m_requestsInFlight >= kIdleRequestsInFlight) {
+            m_heldRequests.enqueue(request);
+            return;
+        }
+    }
     queueRequest(request);
 }
 
 int QLibCamera::queueRequest(Request *request)
 {
-    return m_camera->queueRequest(request);
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_pendingControls.empty()) {
+            request->controls().merge(m_pendingControls);
+            m_pendingControls.clear();
+        }
+        m_requestsInFlight++;
+    }
+    const int ret = m_camera->queueRequest(request);
+    if (ret < 0) {
+        QMutexLocker locker(&m_mutex);
+        m_requestsInFlight--;
+    }
+    return ret;
 }
 
 void QLibCamera::addFilter(AbstractVideoFilter *filter)
@@ -560,6 +753,10 @@ void QLibCamera::addFilter(AbstractVideoFilter *filter)
     if (m_videoFilters.contains(filter))
         return;
     m_videoFilters.append(filter);
+    connect(filter, &AbstractVideoFilter::dependenciesChanged, this, [this]() {
+        m_filterGraph.setFilters(m_videoFilters);
+    });
+    m_filterGraph.setFilters(m_videoFilters);
     Q_EMIT videoFiltersChanged();
 }
 
@@ -567,10 +764,88 @@ void QLibCamera::removeFilter(AbstractVideoFilter *filter)
 {
     if (!filter)
         return;
+    disconnect(filter, &AbstractVideoFilter::dependenciesChanged, this, nullptr);
     m_videoFilters.removeAll(filter);
+    m_filterGraph.setFilters(m_videoFilters);
     Q_EMIT videoFiltersChanged();
 }
 
+AbstractVideoFilter *QLibCamera::filter(const QString &name) const
+{
+    for (AbstractVideoFilter *filter : m_videoFilters) {
+        if (filter->objectName() == name)
+            return filter;
+    }
+    return nullptr;
+}
+
+void QLibCamera::destroyFilter(const QString &name)
+{
+    AbstractVideoFilter *namedFilter = filter(name);
+    if (!namedFilter)
+        return;
+    removeFilter(namedFilter);
+    // a pipeline task could still run it
+    m_filterGraph.waitForDone();
+    delete namedFilter;
+}
+
+quint64 QLibCamera::droppedFrames(AbstractVideoFilter *filter) const
+{
+    return m_filterGraph.droppedFrames(filter);
+}
+
+quint64 QLibCamera::processedFrames(AbstractVideoFilter *filter) const
+{
+    return m_filterGraph.processedFrames(filter);
+}
+
+QList<VideoFilterGraph::FilterStatistics> QLibCamera::filterStatistics() const
+{
+    return m_filterGraph.statistics();
+}
+
+LatencyHistogram::Snapshot QLibCamera::frameLatency() const
+{
+    return m_filterGraph.frameLatency();
+}
+
+QVariantMap QLibCamera::statisticsMap() const
+{
+    QVariantList filters;
+    const auto statistics = m_filterGraph.statistics();
+    for (const VideoFilterGraph::FilterStatistics &filterStatistics : statistics) {
+        const QString name = filterStatistics.filter->objectName();
+        filters.append(QVariantMap {
+            { "filter", QVariant::fromValue(filterStatistics.filter) },
+            { "name", name.isEmpty() ? QString(filterStatistics.filter->metaObject()->className()) : name },
+            { "processed", filterStatistics.processed },
+            { "dropped", filterStatistics.dropped },
+            { "throttled", filterStatistics.throttled },
+            { "gated", filterStatistics.gated },
+            { "shed", filterStatistics.shed },
+            { "late", filterStatistics.late },
+            { "queueWait", filterStatistics.queueWait.toVariantMap() },
+            { "runTime", filterStatistics.runTime.toVariantMap() },
+            { "conversionTime", filterStatistics.conversionTime.toVariantMap() },
+        });
+    }
+    return {
+        { "frameLatency", m_filterGraph.frameLatency().toVariantMap() },
+        { "filters", filters },
+        { "frameRatePolicy", m_frameRatePolicy->statisticsMap() },
+        { "budget", m_budget->statisticsMap() },
+        { "consumers", m_fanout.statisticsMap() },
+    };
+}
+
+void QLibCamera::resetStatistics()
+{
+    m_filterGraph.resetStatistics();
+    m_fanout.resetStatistics();
+    Q_EMIT statisticsChanged();
+}
+
 QList<AbstractVideoFilter*> QLibCamera::filters() const
 {
     return m_videoFilters;
@@ -656,23 +931,345 @@ void QLibCamera::setPrefferedResolution(const QString &resolution)
     m_prefferedResolution = QSize(resList.at(0).toInt(), resList.at(1).toInt());
 }
 
-void QLibCamera::run()
+void QLibCamera::setPrefferedResolution(const QSize &resolution)
 {
-    m_threadLoop = new QEventLoop();
-    m_threadLoop->exec();
-    m_threadLoop->deleteLater();
-    m_threadLoop = nullptr;
+    m_prefferedResolution = resolution;
+}
 
-    qWarning() << "QLibCam thread finished";
+int QLibCamera::bufferCount() const
+{
+    return m_bufferCount;
+}
+
+void QLibCamera::setBufferCount(int count)
+{
+    m_bufferCount = std::max(count, 0);
 }
 
-bool QLibCamera::filtersRunner(const QVideoFrame &frame)
+qreal QLibCamera::frameRate() const
 {
-    QVideoFrame _frame = frame;
+    return m_frameRate;
+}
+
+void QLibCamera::setFrameRate(qreal rate)
+{
+    rate = std::max<qreal>(rate, 0.0);
+    if (qFuzzyCompare(m_frameRate, rate))
+        return;
+    m_frameRate = rate;
+    if (m_isCapturing) {
+        QMutexLocker locker(&m_mutex);
+        queueFrameDurationLimits();
+    }
+    Q_EMIT frameRateChanged();
+}
+
+void QLibCamera::setIdleFrameRate(qreal rate)
+{
+    QQueue<Request *> held;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_idleFrameRate = std::max<qreal>(rate, 0.0);
+        if (!m_isCapturing)
+            return;
+        queueFrameDurationLimits();
+        if (m_idleFrameRate <= 0.0)
+            held.swap(m_heldRequests);
+    }
+    // the first one carries the full rate
+    for (Request *request : std::as_const(held))
+        queueRequest(request);
+}
+
+int QLibCamera::priority() const
+{
+    return m_budget->priority();
+}
+
+void QLibCamera::setPriority(int priority)
+{
+    if (m_budget->priority() == priority)
+        return;
+    m_budget->setPriority(priority);
+    Q_EMIT priorityChanged();
+}
+
+void QLibCamera::queueFrameDurationLimits()
+{
+    const ControlInfoMap &cameraControls = m_camera->controls();
+    const auto limits = cameraControls.find(&controls::FrameDurationLimits);
+    if (limits == cameraControls.end()) {
+        qWarning() << "Camera" << m_cameraModel << "does not support FrameDurationLimits";
+        return;
+    }
+
+    /* Frame durations are in microseconds, the default range lets the AE choose */
+    int64_t minDuration = limits->second.min().get<int64_t>();
+    int64_t maxDuration = limits->second.max().get<int64_t>();
+    // the idle rate only ever lowers the configured one
+    qreal rate = m_frameRate;
+    if (m_idleFrameRate > 0.0 && (rate <= 0.0 || m_idleFrameRate < rate))
+        rate = m_idleFrameRate;
+    if (rate > 0.0) {
+        const int64_t duration = std::clamp(int64_t(1000000.0 / rate), minDuration, maxDuration);
+        minDuration = duration;
+        maxDuration = duration;
+    }
+    m_pendingControls.set(controls::FrameDurationLimits,
+                          libcamera::Span<const int64_t, 2>({ minDuration, maxDuration }));
+}
+
+int QLibCamera::exposureTime() const
+{
+    return m_exposureTime;
+}
+
+void QLibCamera::setExposureTime(int us)
+{
+    us = std::max(us, 0);
+    if (m_exposureTime == us)
+        return;
+    m_exposureTime = us;
+    if (m_isCapturing) {
+        QMutexLocker locker(&m_mutex);
+        queueExposureControls();
+    }
+    Q_EMIT exposureChanged();
+}
+
+qreal QLibCamera::analogueGain() const
+{
+    return m_analogueGain;
+}
+
+void QLibCamera::setAnalogueGain(qreal gain)
+{
+    gain = std::max<qreal>(gain, 0.0);
+    if (qFuzzyCompare(m_analogueGain, gain))
+        return;
+    m_analogueGain = gain;
+    if (m_isCapturing) {
+        QMutexLocker locker(&m_mutex);
+        queueExposureControls();
+    }
+    Q_EMIT exposureChanged();
+}
+
+void QLibCamera::queueExposureControls()
+{
+    /* Controls are sticky, whatever is left at 0 stays under AE control or at its last value */
+    const bool manual = m_exposureTime > 0 || m_analogueGain > 0.0;
+    m_pendingControls.set(controls::AeEnable, !manual);
+    if (m_exposureTime > 0)
+        m_pendingControls.set(controls::ExposureTime, int32_t(m_exposureTime));
+    if (m_analogueGain > 0.0)
+        m_pendingControls.set(controls::AnalogueGain, float(m_analogueGain));
+}
+
+bool QLibCamera::autoFormat() const
+{
+    return m_autoFormat;
+}
+
+void QLibCamera::setAutoFormat(bool enable)
+{
+    if (m_autoFormat == enable)
+        return;
+    m_autoFormat = enable;
+    Q_EMIT autoFormatChanged();
+}
+
+void QLibCamera::resetAutoFormat()
+{
+    CaptureFormatSelector::forgetDecision(m_cameraModel);
+}
+
+QList<FrameRequirements> QLibCamera::filterRequirements() const
+{
+    QList<FrameRequirements> requirements;
     for (AbstractVideoFilter *filter : m_videoFilters) {
-        if (filter->isActive()) {
-            _frame = filter->run(&_frame);
+        if (filter->isActive())
+            requirements.append(filter->requirements());
+    }
+    return requirements;
+}
+
+int QLibCamera::startFormatSelection(const QLibCameraManager::StreamingRoles &roles,
+                                     const QList<FrameRequirements> &requirements)
+{
+    qInfo() << "Measuring the capture modes of" << m_cameraModel;
+    auto selector = std::make_shared<CaptureFormatSelector>(m_camera, m_cameraModel);
+    selector->setRequirements(requirements);
+    m_formatSelector = selector;
+    m_startAfterSelection = true;
+    m_formatSelection = QThread::create([this, selector, viewfinderInfo = m_viewfinderInfo, roles]() {
+        const CaptureFormatSelector::Mode mode = selector->select(viewfinderInfo);
+        QMetaObject::invokeMethod(this, [this, mode, roles]() {
+            formatSelected(mode, roles);
+        }, Qt::QueuedConnection);
+    });
+    m_formatSelection->start();
+    return 0;
+}
+
+void QLibCamera::formatSelected(const CaptureFormatSelector::Mode &mode, const QLibCameraManager::StreamingRoles &roles)
+{
+    m_formatSelection->wait();
+    delete m_formatSelection;
+    m_formatSelection = nullptr;
+    m_formatSelector.reset();
+    m_camera->release();
+    if (!std::exchange(m_startAfterSelection, false))
+        return;
+    m_selectedMode = mode;
+    startCapture(roles);
+}
+
+void QLibCamera::reserveFramePool()
+{
+    FramePool *pool = FramePool::instance();
+    const int count = int(m_requests.size()) + 2;
+
+    if (m_frameFormat == QVideoFrameFormat::Format_Jpeg)
+        pool->reserveFrames(QVideoFrameFormat(m_frameSize, QVideoFrameFormat::Format_RGBA8888), count);
+    else
+        pool->reserveFrames(QVideoFrameFormat(m_frameSize, m_frameFormat), count);
+
+    for (AbstractVideoFilter *filter : std::as_const(m_videoFilters)) {
+        const FrameRequirements req = filter->requirements();
+        if (req.format == QImage::Format_Invalid)
+            continue;
+        QSize size = req.roi.isNull() ? m_frameSize : req.roi.size().boundedTo(m_frameSize);
+        if (req.maxSize.isValid())
+            size = size.scaled(size.boundedTo(req.maxSize), Qt::KeepAspectRatio);
+        pool->reserveImages(size, req.format, 2);
+    }
+    qInfo() << "Frame pool pinned" << pool->pinnedBytes() / (1024 * 1024) << "MB,"
+            << pool->hugePageBytes() / (1024 * 1024) << "MB in huge pages";
+}
+
+QRectF QLibCamera::analysisRegion() const
+{
+    return m_analysisRegion;
+}
+
+void QLibCamera::setAnalysisRegion(const QRectF &region)
+{
+    QRectF _region = region.intersected(QRectF(0.0, 0.0, 1.0, 1.0));
+    if (_region.isEmpty() || _region == QRectF(0.0, 0.0, 1.0, 1.0))
+        _region = QRectF();
+    if (m_analysisRegion == _region)
+        return;
+    m_analysisRegion = _region;
+
+    bool supported = true;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_isCapturing) {
+            supported = !m_scalerCropMaximum.isNull();
+            if (supported)
+                m_pendingControls.set(controls::ScalerCrop, scalerCropForRegion(m_analysisRegion));
+        }
+    }
+    if (!supported)
+        qWarning() << "Camera" << m_cameraModel << "does not support ScalerCrop";
+    Q_EMIT analysisRegionChanged();
+}
+
+QRectF QLibCamera::cropRegion() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_cropRegion;
+}
+
+void QLibCamera::updateScalerCropLimits()
+{
+    Rectangle maximum;
+    Size minimum;
+
+    /* The pipeline handler updates the limits for the configured sensor mode */
+    const ControlInfoMap &cameraControls = m_camera->controls();
+    const auto scalerCrop = cameraControls.find(&controls::ScalerCrop);
+    if (scalerCrop != cameraControls.end()) {
+        maximum = scalerCrop->second.max().get<Rectangle>();
+        minimum = scalerCrop->second.min().get<Rectangle>().size();
+        if (maximum.isNull()) {
+            const auto property = m_camera->properties().get(properties::ScalerCropMaximum);
+            if (property)
+                maximum = *property;
         }
     }
-    return true;
+
+    QMutexLocker locker(&m_mutex);
+    m_scalerCropMaximum = maximum;
+    m_scalerCropMinimum = minimum;
+}
+
+Rectangle QLibCamera::scalerCropForRegion(const QRectF &region) const
+{
+    const Rectangle &max = m_scalerCropMaximum;
+    const QRectF maxRect(max.x, max.y, max.width, max.height);
+    const QRectF _region = region.isNull() ? QRectF(0.0, 0.0, 1.0, 1.0) : region;
+
+    QRectF crop(maxRect.x() + _region.x() * maxRect.width(),
+                maxRect.y() + _region.y() * maxRect.height(),
+                _region.width() * maxRect.width(),
+                _region.height() * maxRect.height());
+    const QPointF center = crop.center();
+
+    /* Not smaller than the pipeline can scale up */
+    crop.setWidth(std::max<qreal>(crop.width(), m_scalerCropMinimum.width));
+    crop.setHeight(std::max<qreal>(crop.height(), m_scalerCropMinimum.height));
+
+    /* Keep the output aspect ratio, otherwise the ISP stretches the picture */
+    if (!m_frameSize.isEmpty()) {
+        const qreal aspect = qreal(m_frameSize.width()) / m_frameSize.height();
+        if (crop.width() / crop.height() < aspect)
+            crop.setWidth(crop.height() * aspect);
+        else
+            crop.setHeight(crop.width() / aspect);
+    }
+
+    crop.setSize(crop.size().boundedTo(maxRect.size()));
+    crop.moveCenter(center);
+    if (crop.left() < maxRect.left())
+        crop.moveLeft(maxRect.left());
+    if (crop.right() > maxRect.right())
+        crop.moveRight(maxRect.right());
+    if (crop.top() < maxRect.top())
+        crop.moveTop(maxRect.top());
+    if (crop.bottom() > maxRect.bottom())
+        crop.moveBottom(maxRect.bottom());
+
+    return Rectangle(qRound(crop.x()), qRound(crop.y()),
+                     static_cast<unsigned int>(qRound(crop.width())),
+                     static_cast<unsigned int>(qRound(crop.height())));
+}
+
+void QLibCamera::updateCropRegion(const Rectangle &crop)
+{
+    if (crop.isNull())
+        return;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_scalerCropMaximum.isNull())
+            return;
+        const Rectangle &max = m_scalerCropMaximum;
+        const QRectF region(qreal(crop.x - max.x) / max.width, qreal(crop.y - max.y) / max.height,
+                            qreal(crop.width) / max.width, qreal(crop.height) / max.height);
+        if (m_cropRegion == region)
+            return;
+        m_cropRegion = region;
+    }
+    Q_EMIT cropRegionChanged();
+}
+
+void QLibCamera::run()
+{
+    m_threadLoop = new QEventLoop();
+    m_threadLoop->exec();
+    m_threadLoop->deleteLater();
+    m_threadLoop = nullptr;
+
+    qWarning() << "QLibCam thread finished";
 }
@@ -4,13 +4,11 @@
 #include <QObject>
 #include <QQueue>
 #include <QThread>
+#include <QTimer>
 #include <QVideoFrame>
 #include <QVideoSink>
-#include <QtConcurrent>
-#include <QFuture>
 #include "libcamera/pixel_format.h"
 #include "qcontainerfwd.h"
-#include "qfuturewatcher.h"
 
 #include <common/image.h>
 #include <libcamera/camera.h>
@@ -18,10 +16,17 @@
 #include <libcamera/controls.h>
 #include <libcamera/framebuffer.h>
 #include <libcamera/framebuffer_allocator.h>
+#include <libcamera/geometry.h>
 #include <libcamera/request.h>
 #include <libcamera/stream.h>
 
+#include <optional>
+
+#include "captureformatselector.h"
+#include "framefanout.h"
+#include "frameratepolicy.h"
 #include "qlibcameramanager.h"
+#include "videofiltergraph.h"
 #include "qvideoframe.h"
 #include "qvideoframeformat.h"
 
@@ -42,6 +47,15 @@ class QLibCamera : public QThread
     Q_PROPERTY(QVideoFrameFormat::PixelFormat frameFormat READ frameFormat WRITE setFrameFormat
                    NOTIFY frameFormatChanged FINAL)
     Q_PROPERTY(QSize frameSize READ frameSize WRITE setFrameSize NOTIFY frameSizeChanged FINAL)
+    Q_PROPERTY(QRectF analysisRegion READ analysisRegion WRITE setAnalysisRegion NOTIFY analysisRegionChanged FINAL)
+    Q_PROPERTY(QRectF cropRegion READ cropRegion NOTIFY cropRegionChanged FINAL)
+    Q_PROPERTY(bool autoFormat READ autoFormat WRITE setAutoFormat NOTIFY autoFormatChanged FINAL)
+    Q_PROPERTY(qreal frameRate READ frameRate WRITE setFrameRate NOTIFY frameRateChanged FINAL)
+    Q_PROPERTY(FrameRatePolicy *frameRatePolicy READ frameRatePolicy CONSTANT FINAL)
+    Q_PROPERTY(int priority READ priority WRITE setPriority NOTIFY priorityChanged FINAL)
+    Q_PROPERTY(int exposureTime READ exposureTime WRITE setExposureTime NOTIFY exposureChanged FINAL)
+    Q_PROPERTY(qreal analogueGain READ analogueGain WRITE setAnalogueGain NOTIFY exposureChanged FINAL)
+    Q_PROPERTY(QVariantMap statistics READ statisticsMap NOTIFY statisticsChanged FINAL)
 
 public:
     explicit QLibCamera(QLibCameraManager *manager, const QString &cameraID, QObject *parent = nullptr);
@@ -50,8 +64,19 @@ public:
     QVideoSink *videoSink() const;
     void setVideoSink(QVideoSink *newVideoSink);
 
+    // every consumer gets the frames the video sink shows, at its own pace.
+    // The videoSink property is one of them. A sink is dropped when its
+    // parent, e.g. a VideoOutput, is destroyed; a sink without one has to be
+    // removed, or the property reset, before it is deleted
+    FrameFanout *frameFanout() { return &m_fanout; }
+    Q_INVOKABLE void addVideoSink(QVideoSink *sink, qreal maxRate = 0.0);
+    Q_INVOKABLE void removeVideoSink(QVideoSink *sink);
+
     int startCapture(const QLibCameraManager::StreamingRoles &roles);
     void stopCapture();
+    // applies the format, resolution and buffer count set since the capture started
+    int restartCapture();
+    QLibCameraManager::StreamingRoles captureRoles() const;
 
     QString model() const;
     QString id() const;
@@ -60,6 +85,10 @@ public:
     QList<AbstractVideoFilter*> filters() const;
     void addFilter(AbstractVideoFilter *filter);
     void removeFilter(AbstractVideoFilter *filter);
+    // filter created for the camera by the factory with the given name
+    Q_INVOKABLE AbstractVideoFilter *filter(const QString &name) const;
+    // removes the named filter and deletes it once it is not running anymore
+    void destroyFilter(const QString &name);
 
     QStringList formats() const;
 
@@ -79,6 +108,57 @@ public:
     Q_INVOKABLE void setPrefferedFormat(QVideoFrameFormat::PixelFormat prefferedFormat);
 
     Q_INVOKABLE void setPrefferedResolution(const QString& resolution);
+    void setPrefferedResolution(const QSize &resolution);
+
+    // capture buffers to allocate, 0 for the pipeline handler default
+    int bufferCount() const;
+    void setBufferCount(int count);
+
+    // fixed sensor frame rate through FrameDurationLimits, 0 for the camera default
+    qreal frameRate() const;
+    void setFrameRate(qreal rate);
+    // lowers the frame rate while the analysis filters see no activity
+    FrameRatePolicy *frameRatePolicy() const { return m_frameRatePolicy; }
+
+    // cameras with a lower priority shed their analysis and preview frames
+    // first when the pipeline is overloaded, see PipelineScheduler
+    int priority() const;
+    void setPriority(int priority);
+
+    // manual exposure in microseconds and analogue gain, e.g. from an
+    // ExposureFilter. With both at 0 the camera runs its own AE
+    int exposureTime() const;
+    void setExposureTime(int us);
+    qreal analogueGain() const;
+    void setAnalogueGain(qreal gain);
+
+    // choose format and resolution from the measured capture and conversion
+    // cost instead of the preffered ones. The decision is stored per camera model.
+    // Without a stored decision startCapture() returns at once, the capture
+    // starts after the measurement
+    bool autoFormat() const;
+    void setAutoFormat(bool enable);
+    Q_INVOKABLE void resetAutoFormat();
+
+    // frames the filter skipped because it was still busy with an earlier one
+    Q_INVOKABLE quint64 droppedFrames(AbstractVideoFilter *filter) const;
+    Q_INVOKABLE quint64 processedFrames(AbstractVideoFilter *filter) const;
+
+    // filters timings, updated every second while capturing
+    QList<VideoFilterGraph::FilterStatistics> filterStatistics() const;
+    LatencyHistogram::Snapshot frameLatency() const;
+    QVariantMap statisticsMap() const;
+    Q_INVOKABLE void resetStatistics();
+
+    // normalized region of the sensor field of view to capture, applied on the
+    // ISP side through the ScalerCrop control. Null rect means full field of view.
+    // The viewfinder is the only stream, the preview shows the cropped region
+    // too. Filters results are mapped back to the full field of view with
+    // VideoFilterFrame::mapToFullFrame()
+    QRectF analysisRegion() const;
+    void setAnalysisRegion(const QRectF &region);
+    // normalized region actually cropped by the pipeline for the latest frame
+    QRectF cropRegion() const;
 
 Q_SIGNALS:
     void videoSinkChanged();
@@ -86,24 +166,35 @@ Q_SIGNALS:
     void cameraChanged();
     void videoFiltersChanged();
     void videoFiltersFinished();
+    // frame published to the consumers, processed by the filters if any processing one is active
+    void videoFrameReady(const QVideoFrame &frame);
     void formatsChanged();
     void isCapturingChanged();
     void frameFormatChanged();
     void frameSizeChanged();
+    void analysisRegionChanged();
+    void cropRegionChanged();
+    void autoFormatChanged();
+    void frameRateChanged();
+    void priorityChanged();
+    void exposureChanged();
+    void statisticsChanged();
 
 protected:
     void run() override;
 
 private Q_SLOTS:
     void processCapture();
-    void handleFiltersFinished();
-    bool filtersRunner(const QVideoFrame& frame);
 
 private:
+    friend class FrameRatePolicy;
+
     void requestComplete(libcamera::Request *request);
     void cameraCleanup(bool stopCapture);
     void processViewfinder(libcamera::FrameBuffer *buffer);
     void processRaw(libcamera::FrameBuffer *buffer, const libcamera::ControlList &metadata);
+    void presentFrame(const QVideoFrame &frame);
+    void watchSinkOwner(QVideoSink *sink);
 
     void listControls() const;
     void listProperties() const;
@@ -113,6 +204,22 @@ private:
 
     void retrieveViefinderInfo();
 
+    void reserveFramePool();
+    QList<FrameRequirements> filterRequirements() const;
+    int startFormatSelection(const QLibCameraManager::StreamingRoles &roles,
+                             const QList<FrameRequirements> &requirements);
+    void formatSelected(const CaptureFormatSelector::Mode &mode, const QLibCameraManager::StreamingRoles &roles);
+
+    void updateScalerCropLimits();
+    // m_mutex held, reads the crop limits and the frame size
+    libcamera::Rectangle scalerCropForRegion(const QRectF &region) const;
+    void updateCropRegion(const libcamera::Rectangle &crop);
+    void queueFrameDurationLimits();
+    void queueExposureControls();
+    // FrameRatePolicy, caps the frame rate without touching the frameRate
+    // property, 0 - not idle
+    void setIdleFrameRate(qreal rate);
+
 private:
     QVideoFrame m_videoFrame;
     std::shared_ptr<libcamera::Camera> m_camera;
@@ -121,10 +228,11 @@ private:
     std::unique_ptr<libcamera::CameraConfiguration> m_cameraConfig;
     std::map<libcamera::FrameBuffer *, std::unique_ptr<Image>> m_mappedBuffers;
 
-    /* Capture state, buffers queue and statistics */
+    /* Capture state, buffers queue and statistics. m_isCapturing, m_frameSize
+       and the crop limits are written under m_mutex */
     bool m_isCapturing = false;
     bool m_captureRaw = false;
-    QMutex m_mutex;
+    mutable QMutex m_mutex;
     libcamera::Stream *m_viewFinderStream = nullptr;
     libcamera::Stream *m_rawStream = nullptr;
     std::map<const libcamera::Stream *, QQueue<libcamera::FrameBuffer *>> m_freeBuffers;
@@ -135,17 +243,47 @@ private:
 
     QEventLoop *m_threadLoop = nullptr;
     QVideoSink *m_videoSink = nullptr;
+    std::shared_ptr<VideoSinkConsumer> m_videoSinkConsumer;
     QVideoFrameFormat::PixelFormat m_frameFormat = QVideoFrameFormat::Format_YUYV;
     QSize m_frameSize;
     libcamera::PixelFormat m_prefferedPixelFormat;
     QSize m_prefferedResolution;
+    bool m_autoFormat = false;
+    /* Capture mode measurement, the camera stays acquired meanwhile */
+    QThread *m_formatSelection = nullptr;
+    std::shared_ptr<CaptureFormatSelector> m_formatSelector;
+    bool m_startAfterSelection = false;
+    // result of the last measurement, used by the next startCapture()
+    std::optional<CaptureFormatSelector::Mode> m_selectedMode;
+    int m_bufferCount = 0;
+    qreal m_frameRate = 0.0;
+    FrameRatePolicy *m_frameRatePolicy = nullptr;
+    /* Idle override, an idle camera keeps few requests queued and holds the
+       others back, to come back to full rate within a frame or two. Under m_mutex */
+    qreal m_idleFrameRate = 0.0;
+    int m_requestsInFlight = 0;
+    QQueue<libcamera::Request *> m_heldRequests;
+    std::shared_ptr<PipelineScheduler::Budget> m_budget;
+    std::atomic<quint64> m_presentedFrames { 0 };
+    int m_exposureTime = 0;
+    qreal m_analogueGain = 0.0;
+    QLibCameraManager::StreamingRoles m_roles;
     uint64_t m_lastBufferTime = 0;
     QLibCameraManager *m_manager = nullptr;
     QString m_cameraID;
     QString m_cameraModel;
     QString m_cameraLocation { "Unknown"};
     QList<AbstractVideoFilter *> m_videoFilters;
-    QFutureWatcher<bool> m_filtersWatcher;
+    VideoFilterGraph m_filterGraph;
+    FrameFanout m_fanout;
+    QTimer m_statisticsTimer;
     QList<libcamera::StreamFormats> m_viewfinderInfo;
     QStringList m_formats;
+
+    /* Controls applied with the next queued request */
+    libcamera::ControlList m_pendingControls;
+    libcamera::Rectangle m_scalerCropMaximum;
+    libcamera::Size m_scalerCropMinimum;
+    QRectF m_analysisRegion;
+    QRectF m_cropRegion { 0.0, 0.0, 1.0, 1.0 };
 };
@@ -7,7 +7,9 @@
 #include <libcamera/formats.h>
 
 #include <QEventLoop>
+#include <QFileInfo>
 #include <QImage>
+#include <QMetaProperty>
 #include <QMutexLocker>
 #include <QQmlEngine>
 
@@ -16,6 +18,10 @@
 #include <utility>
 
 #include "qlibcamera.h"
+#include "abstractvideofilter.h"
+#include "pipelineconfig.h"
+#include <common/framepool.h>
+#include <common/pipelineexecutor.h>
 #include "qlogging.h"
 
 Q_GLOBAL_STATIC(QLibCameraManager, singletonInstance);
@@ -69,6 +75,8 @@ QLibCameraManager::QLibCameraManager(QObject *parent) : QObject(parent)
     QObject::connect(this, &QLibCameraManager::cameraAdded, this, [this](const QString &cameraId) {
             auto cam = new QLibCamera(this, cameraId);
             m_cameras.insert(cameraId, cam);
+            updateFilters(cam);
+            applyCameraConfig(cam, nullptr);
             Q_EMIT camerasChanged();
         }, Qt::QueuedConnection);
 
@@ -82,6 +90,13 @@ QLibCameraManager::QLibCameraManager(QObject *parent) : QObject(parent)
 
         }, Qt::QueuedConnection);
 
+    m_pipelineConfigReload.setSingleShot(true);
+    m_pipelineConfigReload.setInterval(200);
+    connect(&m_pipelineConfigReload, &QTimer::timeout, this, &QLibCameraManager::reloadPipelineConfig);
+    connect(&m_pipelineConfigWatcher, &QFileSystemWatcher::fileChanged, this, [this]() {
+        m_pipelineConfigReload.start();
+    });
+
     initManager();
 }
 
@@ -213,6 +228,328 @@ void QLibCameraManager::removeCameraFilter(AbstractVideoFilter *filter, const QS
     }
 }
 
+void QLibCameraManager::registerFilterFactory(const QString &name, FilterFactory factory)
+{
+    unregisterFilterFactory(name);
+    m_filterFactories.append({ name, std::move(factory) });
+    for (auto cam : std::as_const(m_cameras)) {
+        updateFilters(cam);
+    }
+}
+
+void QLibCameraManager::unregisterFilterFactory(const QString &name)
+{
+    for (int i = 0; i < m_filterFactories.size(); ++i) {
+        if (m_filterFactories.at(i).first == name) {
+            m_filterFactories.removeAt(i);
+            break;
+        }
+    }
+    for (auto cam : std::as_const(m_cameras)) {
+        cam->destroyFilter(name);
+    }
+}
+
+QStringList QLibCameraManager::filterFactories() const
+{
+    QStringList names;
+    for (const auto &factory : m_filterFactories) {
+        names.append(factory.first);
+    }
+    return names;
+}
+
+bool QLibCameraManager::hasFilterFactory(const QString &name) const
+{
+    for (const auto &factory : m_filterFactories) {
+        if (factory.first == name)
+            return true;
+    }
+    return false;
+}
+
+AbstractVideoFilter *QLibCameraManager::createFilter(QLibCamera *camera, const QString &name)
+{
+    for (const auto &factory : std::as_const(m_filterFactories)) {
+        if (factory.first != name)
+            continue;
+        AbstractVideoFilter *filter = factory.second(camera);
+        if (filter) {
+            filter->setObjectName(name);
+            filter->setParent(camera);
+            camera->addFilter(filter);
+        }
+        return filter;
+    }
+    return nullptr;
+}
+
+void QLibCameraManager::updateFilters(QLibCamera *camera)
+{
+    const CameraConfig *config = cameraConfig(camera);
+    if (!config || !config->filters) {
+        for (const auto &factory : std::as_const(m_filterFactories)) {
+            if (!camera->filter(factory.first))
+                createFilter(camera, factory.first);
+        }
+        return;
+    }
+
+    const QList<FilterConfig> &filters = *config->filters;
+    QStringList names;
+    for (const FilterConfig &filterConfig : filters) {
+        if (hasFilterFactory(filterConfig.factory))
+            names.append(filterConfig.factory);
+        else
+            qWarning() << "No filter factory" << filterConfig.factory << "for camera" << camera->id();
+    }
+    for (const auto &factory : std::as_const(m_filterFactories)) {
+        if (!names.contains(factory.first))
+            camera->destroyFilter(factory.first);
+    }
+
+    // the graph follows the camera filters order. Every re-add rebuilds it, so
+    // the existing filters are added again only when they are out of order
+    QStringList current;
+    const QList<AbstractVideoFilter *> cameraFilters = camera->filters();
+    for (AbstractVideoFilter *filter : cameraFilters) {
+        if (names.contains(filter->objectName()) && camera->filter(filter->objectName()) == filter)
+            current.append(filter->objectName());
+    }
+    // new filters are appended, fine as long as the existing ones come first
+    const bool reorder = names.mid(0, current.size()) != current;
+    for (const QString &name : std::as_const(names)) {
+        AbstractVideoFilter *filter = camera->filter(name);
+        if (!filter) {
+            createFilter(camera, name);
+        } else if (reorder) {
+            camera->removeFilter(filter);
+            camera->addFilter(filter);
+        }
+    }
+    for (const FilterConfig &filterConfig : filters) {
+        if (AbstractVideoFilter *filter = camera->filter(filterConfig.factory))
+            applyFilterConfig(camera, filter, filterConfig);
+    }
+}
+
+void QLibCameraManager::applyFilterConfig(QLibCamera *camera, AbstractVideoFilter *filter, const FilterConfig &config)
+{
+    if (config.active)
+        filter->setActive(*config.active);
+    if (config.maxRate)
+        filter->setMaxRate(*config.maxRate);
+    if (config.deadline)
+        filter->setDeadline(*config.deadline);
+
+    for (auto it = config.properties.begin(); it != config.properties.end(); ++it) {
+        const QMetaObject *metaObject = filter->metaObject();
+        const int index = metaObject->indexOfProperty(it.key().toUtf8().constData());
+        if (index < 0) {
+            qWarning() << "Filter" << config.factory << "has no property" << it.key();
+            continue;
+        }
+        const QMetaProperty property = metaObject->property(index);
+        QVariant value = it.value();
+        // geometry comes as [x, y, width, height] or [width, height]
+        const QVariantList list = value.toList();
+        if (property.metaType() == QMetaType::fromType<QRectF>() && list.size() == 4)
+            value = QRectF(list[0].toReal(), list[1].toReal(), list[2].toReal(), list[3].toReal());
+        else if (property.metaType() == QMetaType::fromType<QRect>() && list.size() == 4)
+            value = QRect(list[0].toInt(), list[1].toInt(), list[2].toInt(), list[3].toInt());
+        else if (property.metaType() == QMetaType::fromType<QSize>() && list.size() == 2)
+            value = QSize(list[0].toInt(), list[1].toInt());
+        if (!property.write(filter, value))
+            qWarning() << "Failed to set property" << it.key() << "of filter" << config.factory << "to" << it.value();
+    }
+
+    // dependencies between the configured filters are replaced, the ones set from code stay
+    const auto dependencies = filter->dependencies();
+    for (AbstractVideoFilter *dependency : dependencies) {
+        if (hasFilterFactory(dependency->objectName()) && camera->filter(dependency->objectName()) == dependency)
+            filter->removeDependency(dependency);
+    }
+    for (const QString &name : config.after) {
+        AbstractVideoFilter *dependency = camera->filter(name);
+        if (dependency)
+            filter->addDependency(dependency);
+        else
+            qWarning() << "Filter" << config.factory << "depends on missing filter" << name;
+    }
+}
+
+const CameraConfig *QLibCameraManager::cameraConfig(const QLibCamera *camera) const
+{
+    if (!m_pipelineConfig)
+        return nullptr;
+    return m_pipelineConfig->camera(camera->id(), camera->model());
+}
+
+void QLibCameraManager::applyCameraConfig(QLibCamera *camera, const CameraConfig *previous)
+{
+    const CameraConfig *config = cameraConfig(camera);
+    if (!config)
+        return;
+
+    if (!config->format.isEmpty())
+        camera->setPrefferedFormat(config->format);
+    if (config->resolution.isValid())
+        camera->setPrefferedResolution(config->resolution);
+    if (config->autoFormat)
+        camera->setAutoFormat(*config->autoFormat);
+    if (config->priority || (previous && previous->priority))
+        camera->setPriority(config->priority.value_or(0));
+    // values removed from the file go back to the defaults
+    if (config->bufferCount > 0 || (previous && previous->bufferCount > 0))
+        camera->setBufferCount(config->bufferCount);
+    // these two are applied to the running capture through controls
+    if (config->frameRate > 0.0 || (previous && previous->frameRate > 0.0))
+        camera->setFrameRate(config->frameRate);
+    if (!config->analysisRegion.isNull() || (previous && !previous->analysisRegion.isNull()))
+        camera->setAnalysisRegion(config->analysisRegion);
+
+    // the config only lets the roles the capture supports through
+    StreamingRoles roles;
+    for (const QString &stream : config->streams) {
+        if (stream == "viewfinder")
+            roles |= ViewFinderRole;
+    }
+
+    if (camera->isCapturing()) {
+        const bool streamChanged = !previous || previous->format != config->format
+                                   || previous->resolution != config->resolution
+                                   || previous->bufferCount != config->bufferCount
+                                   || previous->autoFormat != config->autoFormat
+                                   || previous->streams != config->streams;
+        if (!streamChanged)
+            return;
+        qInfo() << "Restarting camera" << camera->id() << "with the new stream configuration";
+        if (!config->streams.isEmpty() && roles != camera->captureRoles()) {
+            camera->stopCapture();
+            camera->startCapture(roles);
+        } else {
+            camera->restartCapture();
+        }
+    } else if (config->autostart) {
+        camera->startCapture(config->streams.isEmpty() ? StreamingRoles(ViewFinderRole) : roles);
+    }
+}
+
+void QLibCameraManager::applyExecutorConfig(const ExecutorConfig &config)
+{
+    // the workers can't be replaced under a running capture
+    QList<QLibCamera *> capturing;
+    for (auto cam : std::as_const(m_cameras)) {
+        if (cam->isCapturing())
+            capturing.append(cam);
+    }
+    QList<QLibCameraManager::StreamingRoles> roles;
+    for (auto cam : std::as_const(capturing)) {
+        roles.append(cam->captureRoles());
+        cam->stopCapture();
+    }
+
+    PipelineExecutor::instance()->configure(config.workers, config.cpus);
+    PipelineExecutor::instance()->setLocalityPreference(config.locality);
+
+    for (int i = 0; i < capturing.size(); ++i)
+        capturing.at(i)->startCapture(roles.at(i));
+}
+
+void QLibCameraManager::applyPipelineConfig(std::unique_ptr<PipelineConfig> config)
+{
+    std::unique_ptr<PipelineConfig> previous = std::move(m_pipelineConfig);
+    m_pipelineConfig = std::move(config);
+
+    if (m_pipelineConfig->framePool)
+        setFramePoolEnabled(*m_pipelineConfig->framePool);
+    if (m_pipelineConfig->executor && (!previous || previous->executor != m_pipelineConfig->executor))
+        applyExecutorConfig(*m_pipelineConfig->executor);
+
+    for (auto cam : std::as_const(m_cameras)) {
+        updateFilters(cam);
+        applyCameraConfig(cam, previous ? previous->camera(cam->id(), cam->model()) : nullptr);
+    }
+    Q_EMIT pipelineConfigChanged();
+}
+
+bool QLibCameraManager::loadPipelineConfig(const QString &fileName)
+{
+    QString error;
+    std::optional<PipelineConfig> config = PipelineConfig::load(fileName, &error);
+    if (!config) {
+        qWarning() << "Failed to load pipeline configuration" << fileName << ":" << error;
+        return false;
+    }
+
+    if (!m_pipelineConfigFile.isEmpty())
+        m_pipelineConfigWatcher.removePath(m_pipelineConfigFile);
+    m_pipelineConfigFile = QFileInfo(fileName).absoluteFilePath();
+    m_pipelineConfigWatcher.addPath(m_pipelineConfigFile);
+
+    qInfo() << "Loaded pipeline configuration" << m_pipelineConfigFile;
+    applyPipelineConfig(std::make_unique<PipelineConfig>(std::move(*config)));
+    return true;
+}
+
+void QLibCameraManager::reloadPipelineConfig()
+{
+    // files replaced by a rename drop out of the watcher
+    if (!m_pipelineConfigWatcher.files().contains(m_pipelineConfigFile)) {
+        if (!m_pipelineConfigWatcher.addPath(m_pipelineConfigFile)) {
+            qWarning() << "Pipeline configuration" << m_pipelineConfigFile << "is gone, keeping the current one";
+            return;
+        }
+    }
+
+    QString error;
+    std::optional<PipelineConfig> config = PipelineConfig::load(m_pipelineConfigFile, &error);
+    if (!config) {
+        qWarning() << "Keeping the current pipeline configuration," << m_pipelineConfigFile << "is invalid:" << error;
+        return;
+    }
+    qInfo() << "Reloaded pipeline configuration" << m_pipelineConfigFile;
+    applyPipelineConfig(std::make_unique<PipelineConfig>(std::move(*config)));
+}
+
+QString QLibCameraManager::pipelineConfigFile() const
+{
+    return m_pipelineConfigFile;
+}
+
+bool QLibCameraManager::framePoolEnabled() const
+{
+    return FramePool::instance()->isEnabled();
+}
+
+void QLibCameraManager::setFramePoolEnabled(bool enabled)
+{
+    if (FramePool::instance()->isEnabled() == enabled)
+        return;
+    FramePool::instance()->setEnabled(enabled);
+    Q_EMIT framePoolEnabledChanged();
+}
+
+qint64 QLibCameraManager::pinnedMemory() const
+{
+    return qint64(FramePool::instance()->pinnedBytes());
+}
+
+QVariantList QLibCameraManager::pipelineWorkersStatistics() const
+{
+    QVariantList result;
+    const auto statistics = PipelineExecutor::instance()->statistics();
+    for (const PipelineExecutor::WorkerStatistics &worker : statistics) {
+        result.append(QVariantMap {
+            { "cpu", worker.cpu },
+            { "queueDepth", worker.queueDepth },
+            { "executed", worker.executed },
+            { "stolen", worker.stolen },
+        });
+    }
+    return result;
+}
+
 QLibCamera *QLibCameraManager::camera(const QString &cameraId) const
 {
     return m_cameras.value(cameraId, nullptr);
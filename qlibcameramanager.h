@@ -12,14 +12,23 @@
 #include <libcamera/request.h>
 #include <libcamera/stream.h>
 
+#include <QFileSystemWatcher>
 #include <QMutex>
 #include <QQmlEngine>
+#include <QTimer>
+
+#include <functional>
+#include <memory>
 #include <QQueue>
 #include <QVideoSink>
 
 class QEventLoop;
 class QLibCamera;
 class AbstractVideoFilter;
+struct CameraConfig;
+struct ExecutorConfig;
+struct FilterConfig;
+struct PipelineConfig;
 
 using namespace libcamera;
 
@@ -28,6 +37,8 @@ class QLibCameraManager : public QObject
     Q_OBJECT
     Q_PROPERTY(QList<QLibCamera*> cameras READ cameras NOTIFY camerasChanged)
     Q_PROPERTY(QStringList camerasModels READ camerasModels NOTIFY camerasChanged)
+    Q_PROPERTY(bool framePoolEnabled READ framePoolEnabled WRITE setFramePoolEnabled NOTIFY framePoolEnabledChanged)
+    Q_PROPERTY(QString pipelineConfigFile READ pipelineConfigFile NOTIFY pipelineConfigChanged)
 
 public:
 
@@ -40,6 +51,8 @@ public:
     Q_DECLARE_FLAGS(StreamingRoles, StreamingRole)
     Q_FLAG(StreamingRoles)
 
+    using FilterFactory = std::function<AbstractVideoFilter *(QLibCamera *camera)>;
+
     QLibCameraManager(QObject* parent = nullptr);
     virtual ~QLibCameraManager();
 
@@ -51,16 +64,40 @@ public:
     QList<QLibCamera*> cameras() const;
     QStringList camerasModels() const;
 
-    // add or remove for all registered cameras or camera with ginen id
+    // add or remove for all registered cameras or camera with ginen id.
+    // The same filter object is called from all the cameras threads, it has to be thread safe
     void addCameraFilter(AbstractVideoFilter *filter, const QString& cameraId = QString());
     void removeCameraFilter(AbstractVideoFilter *filter, const QString& cameraId = QString());
 
+    // every camera, including the ones plugged in later, gets its own filter
+    // created by the factory, named after the factory. Filters run in the
+    // order their factories were registered, unless the pipeline configuration
+    // lists the filters of the camera
+    void registerFilterFactory(const QString &name, FilterFactory factory);
+    void unregisterFilterFactory(const QString &name);
+    QStringList filterFactories() const;
+
     static const QMap<libcamera::PixelFormat, QVideoFrameFormat::PixelFormat> nativeFormats;
     static libcamera::PixelFormat toLibCameraFormat(QVideoFrameFormat::PixelFormat format);
     static QVideoFrameFormat::PixelFormat toQtFormat(libcamera::PixelFormat format);
 
     void finishManager();
 
+    // huge pages backed, locked and prefaulted frame and conversion buffers
+    bool framePoolEnabled() const;
+    void setFramePoolEnabled(bool enabled);
+    Q_INVOKABLE qint64 pinnedMemory() const;
+
+    // queue depth, executed and stolen tasks of every pipeline worker
+    Q_INVOKABLE QVariantList pipelineWorkersStatistics() const;
+
+    // loads the pipeline configuration (pipelineconfig.h) and applies it to
+    // the cameras, the executor and the filters. The file is watched and
+    // reloaded when it changes, an invalid file leaves the current
+    // configuration in place. Register the filter factories first
+    bool loadPipelineConfig(const QString &fileName);
+    QString pipelineConfigFile() const;
+
 public Q_SLOTS:
     QLibCamera* camera(const QString &cameraId) const;
     int startCapture(const QString& cameraId, const QLibCameraManager::StreamingRoles &roles, QVideoFrameFormat::PixelFormat prefferedFormat = QVideoFrameFormat::Format_Invalid);
@@ -70,6 +107,8 @@ Q_SIGNALS:
     void cameraAdded(const QString &cameraId);
     void cameraRemoved(const QString &cameraId);
     void camerasChanged();
+    void framePoolEnabledChanged();
+    void pipelineConfigChanged();
 
 protected:
   void initManager();
@@ -77,10 +116,25 @@ protected:
 private:
   void addCamera(std::shared_ptr<libcamera::Camera> camera);
   void removeCamera(std::shared_ptr<libcamera::Camera> camera);
+  void updateFilters(QLibCamera *camera);
+  bool hasFilterFactory(const QString &name) const;
+  AbstractVideoFilter *createFilter(QLibCamera *camera, const QString &name);
+  void applyFilterConfig(QLibCamera *camera, AbstractVideoFilter *filter, const FilterConfig &config);
+  void applyCameraConfig(QLibCamera *camera, const CameraConfig *previous);
+  void applyExecutorConfig(const ExecutorConfig &config);
+  void applyPipelineConfig(std::unique_ptr<PipelineConfig> config);
+  void reloadPipelineConfig();
+  const CameraConfig *cameraConfig(const QLibCamera *camera) const;
 
 private:
   libcamera::CameraManager *m_cameraManager = nullptr;
   QMap<QString, QLibCamera*> m_cameras;
+  QList<QPair<QString, FilterFactory>> m_filterFactories;
+  std::unique_ptr<PipelineConfig> m_pipelineConfig;
+  QString m_pipelineConfigFile;
+  QFileSystemWatcher m_pipelineConfigWatcher;
+  // editors write files in several steps, reload once they are done
+  QTimer m_pipelineConfigReload;
   bool m_initialized = false;
 };
 
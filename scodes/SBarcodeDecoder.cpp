@@ -104,38 +104,69 @@ std::ostream& operator << (std::ostream& os, const std::vector<ZXing::ResultPoin
 }
 
 SBarcodeDecoder::SBarcodeDecoder(QObject *parent) : QObject(parent)
-{ }
+{
+    m_pinnedCaptured = &m_captured.latest();
+}
 
 void SBarcodeDecoder::clean()
 {
-    m_captured = "";
+    m_captured.publish(QString());
+    QMetaObject::invokeMethod(this, &SBarcodeDecoder::deliverCaptured, Qt::QueuedConnection);
 }
 
 QString SBarcodeDecoder::captured() const
 {
-    return m_captured;
+    return m_pinnedCaptured->value;
+}
+
+quint64 SBarcodeDecoder::capturedSequence() const
+{
+    return m_captured.publishedSequence();
 }
 
 void SBarcodeDecoder::setCaptured(const QString &captured)
 {
-    if (m_captured == captured) {
-        return;
-    }
+    const bool changed = m_captured.publish([&captured](QString &next, const QString &current) {
+        if (current == captured) {
+            return false;
+        }
+        next = captured;
+        return true;
+    });
 
-    m_captured = captured;
+    if (changed) {
+        QMetaObject::invokeMethod(this, &SBarcodeDecoder::deliverCaptured, Qt::QueuedConnection);
+    }
+}
 
-    Q_EMIT capturedChanged(m_captured);
+void SBarcodeDecoder::deliverCaptured()
+{
+    const quint64 sequence = m_pinnedCaptured->sequence;
+    m_pinnedCaptured = &m_captured.latest();
+    if (m_pinnedCaptured->sequence != sequence) {
+        Q_EMIT capturedChanged(m_pinnedCaptured->value);
+    }
 }
 
 void SBarcodeDecoder::setIsDecoding(bool isDecoding)
 {
-    if (m_isDecoding == isDecoding) {
+    if (m_isDecoding.exchange(isDecoding) == isDecoding) {
         return;
     }
 
-    m_isDecoding = isDecoding;
+    QMetaObject::invokeMethod(this, &SBarcodeDecoder::deliverIsDecoding, Qt::QueuedConnection);
+}
+
+void SBarcodeDecoder::deliverIsDecoding()
+{
+    // a decode may start and finish before the GUI thread gets here
+    const bool isDecoding = m_isDecoding;
+    if (isDecoding == m_deliveredIsDecoding) {
+        return;
+    }
 
-    Q_EMIT isDecodingChanged(m_isDecoding);
+    m_deliveredIsDecoding = isDecoding;
+    Q_EMIT isDecodingChanged(isDecoding);
 }
 
 bool SBarcodeDecoder::  isDecoding() const
@@ -143,10 +174,10 @@ bool SBarcodeDecoder::  isDecoding() const
     return m_isDecoding;
 }
 
-void SBarcodeDecoder::process(const QImage& capturedImage, ZXing::BarcodeFormats formats)
+bool SBarcodeDecoder::process(const QImage& capturedImage, ZXing::BarcodeFormats formats)
 {
     // This will set the "isDecoding" to false automatically
-    auto decodeGuard = qScopeGuard([=](){setIsDecoding(false);});
+    auto decodeGuard = qScopeGuard([this](){setIsDecoding(false);});
     SCODES_MEASURE(time);
     setIsDecoding(true);
 
@@ -162,11 +193,13 @@ void SBarcodeDecoder::process(const QImage& capturedImage, ZXing::BarcodeFormats
 
         if (result.isValid()) {
             setCaptured(result.text());
+            return true;
         }
     }
     catch(std::exception& e) {
         Q_EMIT errorOccured("ZXing exception: " + QString::fromLocal8Bit(e.what()));
     }
+    return false;
 }
 
 QImage SBarcodeDecoder::videoFrameToImage(const QVideoFrame &videoFrame, const QRect &captureRect) const
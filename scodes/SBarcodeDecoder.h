@@ -9,6 +9,10 @@
 
 #include "SBarcodeFormat.h"
 
+#include <common/snapshotbuffer.h>
+
+#include <atomic>
+
 // Default camera resolution width/height
 #define DEFAULT_RES_W 1080
 #define DEFAULT_RES_H 1920
@@ -42,10 +46,16 @@ public:
 
     /*!
      * \fn QString captured() const
-     * \brief Returns the captured barcode string.
+     * \brief Returns the captured barcode string last delivered to the thread of the decoder.
      */
     QString captured() const;
 
+    /*!
+     * \fn quint64 capturedSequence() const
+     * \brief Returns the sequence number of the latest published barcode string, from any thread.
+     */
+    quint64 capturedSequence() const;
+
     /*!
      * \fn static QImage videoFrameToImage(QVideoFrame &videoFrame, const QRect &captureRect)
      * \brief Returns image from video frame.
@@ -65,12 +75,13 @@ public:
 
 public Q_SLOTS:
     /*!
-     * \fn void process(const QImage capturedImage, ZXing::BarcodeFormats formats)
+     * \fn bool process(const QImage capturedImage, ZXing::BarcodeFormats formats)
      * \brief Processes the image to scan the given barcode format types.
      * \param const QImage capturedImage - captured image.
      * \param ZXing::BarcodeFormats formats - barcode formats.
+     * \return true if a barcode was decoded.
      */
-    void process(const QImage& capturedImage, ZXing::BarcodeFormats formats);
+    bool process(const QImage& capturedImage, ZXing::BarcodeFormats formats);
 
 Q_SIGNALS:
     /*!
@@ -87,16 +98,31 @@ Q_SIGNALS:
 
     void errorOccured(const QString& errorString);
 
+private Q_SLOTS:
+    /*!
+     * \fn void deliverCaptured()
+     * \brief Picks up the latest published barcode string.
+     */
+    void deliverCaptured();
+
+    /*!
+     * \fn void deliverIsDecoding()
+     * \brief Signals the decoding state changed by the decoding threads.
+     */
+    void deliverIsDecoding();
+
 private:
     /*!
      * \brief Indicates the decoding state
      */
-    bool m_isDecoding = false;
+    std::atomic<bool> m_isDecoding { false };
+    bool m_deliveredIsDecoding = false;
 
     /*!
-     * \brief Captured string from barcode
+     * \brief Captured string from barcode, published by the decoding threads
      */
-    QString m_captured = "";
+    SnapshotBuffer<QString> m_captured;
+    const SnapshotBuffer<QString>::Snapshot *m_pinnedCaptured = nullptr;
     QSize m_resolution;
 
     /*!
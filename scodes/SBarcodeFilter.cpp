@@ -6,6 +6,9 @@
 #include "SBarcodeDecoder.h"
 #include "private/debug.h"
 
+#include <common/imageops.h>
+#include <common/latencyhistogram.h>
+
 void processImage(SBarcodeDecoder *decoder, const QImage &image, ZXing::BarcodeFormats formats)
 {
     decoder->process(image, formats);
@@ -15,6 +18,8 @@ SBarcodeFilter::SBarcodeFilter(QObject *parent)
     : AbstractVideoFilter{parent},
     m_decoder{new SBarcodeDecoder}
 {
+    m_pinnedStatistics = &m_statistics.latest();
+
     connect(m_decoder, &SBarcodeDecoder::capturedChanged, this, &SBarcodeFilter::setCaptured);
 
     connect(this, &AbstractVideoFilter::activeChanged, this, [this](){
@@ -24,12 +29,179 @@ SBarcodeFilter::SBarcodeFilter(QObject *parent)
     });
 }
 
-QVideoFrame SBarcodeFilter::run(QVideoFrame* input)
+FrameRequirements SBarcodeFilter::requirements() const
+{
+    return { QImage::Format_ARGB32, QSize(), captureRect().toRect() };
+}
+
+QVideoFrame SBarcodeFilter::run(VideoFilterFrame *input)
 {
-    const QImage croppedCapturedImage = getDecoder()->videoFrameToImage(*input, captureRect().toRect());
-    m_decoder->process(croppedCapturedImage, SCodes::toZXingFormat(format()));
+    // ZXing with tryHarder spends most of its time on blurred frames it can't
+    // decode anyway: only the sharpest frame of every scan window is decoded,
+    // if it is sharp enough compared to the recent frames
+    const QRect frameRect(QPoint(0, 0), input->size());
+    const QRect captureArea = captureRect().toRect();
+    QRect region = captureArea.isNull() ? frameRect : captureArea & frameRect;
+
+    // only the part of the capture area an analysis filter upstream found changed
+    const QList<QRect> regionsOfInterest = input->regionsOfInterest();
+    if (!regionsOfInterest.isEmpty()) {
+        QRect changed;
+        for (const QRect &roi : regionsOfInterest)
+            changed |= roi;
+        region &= changed;
+    }
+    const FrameRequirements decoderInput { QImage::Format_ARGB32, QSize(), region };
+
+    const qreal sharpness = region.isEmpty() ? -1.0 : measureSharpness(input, region);
+    const qreal threshold = std::max(m_minimumSharpness.load(), m_sharpnessRatio.load() * m_averageSharpness);
+    m_totals.frames++;
+
+    if (region.isEmpty()) {
+        // nothing changed in the capture area
+    } else if (sharpness < 0.0) {
+        // unknown, decode it as before
+        m_bestImage = input->image(decoderInput);
+        m_bestSharpness = 0.0;
+    } else {
+        m_averageSharpness = m_averageSharpness > 0.0 ? m_averageSharpness + (sharpness - m_averageSharpness) / 16
+                                                      : sharpness;
+        if (sharpness < threshold) {
+            m_totals.blurred++;
+        } else if (sharpness > m_bestSharpness) {
+            m_bestImage = input->image(decoderInput);
+            m_bestSharpness = sharpness;
+        }
+    }
+
+    if (++m_windowFrames >= m_scanWindow.load()) {
+        if (!m_bestImage.isNull()) {
+            m_totals.scans++;
+            if (m_decoder->process(m_bestImage, SCodes::toZXingFormat(format())))
+                m_totals.decoded++;
+        }
+        m_windowFrames = 0;
+        m_bestSharpness = -1.0;
+        m_bestImage = QImage();
+    }
+
+    publishStatistics(sharpness, threshold);
+    return input->videoFrame();
+}
+
+qreal SBarcodeFilter::measureSharpness(const VideoFilterFrame *input, const QRect &region)
+{
+    if (region.width() < 3 || region.height() < 3)
+        return -1.0;
+
+    int pixelStride = 1;
+    int offset = 0;
+    QVideoFrame frame = input->videoFrame();
+    if (ImageOps::lumaLayout(frame.pixelFormat(), &pixelStride, &offset) && frame.map(QVideoFrame::ReadOnly)) {
+        const int bytesPerLine = frame.bytesPerLine(0);
+        const uint8_t *origin = frame.bits(0) + size_t(region.y()) * bytesPerLine + size_t(region.x()) * pixelStride;
+        qreal sharpness = 0.0;
+        if (pixelStride == 1) {
+            sharpness = ImageOps::laplacianVariance(origin, bytesPerLine, region.width(), region.height());
+        } else {
+            // packed formats, the luma bytes are gathered first
+            m_luma.resize(size_t(region.width()) * region.height());
+            ImageOps::downsampleLuma(origin, bytesPerLine, region.width(), region.height(), pixelStride, offset, 1,
+                                     m_luma.data(), region.width());
+            sharpness = ImageOps::laplacianVariance(m_luma.data(), region.width(), region.width(), region.height());
+        }
+        frame.unmap();
+        return sharpness;
+    }
+
+    // e.g. MJPEG
+    const QImage luma = input->image({ QImage::Format_Grayscale8, QSize(), region });
+    if (luma.isNull())
+        return -1.0;
+    return ImageOps::laplacianVariance(luma.constBits(), int(luma.bytesPerLine()), luma.width(), luma.height());
+}
+
+void SBarcodeFilter::publishStatistics(qreal sharpness, qreal threshold)
+{
+    const qint64 now = LatencyHistogram::now();
+    if (m_statisticsSince == 0)
+        m_statisticsSince = now;
+    const qint64 elapsed = now - m_statisticsSince;
+    if (elapsed < 1000000000)
+        return;
+
+    const qreal seconds = elapsed / 1e9;
+    const quint64 scans = m_totals.scans - m_lastTotals.scans;
+    const quint64 decoded = m_totals.decoded - m_lastTotals.decoded;
+    const QVariantMap statistics {
+        { "sharpness", sharpness },
+        { "threshold", threshold },
+        { "averageSharpness", m_averageSharpness },
+        { "framesPerSecond", (m_totals.frames - m_lastTotals.frames) / seconds },
+        { "blurredPerSecond", (m_totals.blurred - m_lastTotals.blurred) / seconds },
+        { "scansPerSecond", scans / seconds },
+        { "decodeSuccess", scans ? qreal(decoded) / scans : 0.0 },
+        { "frames", m_totals.frames },
+        { "blurred", m_totals.blurred },
+        { "scans", m_totals.scans },
+        { "decoded", m_totals.decoded },
+    };
+    m_lastTotals = m_totals;
+    m_statisticsSince = now;
+
+    m_statistics.publish(statistics);
+    QMetaObject::invokeMethod(this, &SBarcodeFilter::deliverStatistics, Qt::QueuedConnection);
+}
+
+void SBarcodeFilter::deliverStatistics()
+{
+    const quint64 sequence = m_pinnedStatistics->sequence;
+    m_pinnedStatistics = &m_statistics.latest();
+    if (m_pinnedStatistics->sequence != sequence)
+        Q_EMIT scanStatisticsChanged();
+}
+
+qreal SBarcodeFilter::minimumSharpness() const
+{
+    return m_minimumSharpness;
+}
+
+void SBarcodeFilter::setMinimumSharpness(qreal sharpness)
+{
+    if (m_minimumSharpness.exchange(sharpness) == sharpness) {
+        return;
+    }
+
+    Q_EMIT sharpnessGateChanged();
+}
+
+qreal SBarcodeFilter::sharpnessRatio() const
+{
+    return m_sharpnessRatio;
+}
+
+void SBarcodeFilter::setSharpnessRatio(qreal ratio)
+{
+    if (m_sharpnessRatio.exchange(ratio) == ratio) {
+        return;
+    }
+
+    Q_EMIT sharpnessGateChanged();
+}
+
+int SBarcodeFilter::scanWindow() const
+{
+    return m_scanWindow;
+}
+
+void SBarcodeFilter::setScanWindow(int frames)
+{
+    frames = std::max(frames, 1);
+    if (m_scanWindow.exchange(frames) == frames) {
+        return;
+    }
 
-    return *input;
+    Q_EMIT sharpnessGateChanged();
 }
 
 
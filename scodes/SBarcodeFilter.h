@@ -5,6 +5,11 @@
 #include <QtConcurrent/QtConcurrent>
 #include <qqml.h>
 
+#include <common/snapshotbuffer.h>
+
+#include <atomic>
+#include <vector>
+
 #include "SBarcodeDecoder.h"
 #include "SBarcodeFormat.h"
 
@@ -17,6 +22,10 @@ class SBarcodeFilter : public AbstractVideoFilter
     Q_PROPERTY(QString captured READ captured NOTIFY capturedChanged)
     Q_PROPERTY(QRectF captureRect READ captureRect WRITE setCaptureRect NOTIFY captureRectChanged)
     Q_PROPERTY(SCodes::SBarcodeFormats format READ format WRITE setFormat NOTIFY formatChanged)
+    Q_PROPERTY(qreal minimumSharpness READ minimumSharpness WRITE setMinimumSharpness NOTIFY sharpnessGateChanged)
+    Q_PROPERTY(qreal sharpnessRatio READ sharpnessRatio WRITE setSharpnessRatio NOTIFY sharpnessGateChanged)
+    Q_PROPERTY(int scanWindow READ scanWindow WRITE setScanWindow NOTIFY sharpnessGateChanged)
+    Q_PROPERTY(QVariantMap scanStatistics READ scanStatistics NOTIFY scanStatisticsChanged)
 
 public:
 
@@ -71,6 +80,58 @@ public:
      */
     void setFormat(const SCodes::SBarcodeFormats &format);
 
+    /*!
+     * \fn qreal minimumSharpness() const
+     * \brief Returns the focus measure (variance of the Laplacian of the luma) below which frames are never decoded.
+     */
+    qreal minimumSharpness() const;
+
+    /*!
+     * \fn void setMinimumSharpness(qreal sharpness)
+     * \brief Sets the fixed part of the sharpness threshold, 0 - none.
+     * \param qreal sharpness - variance of the Laplacian.
+     */
+    void setMinimumSharpness(qreal sharpness);
+
+    /*!
+     * \fn qreal sharpnessRatio() const
+     * \brief Returns the adaptive part of the sharpness threshold, a fraction of the recent average sharpness.
+     */
+    qreal sharpnessRatio() const;
+
+    /*!
+     * \fn void setSharpnessRatio(qreal ratio)
+     * \brief Sets the adaptive part of the sharpness threshold, 0 - none.
+     * \param qreal ratio - fraction of the recent average sharpness a frame needs to reach.
+     */
+    void setSharpnessRatio(qreal ratio);
+
+    /*!
+     * \fn int scanWindow() const
+     * \brief Returns the number of frames out of which only the sharpest one is decoded.
+     */
+    int scanWindow() const;
+
+    /*!
+     * \fn void setScanWindow(int frames)
+     * \brief Sets the number of frames out of which only the sharpest one is decoded, 1 - every sharp enough frame.
+     * \param int frames - window size.
+     */
+    void setScanWindow(int frames);
+
+    /*!
+     * \fn QVariantMap scanStatistics() const
+     * \brief Returns the sharpness gate and decoder statistics, refreshed every second: sharpness, threshold,
+     * frame, blurred frame, scan and decode rates per second, decode success ratio and the totals.
+     */
+    QVariantMap scanStatistics() const { return m_pinnedStatistics->value; }
+
+    /*!
+     * \fn FrameRequirements requirements() const override
+     * \brief Returns the decoder input: ARGB32 image of the capture area.
+     */
+    FrameRequirements requirements() const override;
+
 Q_SIGNALS:
 
     /*!
@@ -91,8 +152,18 @@ Q_SIGNALS:
      */
     void formatChanged(const SCodes::SBarcodeFormats &format);
 
+    /*!
+     * \brief This signal is emitted when the sharpness threshold or the scan window changes.
+     */
+    void sharpnessGateChanged();
+
+    /*!
+     * \brief This signal is emitted when new scan statistics are available.
+     */
+    void scanStatisticsChanged();
+
 protected:
-    QVideoFrame run(QVideoFrame *input) override;
+    QVideoFrame run(VideoFilterFrame *input) override;
 
 private Q_SLOTS:
 
@@ -109,12 +180,55 @@ private Q_SLOTS:
      */
     void clean();
 
+    /*!
+     * \fn void deliverStatistics()
+     * \brief Picks up the latest published scan statistics.
+     */
+    void deliverStatistics();
+
 private:
+    /*!
+     * \fn qreal measureSharpness(const VideoFilterFrame *input, const QRect &region)
+     * \brief Returns the variance of the Laplacian of the luma in the region, -1 if the frame can't be read.
+     */
+    qreal measureSharpness(const VideoFilterFrame *input, const QRect &region);
+
+    /*!
+     * \fn void publishStatistics(qreal sharpness, qreal threshold)
+     * \brief Publishes the statistics of the last second.
+     */
+    void publishStatistics(qreal sharpness, qreal threshold);
+
     QString m_captured = "";
     QRectF m_captureRect;
     SBarcodeDecoder *m_decoder = nullptr;
     //QFuture<void> _imageFuture;
     SCodes::SBarcodeFormats m_format = SCodes::SBarcodeFormat::Basic;
+
+    std::atomic<qreal> m_minimumSharpness { 0.0 };
+    std::atomic<qreal> m_sharpnessRatio { 0.6 };
+    std::atomic<int> m_scanWindow { 3 };
+
+    /*!
+     * \brief Sharpness gate state, pipeline thread only
+     */
+    std::vector<uint8_t> m_luma;
+    qreal m_averageSharpness = 0.0;
+    int m_windowFrames = 0;
+    qreal m_bestSharpness = -1.0;
+    QImage m_bestImage;
+
+    struct Counters {
+        quint64 frames = 0;
+        quint64 blurred = 0;
+        quint64 scans = 0;
+        quint64 decoded = 0;
+    };
+    Counters m_totals;
+    Counters m_lastTotals;
+    qint64 m_statisticsSince = 0;
+    SnapshotBuffer<QVariantMap> m_statistics;
+    const SnapshotBuffer<QVariantMap>::Snapshot *m_pinnedStatistics = nullptr;
 };
 
 #endif // QRSCANNERFILTER_H
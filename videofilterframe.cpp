@@ -0,0 +1,224 @@
+#include "videofilterframe.h"
+
+#include <QDebug>
+#include <QPainter>
+
+#include <common/framepool.h>
+#include <common/imageops.h>
+#include <common/latencyhistogram.h>
+#include <common/tiles.h>
+
+namespace {
+thread_local LatencyHistogram *t_conversionHistogram = nullptr;
+thread_local int t_conversionDepth = 0;
+
+// formats QPainter can convert to in place
+bool isPaintableFormat(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB888:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return true;
+    default:
+        return false;
+    }
+}
+}
+
+size_t qHash(const FrameRequirements &key, size_t seed)
+{
+    return qHashMulti(seed, int(key.format), key.maxSize.width(), key.maxSize.height(),
+                      key.roi.x(), key.roi.y(), key.roi.width(), key.roi.height());
+}
+
+VideoFilterFrame::VideoFilterFrame(const QVideoFrame &frame) : m_frame{frame} {}
+
+VideoFilterFrame::~VideoFilterFrame() = default;
+
+void VideoFilterFrame::setConversionHistogram(LatencyHistogram *histogram)
+{
+    t_conversionHistogram = histogram;
+}
+
+QImage VideoFilterFrame::image(const FrameRequirements &requirements) const
+{
+    FrameRequirements key = requirements;
+    // normalize the key, so equal requests share one cache entry
+    const QRect frameRect(QPoint(0, 0), size());
+    if (!key.roi.isNull()) {
+        key.roi = key.roi.intersected(frameRect);
+        if (key.roi == frameRect)
+            key.roi = QRect();
+    }
+    const QSize sourceSize = key.roi.isNull() ? frameRect.size() : key.roi.size();
+    if (key.maxSize.isValid() && sourceSize.width() <= key.maxSize.width()
+        && sourceSize.height() <= key.maxSize.height()) {
+        key.maxSize = QSize();
+    }
+
+    std::shared_ptr<Conversion> conversion;
+    {
+        QMutexLocker locker(&m_mutex);
+        auto &entry = m_conversions[key];
+        if (!entry)
+            entry = std::make_shared<Conversion>();
+        conversion = entry;
+    }
+
+    // concurrent callers of the same conversion wait for the first one
+    std::call_once(conversion->done, [this, &key, &conversion]() {
+        // nested conversion steps are part of the outer one
+        if (!t_conversionHistogram || t_conversionDepth > 0) {
+            conversion->image = convert(key);
+            return;
+        }
+        const qint64 start = LatencyHistogram::now();
+        t_conversionDepth++;
+        conversion->image = convert(key);
+        t_conversionDepth--;
+        t_conversionHistogram->record(LatencyHistogram::now() - start);
+    });
+    return conversion->image;
+}
+
+QImage VideoFilterFrame::convert(const FrameRequirements &key) const
+{
+    // every step reuses the previous one from the cache: format <- scale <- crop <- frame
+    if (key.format != QImage::Format_Invalid) {
+        const QImage source = image({QImage::Format_Invalid, key.maxSize, key.roi});
+        if (source.isNull() || source.format() == key.format)
+            return source;
+        if (FramePool::instance()->isEnabled() && isPaintableFormat(key.format)) {
+            // convert straight into a prefaulted pool buffer, large frames in
+            // strips across the workers. Palette formats can't be cut in strips
+            QImage converted = FramePool::instance()->image(source.size(), key.format);
+            const Tiles::Layout layout { source.colorCount() ? source.size() : QSize(),
+                                         (source.depth() + converted.depth()) / 8 };
+            const QList<Tiles::Tile> tiles = Tiles::split(source.rect(), layout);
+            uchar *const bits = converted.bits();
+            Tiles::run(tiles, [&](const Tiles::Tile &tile) {
+                const QRect &rect = tile.rect;
+                QImage strip(bits + rect.top() * converted.bytesPerLine(), rect.width(), rect.height(),
+                             converted.bytesPerLine(), converted.format());
+                QPainter painter(&strip);
+                painter.setCompositionMode(QPainter::CompositionMode_Source);
+                if (tiles.size() == 1) {
+                    painter.drawImage(0, 0, source);
+                } else {
+                    painter.drawImage(0, 0, QImage(source.constBits() + rect.top() * source.bytesPerLine(), rect.width(),
+                                                   rect.height(), source.bytesPerLine(), source.format()));
+                }
+            });
+            return converted;
+        }
+        return source.convertToFormat(key.format);
+    }
+
+    if (key.maxSize.isValid()) {
+        const QImage source = image({QImage::Format_Invalid, QSize(), key.roi});
+        return source.scaled(key.maxSize, Qt::KeepAspectRatio, Qt::FastTransformation);
+    }
+
+    if (!key.roi.isNull()) {
+        const QImage source = image({});
+        return source.copy(key.roi);
+    }
+
+    // The CPU / GPU buffer check is done internally by QVideoFrame
+    const QImage frameImage = m_frame.toImage();
+    if (frameImage.isNull())
+        qWarning() << "Failed to convert video frame" << m_frame.surfaceFormat().pixelFormat();
+    return frameImage;
+}
+
+QSize VideoFilterFrame::downscaledLuma(int factor, std::vector<uint8_t> *plane) const
+{
+    int pixelStride = 1;
+    int offset = 0;
+    QVideoFrame frame = m_frame;
+    const bool direct = ImageOps::lumaLayout(frame.pixelFormat(), &pixelStride, &offset);
+
+    QImage luma;
+    const uint8_t *bits = nullptr;
+    int bytesPerLine = 0;
+    if (direct && frame.map(QVideoFrame::ReadOnly)) {
+        bits = frame.bits(0);
+        bytesPerLine = frame.bytesPerLine(0);
+    } else {
+        // e.g. MJPEG, decoded once for all the filters asking for it
+        luma = image({ QImage::Format_Grayscale8, QSize(), QRect() });
+        if (luma.isNull())
+            return QSize();
+        bits = luma.constBits();
+        bytesPerLine = int(luma.bytesPerLine());
+        pixelStride = 1;
+        offset = 0;
+    }
+
+    const QSize size = luma.isNull() ? frame.size() : luma.size();
+    const QSize planeSize(size.width() / factor, size.height() / factor);
+    plane->resize(size_t(planeSize.width()) * planeSize.height());
+    ImageOps::downsampleLuma(bits, bytesPerLine, size.width(), size.height(), pixelStride, offset, factor,
+                             plane->data(), planeSize.width());
+
+    if (frame.isMapped())
+        frame.unmap();
+    return planeSize;
+}
+
+QList<QRect> VideoFilterFrame::regionsOfInterest() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_regionsOfInterest;
+}
+
+void VideoFilterFrame::setRegionsOfInterest(const QList<QRect> &regions)
+{
+    QMutexLocker locker(&m_mutex);
+    m_regionsOfInterest = regions;
+}
+
+QVariant VideoFilterFrame::annotation(const QByteArray &key) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_annotations.value(key);
+}
+
+void VideoFilterFrame::setAnnotation(const QByteArray &key, const QVariant &value)
+{
+    QMutexLocker locker(&m_mutex);
+    m_annotations.insert(key, value);
+}
+
+void VideoFilterFrame::copyAnnotations(const VideoFilterFrame &other)
+{
+    QList<QRect> regions;
+    QHash<QByteArray, QVariant> annotations;
+    {
+        QMutexLocker locker(&other.m_mutex);
+        regions = other.m_regionsOfInterest;
+        annotations = other.m_annotations;
+    }
+    QMutexLocker locker(&m_mutex);
+    m_regionsOfInterest = regions;
+    m_annotations = annotations;
+}
+
+QPointF VideoFilterFrame::mapToFullFrame(const QPointF &point) const
+{
+    const QSize frameSize = size();
+    if (frameSize.isEmpty())
+        return point;
+    return QPointF((m_sourceRegion.x() + point.x() / frameSize.width() * m_sourceRegion.width()) * frameSize.width(),
+                   (m_sourceRegion.y() + point.y() / frameSize.height() * m_sourceRegion.height()) * frameSize.height());
+}
+
+QRectF VideoFilterFrame::mapToFullFrame(const QRectF &rect) const
+{
+    return QRectF(mapToFullFrame(rect.topLeft()), mapToFullFrame(rect.bottomRight()));
+}
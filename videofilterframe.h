@@ -0,0 +1,103 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <QRectF>
+#include <QSize>
+#include <QVariant>
+#include <QVideoFrame>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class LatencyHistogram;
+
+/*
+ * Input a filter wants to work on. Filters declare it through
+ * AbstractVideoFilter::requirements() and fetch the converted image from
+ * VideoFilterFrame::image(), so identical conversions are done once per frame
+ * no matter how many filters ask for them.
+ */
+struct FrameRequirements
+{
+    // QImage::Format_Invalid keeps the format QVideoFrame::toImage() produces
+    QImage::Format format = QImage::Format_Invalid;
+    // image is scaled down, keeping aspect ratio, to fit; invalid - no scaling
+    QSize maxSize;
+    // region of the frame in frame coordinates; null - whole frame
+    QRect roi;
+
+    bool operator==(const FrameRequirements &other) const
+    {
+        return format == other.format && maxSize == other.maxSize && roi == other.roi;
+    }
+    bool operator!=(const FrameRequirements &other) const { return !(*this == other); }
+};
+
+size_t qHash(const FrameRequirements &key, size_t seed = 0);
+
+/*
+ * Frame handed to the filters chain. Wraps the captured QVideoFrame and caches
+ * every conversion requested by filters. The cached images are shared
+ * read-only between filters and released together with the frame, i.e. when
+ * the last filter holding it finishes.
+ */
+class VideoFilterFrame
+{
+public:
+    explicit VideoFilterFrame(const QVideoFrame &frame);
+    ~VideoFilterFrame();
+
+    const QVideoFrame &videoFrame() const { return m_frame; }
+    QSize size() const { return m_frame.size(); }
+
+    QImage image(const FrameRequirements &requirements) const;
+
+    // luma plane scaled down by factor into plane, straight from the frame data
+    // when the format has one. Returns the plane size, empty on failure
+    QSize downscaledLuma(int factor, std::vector<uint8_t> *plane) const;
+
+    // normalized part of the sensor field of view the frame covers, when it
+    // was cropped on the ISP side with the ScalerCrop control
+    QRectF sourceRegion() const { return m_sourceRegion; }
+    void setSourceRegion(const QRectF &region) { m_sourceRegion = region; }
+    // number of the frame since the graph started
+    quint64 sequence() const { return m_sequence; }
+    void setSequence(quint64 sequence) { m_sequence = sequence; }
+    // parts of the frame that changed, set by an analysis filter for the
+    // filters depending on it, in frame coordinates. Empty for the whole frame
+    QList<QRect> regionsOfInterest() const;
+    void setRegionsOfInterest(const QList<QRect> &regions);
+    // what filters found out about the frame, for the filters running after them
+    QVariant annotation(const QByteArray &key) const;
+    void setAnnotation(const QByteArray &key, const QVariant &value);
+    // carries the regions and annotations over to the frame a processing filter produced
+    void copyAnnotations(const VideoFilterFrame &other);
+    // maps frame coordinates to the coordinates of an uncropped frame of the same size
+    QRectF mapToFullFrame(const QRectF &rect) const;
+    QPointF mapToFullFrame(const QPointF &point) const;
+
+    // conversions done from now on by the calling thread are timed into the histogram
+    static void setConversionHistogram(LatencyHistogram *histogram);
+
+private:
+    Q_DISABLE_COPY(VideoFilterFrame)
+
+    struct Conversion {
+        std::once_flag done;
+        QImage image;
+    };
+
+    QImage convert(const FrameRequirements &requirements) const;
+
+    QVideoFrame m_frame;
+    QRectF m_sourceRegion { 0.0, 0.0, 1.0, 1.0 };
+    quint64 m_sequence = 0;
+    mutable QMutex m_mutex;
+    mutable QHash<FrameRequirements, std::shared_ptr<Conversion>> m_conversions;
+    QList<QRect> m_regionsOfInterest;
+    QHash<QByteArray, QVariant> m_annotations;
+};
@@ -0,0 +1,570 @@
+#include "videofiltergraph.h"
+#include "abstractvideofilter.h"
+#include "videofilterframe.h"
+
+#include <QDebug>
+
+#include <common/pipelineexecutor.h>
+
+namespace {
+// frames a node with several dependencies keeps waiting for the slower ones
+constexpr quint64 kMaxPendingJoins = 8;
+// deadline of filters without a deadline and a rate cap
+constexpr qint64 kDefaultDeadline = 100'000'000;
+}
+
+VideoFilterGraph::VideoFilterGraph() = default;
+
+VideoFilterGraph::~VideoFilterGraph()
+{
+    waitForDone();
+}
+
+void VideoFilterGraph::setFilters(const QList<AbstractVideoFilter *> &filters)
+{
+    QMutexLocker locker(&m_mutex);
+    // counters and execution state survive the rebuild, the removed filters lose theirs
+    QHash<AbstractVideoFilter *, std::shared_ptr<Counters>> counters;
+    QHash<AbstractVideoFilter *, std::shared_ptr<Execution>> executions;
+    for (AbstractVideoFilter *filter : filters) {
+        std::shared_ptr<Counters> filterCounters = m_counters.value(filter);
+        if (!filterCounters)
+            filterCounters = std::make_shared<Counters>();
+        counters.insert(filter, filterCounters);
+        std::shared_ptr<Execution> execution = m_executions.value(filter);
+        if (!execution)
+            execution = std::make_shared<Execution>();
+        executions.insert(filter, execution);
+    }
+    m_counters = std::move(counters);
+    m_executions = std::move(executions);
+    m_filters = filters;
+    m_topology = buildTopology(filters);
+}
+
+void VideoFilterGraph::setFinishedCallback(FinishedCallback callback)
+{
+    QMutexLocker locker(&m_mutex);
+    m_finishedCallback = std::move(callback);
+}
+
+void VideoFilterGraph::setOutputCallback(OutputCallback callback)
+{
+    QMutexLocker locker(&m_mutex);
+    m_outputCallback = std::move(callback);
+}
+
+void VideoFilterGraph::setLocalityHint(int hint)
+{
+    m_localityHint = hint;
+}
+
+void VideoFilterGraph::setBudget(std::shared_ptr<PipelineScheduler::Budget> budget)
+{
+    m_budget = std::move(budget);
+}
+
+qint64 VideoFilterGraph::deadlineOf(const AbstractVideoFilter *filter)
+{
+    if (filter->deadline() > 0)
+        return qint64(filter->deadline()) * 1'000'000;
+    // a rate capped filter is due when it would take the next frame
+    if (filter->maxRate() > 0.0)
+        return qint64(1e9 / filter->maxRate());
+    return kDefaultDeadline;
+}
+
+bool VideoFilterGraph::hasOutput() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_topology && m_topology->outputNode >= 0;
+}
+
+std::shared_ptr<VideoFilterGraph::Topology> VideoFilterGraph::buildTopology(const QList<AbstractVideoFilter *> &filters)
+{
+    auto topology = std::make_shared<Topology>();
+    std::vector<std::unique_ptr<Node>> &nodes = topology->nodes;
+    const int count = int(filters.size());
+
+    QHash<AbstractVideoFilter *, int> indexes;
+    for (int i = 0; i < count; ++i) {
+        indexes.insert(filters.at(i), i);
+        nodes.push_back(std::make_unique<Node>());
+        nodes[i]->filter = filters.at(i);
+        nodes[i]->counters = m_counters.value(filters.at(i));
+        nodes[i]->execution = m_executions.value(filters.at(i));
+    }
+
+    std::vector<QList<int>> dependencies(count);
+    int lastProcessing = -1;
+    for (int i = 0; i < count; ++i) {
+        AbstractVideoFilter *filter = filters.at(i);
+
+        // processing filters keep the order they were added in
+        if (lastProcessing >= 0)
+            dependencies[i].append(lastProcessing);
+        const auto explicitDependencies = filter->dependencies();
+        for (AbstractVideoFilter *dependency : explicitDependencies) {
+            const int index = indexes.value(dependency, -1);
+            if (index >= 0 && index != i && !dependencies[i].contains(index))
+                dependencies[i].append(index);
+        }
+        if (filter->kind() == AbstractVideoFilter::ProcessingFilter)
+            lastProcessing = i;
+    }
+    topology->outputNode = lastProcessing;
+
+    for (int i = 0; i < count; ++i) {
+        nodes[i]->dependencyCount = int(dependencies[i].size());
+        for (int dependency : std::as_const(dependencies[i]))
+            nodes[dependency]->dependents.append(i);
+    }
+
+    // check for cycles
+    std::vector<int> remaining(count);
+    QList<int> ready;
+    for (int i = 0; i < count; ++i) {
+        remaining[i] = nodes[i]->dependencyCount;
+        if (remaining[i] == 0)
+            ready.append(i);
+    }
+    int sorted = 0;
+    while (!ready.isEmpty()) {
+        const int i = ready.takeFirst();
+        ++sorted;
+        for (int dependent : std::as_const(nodes[i]->dependents)) {
+            if (--remaining[dependent] == 0)
+                ready.append(dependent);
+        }
+    }
+
+    if (sorted != count) {
+        qWarning() << "Video filters dependencies have a cycle, running them one after another";
+        for (int i = 0; i < count; ++i) {
+            nodes[i]->dependents.clear();
+            nodes[i]->dependencyCount = i > 0 ? 1 : 0;
+            if (i > 0)
+                nodes[i - 1]->dependents.append(i);
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i]->dependencyCount == 0)
+            topology->roots.append(i);
+        if (nodes[i]->dependents.isEmpty())
+            topology->leafCount++;
+    }
+    return topology;
+}
+
+void VideoFilterGraph::post(const QVideoFrame &frame, const QRectF &sourceRegion)
+{
+    std::shared_ptr<Topology> topology;
+    {
+        QMutexLocker locker(&m_mutex);
+        topology = m_topology;
+    }
+    if (!topology || topology->nodes.empty())
+        return;
+
+    Message message;
+    message.sequence = ++m_sequence;
+    message.postedAt = LatencyHistogram::now();
+    // conversions cached in the filter frame are shared by all filters and
+    // released when the last one is done with the frame
+    message.frame = std::make_shared<VideoFilterFrame>(frame);
+    message.frame->setSourceRegion(sourceRegion);
+    message.frame->setSequence(message.sequence);
+
+    for (int root : std::as_const(topology->roots))
+        deliver(topology, root, message);
+}
+
+void VideoFilterGraph::deliver(const std::shared_ptr<Topology> &topology, int index, Message message)
+{
+    Node &node = *topology->nodes[index];
+    Execution &execution = *node.execution;
+    bool active = node.filter->isActive();
+    // a throttled processing filter would pass the raw frame on to the output
+    const qreal maxRate = node.filter->kind() == AbstractVideoFilter::AnalysisFilter ? node.filter->maxRate() : 0.0;
+    qint64 deadline = 0;
+    {
+        QMutexLocker locker(&execution.mutex);
+        if (node.dependencyCount > 1) {
+            Join &join = node.joins[message.sequence];
+            join.received++;
+            // the latest transformed frame among the dependencies
+            const bool gated = join.input.gated || message.gated;
+            if (!join.input.frame || message.producer > join.input.producer)
+                join.input = message;
+            join.input.gated = gated;
+            if (join.received < node.dependencyCount) {
+                // a dependency busy with other frames never completes the old ones
+                while (!node.joins.empty() && node.joins.begin()->first + kMaxPendingJoins < message.sequence) {
+                    node.joins.erase(node.joins.begin());
+                    node.counters->dropped++;
+                }
+                return;
+            }
+            message = std::move(join.input);
+            const auto end = node.joins.upper_bound(message.sequence);
+            for (auto it = node.joins.begin(); it != end; ++it) {
+                if (it->first != message.sequence)
+                    node.counters->dropped++;
+            }
+            node.joins.erase(node.joins.begin(), end);
+        }
+
+        // a deactivated gate lets everything through
+        if (!active)
+            execution.gateOpen = true;
+
+        if (active && message.gated && node.filter->kind() == AbstractVideoFilter::AnalysisFilter) {
+            node.counters->gated++;
+            active = false;
+        }
+
+        if (active && maxRate > 0.0) {
+            const qint64 interval = qint64(1e9 / maxRate);
+            if (execution.lastAcceptedAt && message.postedAt - execution.lastAcceptedAt < interval) {
+                node.counters->throttled++;
+                applyLastGate(execution, &message);
+                active = false;
+            } else {
+                execution.lastAcceptedAt = message.postedAt;
+            }
+        }
+
+        // the other frames are left to the filters of the cameras ahead
+        if (active && m_budget && node.filter->kind() == AbstractVideoFilter::AnalysisFilter) {
+            const int divisor = m_budget->analysisDivisor();
+            if (divisor > 1 && message.sequence % divisor != 0) {
+                node.counters->shed++;
+                applyLastGate(execution, &message);
+                active = false;
+            }
+        }
+
+        if (active) {
+            message.queuedAt = LatencyHistogram::now();
+            deadline = message.postedAt + deadlineOf(node.filter);
+            const bool busy = node.filter->isAsync() ? execution.inFlight >= node.filter->maxFramesInFlight()
+                                                     : execution.running;
+            if (busy) {
+                // latest frame wins
+                if (execution.mailbox)
+                    node.counters->dropped++;
+                execution.mailbox = Pending { topology, index, std::move(message) };
+                return;
+            }
+            if (node.filter->isAsync()) {
+                execution.inFlight++;
+            } else {
+                execution.mailbox = Pending { topology, index, std::move(message) };
+                execution.running = true;
+            }
+        }
+    }
+
+    // inactive, gated and throttled filters pass the frame through
+    if (!active) {
+        forward(topology, index, message);
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_tasksMutex);
+        m_runningTasks++;
+    }
+    if (node.filter->isAsync())
+        submit(topology, index, std::move(message), deadline);
+    else
+        submit(topology, index, std::nullopt, deadline);
+}
+
+void VideoFilterGraph::submit(const std::shared_ptr<Topology> &topology, int index, std::optional<Message> message,
+                              qint64 deadline)
+{
+    if (message) {
+        PipelineExecutor::instance()->submit([this, topology, index, message = std::move(*message)]() {
+            startAsync(topology, index, message);
+        }, m_localityHint, deadline);
+        return;
+    }
+    PipelineExecutor::instance()->submit([this, execution = topology->nodes[index]->execution]() {
+        execute(execution);
+        taskFinished();
+    }, m_localityHint, deadline);
+}
+
+void VideoFilterGraph::recordDeadline(const Node &node, const Message &message)
+{
+    const bool met = LatencyHistogram::now() <= message.postedAt + deadlineOf(node.filter);
+    if (!met)
+        node.counters->late++;
+    if (m_budget)
+        m_budget->recordDeadline(met);
+}
+
+void VideoFilterGraph::execute(const std::shared_ptr<Execution> &execution)
+{
+    for (;;) {
+        Pending pending;
+        {
+            QMutexLocker locker(&execution->mutex);
+            if (!execution->mailbox) {
+                execution->running = false;
+                return;
+            }
+            pending = std::move(*execution->mailbox);
+            execution->mailbox.reset();
+        }
+        // the frame goes on through the graph it was delivered in
+        const std::shared_ptr<Topology> &topology = pending.topology;
+        const int index = pending.index;
+        Message &message = pending.message;
+        const Node &node = *topology->nodes[index];
+
+        const qint64 start = LatencyHistogram::now();
+        node.counters->queueWait.record(start - message.queuedAt);
+        VideoFilterFrame::setConversionHistogram(&node.counters->conversionTime);
+        const QVideoFrame result = node.filter->run(message.frame.get());
+        VideoFilterFrame::setConversionHistogram(nullptr);
+        const qint64 runTime = LatencyHistogram::now() - start;
+        node.counters->runTime.record(runTime);
+        node.counters->processed++;
+        if (m_budget)
+            m_budget->recordWork(runTime);
+        recordDeadline(node, message);
+
+        completeFrame(node, index, &message, result);
+        forward(topology, index, message);
+    }
+}
+
+void VideoFilterGraph::completeFrame(const Node &node, int index, Message *message, const QVideoFrame &result)
+{
+    const bool gateOpen = node.filter->isGateOpen(message->frame.get());
+    if (!gateOpen)
+        message->gated = true;
+    {
+        QMutexLocker locker(&node.execution->mutex);
+        node.execution->gateOpen = gateOpen;
+    }
+
+    if (node.filter->kind() == AbstractVideoFilter::ProcessingFilter && result != message->frame->videoFrame()) {
+        auto output = std::make_shared<VideoFilterFrame>(result);
+        output->setSourceRegion(message->frame->sourceRegion());
+        output->setSequence(message->sequence);
+        output->copyAnnotations(*message->frame);
+        message->frame = std::move(output);
+        message->producer = index;
+    }
+}
+
+void VideoFilterGraph::applyLastGate(const Execution &execution, Message *message)
+{
+    if (!execution.gateOpen)
+        message->gated = true;
+}
+
+void VideoFilterGraph::startAsync(const std::shared_ptr<Topology> &topology, int index, Message message)
+{
+    Node &node = *topology->nodes[index];
+    const qint64 start = LatencyHistogram::now();
+    node.counters->queueWait.record(start - message.queuedAt);
+
+    const std::shared_ptr<VideoFilterFrame> input = message.frame;
+    // only the conversions done before the filter first waits are timed
+    VideoFilterFrame::setConversionHistogram(&node.counters->conversionTime);
+    node.filter->runAsync(input, [this, topology, index, message = std::move(message), start](const QVideoFrame &result) {
+        finishAsync(topology, index, message, start, result);
+    });
+    VideoFilterFrame::setConversionHistogram(nullptr);
+    // the worker is busy until the filter first waits, accelerator time isn't counted
+    if (m_budget)
+        m_budget->recordWork(LatencyHistogram::now() - start);
+}
+
+void VideoFilterGraph::finishAsync(const std::shared_ptr<Topology> &topology, int index, Message message,
+                                   qint64 start, const QVideoFrame &result)
+{
+    Node &node = *topology->nodes[index];
+    node.counters->runTime.record(LatencyHistogram::now() - start);
+    node.counters->processed++;
+    recordDeadline(node, message);
+
+    completeFrame(node, index, &message, result);
+    forward(topology, index, message);
+
+    std::optional<Pending> next;
+    {
+        QMutexLocker locker(&node.execution->mutex);
+        if (node.execution->mailbox) {
+            next = std::move(node.execution->mailbox);
+            node.execution->mailbox.reset();
+        } else {
+            node.execution->inFlight--;
+        }
+    }
+    // a new task, the filter may have completed the frame inline
+    if (next) {
+        const qint64 deadline = next->message.postedAt + deadlineOf(node.filter);
+        submit(next->topology, next->index, std::move(next->message), deadline);
+    } else {
+        taskFinished();
+    }
+}
+
+void VideoFilterGraph::forward(const std::shared_ptr<Topology> &topology, int index, const Message &message)
+{
+    const Node &node = *topology->nodes[index];
+    if (index == topology->outputNode) {
+        quint64 last = topology->lastOutput.load();
+        bool newer = false;
+        while (message.sequence > last) {
+            if (topology->lastOutput.compare_exchange_weak(last, message.sequence)) {
+                newer = true;
+                break;
+            }
+        }
+        OutputCallback callback;
+        if (newer) {
+            QMutexLocker locker(&m_mutex);
+            callback = m_outputCallback;
+        }
+        if (callback)
+            callback(message.frame->videoFrame());
+    }
+
+    if (node.dependents.isEmpty()) {
+        if (!leaveGraph(*topology, message.sequence))
+            return;
+        m_frameLatency.record(LatencyHistogram::now() - message.postedAt);
+        FinishedCallback callback;
+        {
+            QMutexLocker locker(&m_mutex);
+            callback = m_finishedCallback;
+        }
+        if (callback)
+            callback();
+        return;
+    }
+    for (int dependent : node.dependents)
+        deliver(topology, dependent, message);
+}
+
+bool VideoFilterGraph::leaveGraph(Topology &topology, quint64 sequence)
+{
+    if (topology.leafCount <= 1)
+        return true;
+
+    QMutexLocker locker(&topology.leavesMutex);
+    auto it = topology.pendingLeaves.try_emplace(sequence, topology.leafCount).first;
+    if (--it->second > 0)
+        return false;
+    // older frames a leaf dropped never finish
+    topology.pendingLeaves.erase(topology.pendingLeaves.begin(), std::next(it));
+    return true;
+}
+
+void VideoFilterGraph::taskFinished()
+{
+    QMutexLocker locker(&m_tasksMutex);
+    if (--m_runningTasks == 0)
+        m_tasksDone.wakeAll();
+}
+
+void VideoFilterGraph::waitForDone()
+{
+    std::shared_ptr<Topology> topology;
+    QList<std::shared_ptr<Execution>> executions;
+    {
+        QMutexLocker locker(&m_mutex);
+        topology = m_topology;
+        executions = m_executions.values();
+    }
+    for (const std::shared_ptr<Execution> &execution : std::as_const(executions)) {
+        QMutexLocker locker(&execution->mutex);
+        execution->mailbox.reset();
+    }
+    if (topology) {
+        for (const std::unique_ptr<Node> &node : topology->nodes) {
+            QMutexLocker locker(&node->execution->mutex);
+            node->joins.clear();
+        }
+        QMutexLocker locker(&topology->leavesMutex);
+        topology->pendingLeaves.clear();
+    }
+
+    QMutexLocker locker(&m_tasksMutex);
+    while (m_runningTasks > 0)
+        m_tasksDone.wait(&m_tasksMutex);
+}
+
+quint64 VideoFilterGraph::processedFrames(AbstractVideoFilter *filter) const
+{
+    QMutexLocker locker(&m_mutex);
+    const std::shared_ptr<Counters> counters = m_counters.value(filter);
+    return counters ? counters->processed.load() : 0;
+}
+
+quint64 VideoFilterGraph::droppedFrames(AbstractVideoFilter *filter) const
+{
+    QMutexLocker locker(&m_mutex);
+    const std::shared_ptr<Counters> counters = m_counters.value(filter);
+    return counters ? counters->dropped.load() : 0;
+}
+
+quint64 VideoFilterGraph::throttledFrames(AbstractVideoFilter *filter) const
+{
+    QMutexLocker locker(&m_mutex);
+    const std::shared_ptr<Counters> counters = m_counters.value(filter);
+    return counters ? counters->throttled.load() : 0;
+}
+
+QList<VideoFilterGraph::FilterStatistics> VideoFilterGraph::statistics() const
+{
+    QMutexLocker locker(&m_mutex);
+    QList<FilterStatistics> result;
+    for (AbstractVideoFilter *filter : m_filters) {
+        const std::shared_ptr<Counters> counters = m_counters.value(filter);
+        if (!counters)
+            continue;
+        FilterStatistics statistics;
+        statistics.filter = filter;
+        statistics.processed = counters->processed.load();
+        statistics.dropped = counters->dropped.load();
+        statistics.throttled = counters->throttled.load();
+        statistics.gated = counters->gated.load();
+        statistics.shed = counters->shed.load();
+        statistics.late = counters->late.load();
+        statistics.queueWait = counters->queueWait.snapshot();
+        statistics.runTime = counters->runTime.snapshot();
+        statistics.conversionTime = counters->conversionTime.snapshot();
+        result.append(statistics);
+    }
+    return result;
+}
+
+LatencyHistogram::Snapshot VideoFilterGraph::frameLatency() const
+{
+    return m_frameLatency.snapshot();
+}
+
+void VideoFilterGraph::resetStatistics()
+{
+    QMutexLocker locker(&m_mutex);
+    for (const std::shared_ptr<Counters> &counters : std::as_const(m_counters)) {
+        counters->processed = 0;
+        counters->dropped = 0;
+        counters->throttled = 0;
+        counters->gated = 0;
+        counters->shed = 0;
+        counters->late = 0;
+        counters->queueWait.reset();
+        counters->runTime.reset();
+        counters->conversionTime.reset();
+    }
+    m_frameLatency.reset();
+}
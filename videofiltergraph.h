@@ -0,0 +1,209 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QRectF>
+#include <QVideoFrame>
+#include <QWaitCondition>
+
+#include <common/latencyhistogram.h>
+#include <common/pipelinescheduler.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+class AbstractVideoFilter;
+class VideoFilterFrame;
+
+/*
+ * Runs the filters of a camera as a dependency graph. Analysis filters read
+ * the same shared frame and run in parallel, processing filters run ahead of
+ * the filters depending on them, which get the transformed frame.
+ *
+ * Every filter owns a single slot mailbox and runs at its own pace: a frame
+ * arriving while the filter is busy replaces the one waiting in the mailbox,
+ * which is counted as dropped for that filter only. Filters run on the
+ * PipelineExecutor workers. Asynchronous filters take several frames at once,
+ * up to AbstractVideoFilter::maxFramesInFlight(), before frames wait in the
+ * mailbox.
+ *
+ * Filter tasks carry the frame deadline (AbstractVideoFilter::deadline()), the
+ * executor runs the most urgent ones first across cameras. With a budget set
+ * the graph reports its work and deadlines to the PipelineScheduler and skips
+ * analysis filters on the frames the scheduler sheds.
+ */
+class VideoFilterGraph
+{
+public:
+    struct FilterStatistics {
+        AbstractVideoFilter *filter = nullptr;
+        quint64 processed = 0;
+        quint64 dropped = 0;
+        // frames passed through untouched because of the filter rate cap
+        quint64 throttled = 0;
+        // frames passed through untouched because a gate upstream was closed
+        quint64 gated = 0;
+        // frames passed through untouched to shed load, see PipelineScheduler
+        quint64 shed = 0;
+        // frames the filter finished after its deadline
+        quint64 late = 0;
+        // from the frame landing in the mailbox to the filter taking it
+        LatencyHistogram::Snapshot queueWait;
+        // AbstractVideoFilter::run(), conversions included. For asynchronous
+        // filters until the frame is done, waiting for the accelerator included
+        LatencyHistogram::Snapshot runTime;
+        // VideoFilterFrame::image() conversions done on behalf of the filter
+        LatencyHistogram::Snapshot conversionTime;
+    };
+
+    using FinishedCallback = std::function<void()>;
+    using OutputCallback = std::function<void(const QVideoFrame &frame)>;
+
+    VideoFilterGraph();
+    ~VideoFilterGraph();
+
+    void setFilters(const QList<AbstractVideoFilter *> &filters);
+    // called from a pool thread once per frame, when it left all the last filters
+    void setFinishedCallback(FinishedCallback callback);
+    // called with the output of the last processing filter, in capture order
+    void setOutputCallback(OutputCallback callback);
+    // filters of graphs with the same hint prefer the same pipeline worker
+    void setLocalityHint(int hint);
+    // budget of the camera, set before posting frames
+    void setBudget(std::shared_ptr<PipelineScheduler::Budget> budget);
+
+    // whether the frames shown should come from the output callback. With a
+    // processing filter every frame leaves through it, inactive ones pass the
+    // frame through untouched
+    bool hasOutput() const;
+
+    // hands the frame over to the filters, doesn't wait for them
+    void post(const QVideoFrame &frame, const QRectF &sourceRegion);
+    // drops frames waiting in the mailboxes and waits for running filters
+    void waitForDone();
+
+    quint64 processedFrames(AbstractVideoFilter *filter) const;
+    quint64 droppedFrames(AbstractVideoFilter *filter) const;
+    quint64 throttledFrames(AbstractVideoFilter *filter) const;
+
+    QList<FilterStatistics> statistics() const;
+    // from posting the frame to it leaving the graph through all the last filters
+    LatencyHistogram::Snapshot frameLatency() const;
+    void resetStatistics();
+
+private:
+    Q_DISABLE_COPY(VideoFilterGraph)
+
+    struct Counters {
+        std::atomic<quint64> processed { 0 };
+        std::atomic<quint64> dropped { 0 };
+        std::atomic<quint64> throttled { 0 };
+        std::atomic<quint64> gated { 0 };
+        std::atomic<quint64> shed { 0 };
+        std::atomic<quint64> late { 0 };
+        LatencyHistogram queueWait;
+        LatencyHistogram runTime;
+        LatencyHistogram conversionTime;
+    };
+    struct Message {
+        quint64 sequence = 0;
+        qint64 postedAt = 0;
+        qint64 queuedAt = 0;
+        std::shared_ptr<VideoFilterFrame> frame;
+        // node which transformed the frame, -1 for the captured frame
+        int producer = -1;
+        // a gate filter upstream closed for this frame. Only analysis filters
+        // skip gated frames, processing filters transform them anyway, the
+        // output never shows an untouched frame because of a gate
+        bool gated = false;
+    };
+    struct Join {
+        int received = 0;
+        Message input;
+    };
+    struct Topology;
+    // frame waiting for a busy filter, with the graph it goes on through
+    struct Pending {
+        std::shared_ptr<Topology> topology;
+        int index = -1;
+        Message message;
+    };
+    // kept per filter across rebuilds of the topology, a filter busy with a
+    // frame of the old graph isn't started again by the new one
+    struct Execution {
+        QMutex mutex;
+        std::optional<Pending> mailbox;
+        bool running = false;
+        // frames inside an asynchronous filter
+        int inFlight = 0;
+        // posting time of the last frame taken, for the rate cap
+        qint64 lastAcceptedAt = 0;
+        // decision of a gate filter on the last frame it ran, applied to the
+        // frames it is throttled or shed on
+        bool gateOpen = true;
+    };
+    struct Node {
+        AbstractVideoFilter *filter = nullptr;
+        QList<int> dependents;
+        int dependencyCount = 0;
+        std::shared_ptr<Counters> counters;
+        std::shared_ptr<Execution> execution;
+
+        // frames waiting for the rest of the dependencies, guarded by the execution mutex
+        std::map<quint64, Join> joins;
+    };
+    struct Topology {
+        std::vector<std::unique_ptr<Node>> nodes;
+        QList<int> roots;
+        // last processing filter, its output leaves the graph
+        int outputNode = -1;
+        // asynchronous filters may finish frames out of order, older ones aren't output
+        std::atomic<quint64> lastOutput { 0 };
+        // nodes without dependents, a frame is finished once it left all of them
+        int leafCount = 0;
+        QMutex leavesMutex;
+        // leaves each frame still has to leave
+        std::map<quint64, int> pendingLeaves;
+    };
+
+    std::shared_ptr<Topology> buildTopology(const QList<AbstractVideoFilter *> &filters);
+    void deliver(const std::shared_ptr<Topology> &topology, int index, Message message);
+    void forward(const std::shared_ptr<Topology> &topology, int index, const Message &message);
+    // true once the frame left the last of the leaves
+    static bool leaveGraph(Topology &topology, quint64 sequence);
+    void execute(const std::shared_ptr<Execution> &execution);
+    // applies the gate and the output of the filter to the message going on
+    static void completeFrame(const Node &node, int index, Message *message, const QVideoFrame &result);
+    // the filter is skipped for the frame, its last gate decision still holds
+    static void applyLastGate(const Execution &execution, Message *message);
+    void startAsync(const std::shared_ptr<Topology> &topology, int index, Message message);
+    void finishAsync(const std::shared_ptr<Topology> &topology, int index, Message message,
+                     qint64 start, const QVideoFrame &result);
+    void submit(const std::shared_ptr<Topology> &topology, int index, std::optional<Message> message,
+                qint64 deadline);
+    // time the filter has for a frame, ns
+    static qint64 deadlineOf(const AbstractVideoFilter *filter);
+    void recordDeadline(const Node &node, const Message &message);
+    void taskFinished();
+
+    mutable QMutex m_mutex;
+    std::shared_ptr<Topology> m_topology;
+    QHash<AbstractVideoFilter *, std::shared_ptr<Counters>> m_counters;
+    QHash<AbstractVideoFilter *, std::shared_ptr<Execution>> m_executions;
+    QList<AbstractVideoFilter *> m_filters;
+    LatencyHistogram m_frameLatency;
+    FinishedCallback m_finishedCallback;
+    OutputCallback m_outputCallback;
+    std::atomic<quint64> m_sequence { 0 };
+    std::atomic<int> m_localityHint { -1 };
+    std::shared_ptr<PipelineScheduler::Budget> m_budget;
+
+    QMutex m_tasksMutex;
+    QWaitCondition m_tasksDone;
+    int m_runningTasks = 0;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <QSize>
+#include <QStringList>
+#include <QVariantMap>
+#include <QtPlugin>
+
+/*
+ * Interface of the video filter plugins loaded at runtime with QPluginLoader.
+ * A plugin only needs this header and Qt, it doesn't link against the
+ * application. The types below are plain data or pure interfaces, new fields
+ * are only ever appended to the structures, the size field tells which ones
+ * the other side knows about. The fields past the size of the
+ * VideoFilterPluginInfo of an older plugin keep their defaults.
+ */
+
+#define QLIBCAM_FILTER_ABI_VERSION 1
+
+/*
+ * Frame given to the plugin filter. Planes point straight into the captured
+ * frame or into the converted image cached for the frame, nothing is copied.
+ * Valid only for the duration of VideoFilterPluginInstance::process().
+ */
+struct VideoFilterFrameView
+{
+    quint32 size = sizeof(VideoFilterFrameView);
+    // QVideoFrameFormat::PixelFormat when isImage is false, QImage::Format otherwise
+    quint32 pixelFormat = 0;
+    quint32 isImage = 0;
+    qint32 width = 0;
+    qint32 height = 0;
+    qint32 planeCount = 0;
+    uchar *planes[4] = {};
+    qint32 bytesPerLine[4] = {};
+    // frame number since the capture started and its start time in microseconds
+    quint64 sequence = 0;
+    qint64 timestamp = 0;
+    // normalized part of the sensor field of view the frame covers: x, y, width, height
+    double sourceRegion[4] = { 0.0, 0.0, 1.0, 1.0 };
+};
+
+struct VideoFilterPluginInfo
+{
+    enum Kind : quint32 {
+        Analysis,
+        // writes a transformed frame into the output view, needs the captured
+        // frame as input: plugins with an inputFormat aren't loaded
+        Processing,
+    };
+    enum ThreadingModel : quint32 {
+        // process() may run concurrently, e.g. for several cameras
+        Reentrant,
+        // process() calls of an instance are serialized by the application
+        NonReentrant,
+    };
+
+    quint32 size = sizeof(VideoFilterPluginInfo);
+    quint32 abiVersion = QLIBCAM_FILTER_ABI_VERSION;
+    Kind kind = Analysis;
+    ThreadingModel threading = NonReentrant;
+    // QImage::Format the plugin wants, 0 (Format_Invalid) for the captured frame as is
+    quint32 inputFormat = 0;
+    // input is scaled down to fit, invalid for the full size
+    QSize maxSize;
+};
+
+class VideoFilterPluginInstance
+{
+public:
+    virtual ~VideoFilterPluginInstance() = default;
+
+    virtual void setParameters(const QVariantMap &parameters) { Q_UNUSED(parameters) }
+    /*
+     * Called from the pipeline threads. Processing filters get an output view of
+     * the same format and size as the input and return true when they wrote it.
+     */
+    virtual bool process(const VideoFilterFrameView &input, VideoFilterFrameView *output) = 0;
+    /*
+     * Latest results, published to QML by the application. Called right after
+     * process() on the same thread, under the same lock for NonReentrant
+     * plugins. Reentrant plugins guard their results on their own.
+     */
+    virtual QVariantMap results() const { return {}; }
+};
+
+class VideoFilterPlugin
+{
+public:
+    virtual ~VideoFilterPlugin() = default;
+
+    virtual QStringList keys() const = 0;
+    virtual VideoFilterPluginInfo info(const QString &key) const = 0;
+    virtual VideoFilterPluginInstance *create(const QString &key) = 0;
+};
+
+#define VideoFilterPlugin_iid "org.qlibcam.VideoFilterPlugin/1.0"
+Q_DECLARE_INTERFACE(VideoFilterPlugin, VideoFilterPlugin_iid)